@@ -0,0 +1,312 @@
+/* An emulated Jupiter Ace, put together from the CPU and peripherals
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ * --------------------------------------------------------------------------
+ *
+ * All of the state of a machine is held in its Ace structure, including
+ * its scheduler, keyboard, spooler and tape, so that several machines can
+ * be run in one process.  Only the read-only flag tables of the CPU are
+ * shared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "z80.h"
+#include "ace.h"
+#include "primitives.h"
+
+/* Raised every frame to give the Ace its interrupt */
+static void
+ace_frame_event(void *context)
+{
+  Ace *ace = context;
+
+  if (ace->interrupted == 0) ace->interrupted = 1;
+  if (ace->frame_handler) ace->frame_handler(ace);
+}
+
+static void
+ace_spooler_event(void *context)
+{
+  Ace *ace = context;
+  spooler_read(&ace->spooler);
+}
+
+/* Added by ace_step() for the end of the step */
+static void
+ace_stop_event(void *context)
+{
+  Ace *ace = context;
+  ace->stop = 1;
+}
+
+static void
+ace_spooler_observer(void *context, SpoolerMessage message)
+{
+  Ace *ace = context;
+  if (ace->spooler_handler) ace->spooler_handler(ace, message);
+}
+
+static void
+ace_clear_keyboard(void *context)
+{
+  Ace *ace = context;
+  keyboard_clear(&ace->keyboard);
+}
+
+static void
+ace_keypress(void *context, KeySym ks, int key_state)
+{
+  Ace *ace = context;
+  keyboard_keypress(&ace->keyboard, ks, key_state);
+}
+
+/* The ROM's keyboard routine, called by the interrupt, sets KEYCOD to
+ * the key that it sees held and counts KEYCNT down from 0x20 while it is
+ * held.  The key is taken when KEYCNT reaches 0x1e if a line is being
+ * entered, otherwise it is thrown away.  A different key is ignored
+ * until the ROM has seen no key held. */
+static SpoolerKeyState
+ace_spooler_key_state(void *context)
+{
+  Ace *ace = context;
+
+  if (ace->mem[ACE_KEYCOD] != 0) {
+    if (ace->mem[ACE_KEYCNT] <= ACE_KEY_TAKEN_COUNT)
+      return SPOOLER_KEY_TAKEN;
+    return SPOOLER_KEY_HELD;
+  }
+  if (!(ace->mem[ACE_STATIN] & ACE_STATIN_INPUT))
+    return SPOOLER_KEY_BUSY;
+  return SPOOLER_KEY_WAITING;
+}
+
+static unsigned short
+ace_peek2(Ace *ace, unsigned short address)
+{
+  return ace->mem[address] | (ace->mem[address+1] << 8);
+}
+
+/* Return the code that typing c would put in the input buffer, 0 if
+ * typing it does nothing, or -1 if it doesn't simply put a character
+ * there.  The keyboard has no backquote, and a tab is typed as a space. */
+static int
+ace_input_char(unsigned char c)
+{
+  if (c == '\t') return ' ';
+  if (c == '\r') return 0;
+  if (c == 0xa3) return 0x60;    /* Pound sign */
+  if (c < ' ' || c > '~' || c == '`') return -1;
+  return c;
+}
+
+/* The input buffer is the bottom rows of the screen, holding a 0, the
+ * line, the cursor and then spaces.  It grows upwards a row at a time as
+ * the line gets longer, the rest of the screen being scrolled up if the
+ * ROM's output would be written over.  The line can only be written in
+ * one go if the buffer is empty and the keys would be typed unchanged,
+ * otherwise it is left to be typed. */
+static int
+ace_spooler_enter_line(void *context, const char *line, int length)
+{
+  Ace *ace = context;
+  unsigned char text[ACE_INPUT_MAX_ROWS*32];
+  unsigned short l_half = ace_peek2(ace, ACE_L_HALF);
+  unsigned short cursor = ace_peek2(ace, ACE_CURSOR);
+  unsigned short scrpos = ace_peek2(ace, ACE_SCRPOS);
+  unsigned short address;
+  unsigned char cursor_glyph = ace->mem[cursor];
+  int text_length = 0, i, c;
+
+  if (ace->mem[ACE_STATIN] != ACE_STATIN_INPUT ||
+      ace_peek2(ace, ACE_INSCRN) != l_half || cursor != l_half+1 ||
+      ace_peek2(ace, ACE_ENDBUF) != cursor+1) {
+    return -1;
+  }
+
+  for (i = 0; i < length; i++) {
+    c = ace_input_char(line[i]);
+    if (c < 0 || text_length == sizeof(text)-2) return -1;
+    if (c) text[text_length++] = c;
+  }
+
+  while (l_half > ACE_VIDEO_END - (text_length+2+31)/32*32) {
+    l_half -= 32;
+    if (scrpos > l_half) {
+      for (address = ACE_VIDEO_RAM; address < l_half; address++)
+        store(address, ace->mem[address+32]);
+      scrpos -= 32;
+    }
+  }
+
+  address = l_half;
+  store(address++, 0);
+  for (i = 0; i < text_length; i++)
+    store(address++, text[i]);
+  cursor = address;
+  store(address++, cursor_glyph);
+  while (address < ACE_VIDEO_END)
+    store(address++, ' ');
+
+  store2(ACE_SCRPOS, scrpos);
+  store2(ACE_INSCRN, l_half);
+  store2(ACE_CURSOR, cursor);
+  store2(ACE_ENDBUF, cursor+1);
+  store2(ACE_L_HALF, l_half);
+  return 0;
+}
+
+Ace *
+ace_create(const unsigned char rom[ACE_ROM_SIZE])
+{
+  Ace *ace;
+  int page;
+
+  ace = calloc(1, sizeof(Ace));
+  if (!ace) return NULL;
+  z80_init();
+
+  for (page = 0; page < 8; page++) {
+    ace->memptr[page] = ace->mem + page*0x2000;
+    ace->memattr[page] = MEM_RAM;
+  }
+  ace->memattr[0] = MEM_ROM;
+  ace->memattr[1] = MEM_MIRRORED;
+
+  memcpy(ace->mem, rom, ACE_ROM_SIZE);
+  tape_patches((char *)ace->mem);
+  memset(ace->mem+ACE_ROM_SIZE, 0xff, sizeof(ace->mem)-ACE_ROM_SIZE);
+  ace->z80.intsample = 1;
+
+  scheduler_init(&ace->scheduler);
+  keyboard_init(&ace->keyboard, NULL);
+  spooler_init(&ace->spooler, ace_spooler_observer, ace_clear_keyboard,
+               ace_keypress, ace_spooler_key_state, ace_spooler_enter_line,
+               ace);
+  tape_init(&ace->tape);
+
+  scheduler_add_event(&ace->scheduler, ACE_FRAME_TSTATES, ACE_FRAME_TSTATES,
+                      ace_frame_event, ace);
+  ace->spooler_event =
+    scheduler_add_event(&ace->scheduler, ACE_FRAME_TSTATES*ACE_SPOOLER_FRAMES,
+                        ACE_FRAME_TSTATES*ACE_SPOOLER_FRAMES,
+                        ace_spooler_event, ace);
+  return ace;
+}
+
+void
+ace_destroy(Ace *ace)
+{
+  spooler_close(&ace->spooler);
+  tape_detach(&ace->tape);
+  tape_clear_observers(&ace->tape);
+  free(ace);
+}
+
+void
+ace_step(Ace *ace, unsigned long num_tstates)
+{
+  int stop_event;
+
+  stop_event = scheduler_add_event(&ace->scheduler,
+                                   ace->tstates+num_tstates, 0,
+                                   ace_stop_event, ace);
+  if (stop_event < 0) return;
+  z80_run(ace);
+  if (ace->scheduler.events[stop_event].active)
+    scheduler_remove_event(&ace->scheduler, stop_event);
+}
+
+/* In SPOOLER_FAST_KEYS and SPOOLER_LINES modes the spooler is run after
+ * every interrupt so that it sees each change made by the ROM's keyboard
+ * routine */
+void
+ace_set_spooler_mode(Ace *ace, SpoolerMode mode)
+{
+  unsigned long period = ACE_FRAME_TSTATES*ACE_SPOOLER_FRAMES;
+
+  if (mode != SPOOLER_KEYS) period = ACE_FRAME_TSTATES;
+  spooler_set_mode(&ace->spooler, mode);
+  scheduler_set_period(&ace->scheduler, ace->spooler_event, period);
+}
+
+/* This is safe to call from an event as the registers are picked up
+ * again by z80_run() */
+void
+ace_reset(Ace *ace)
+{
+  memset(&ace->z80, 0, sizeof(ace->z80));
+  ace->z80.intsample = 1;
+  ace->z80_state_changed = 1;
+  memset(ace->mem+ACE_ROM_SIZE, 0xff, sizeof(ace->mem)-ACE_ROM_SIZE);
+  mark_all_dirty();
+  keyboard_clear(&ace->keyboard);
+}
+
+/* This is safe to call from an event, though a primitive that is part
+ * way through being run then is left to the ROM */
+void
+ace_set_native_primitives(Ace *ace, int on)
+{
+  if (on)
+    primitives_patch(ace);
+  else
+    primitives_unpatch(ace);
+}
+
+/* Inverse video is ignored and characters outside of printable ASCII
+ * are written as spaces */
+void
+ace_print_screen_text(Ace *ace, FILE *fp)
+{
+  unsigned char *video_ram = ace->mem+0x2400;
+  int x, y, c;
+
+  for (y = 0; y < 24; y++) {
+    for (x = 0; x < 32; x++) {
+      c = video_ram[y*32+x] & 127;
+      fputc((c >= 32 && c < 127) ? c : ' ', fp);
+    }
+    fputc('\n', fp);
+  }
+  fflush(fp);
+}
+
+unsigned int
+ace_in(Ace *ace, int h, int l)
+{
+  if(l==0xfe) /* keyboard */
+    switch(h) {
+      case 0xfe: return(keyboard_get_keyport(&ace->keyboard, 0));
+      case 0xfd: return(keyboard_get_keyport(&ace->keyboard, 1));
+      case 0xfb: return(keyboard_get_keyport(&ace->keyboard, 2));
+      case 0xf7: return(keyboard_get_keyport(&ace->keyboard, 3));
+      case 0xef: return(keyboard_get_keyport(&ace->keyboard, 4));
+      case 0xdf: return(keyboard_get_keyport(&ace->keyboard, 5));
+      case 0xbf: return(keyboard_get_keyport(&ace->keyboard, 6));
+      case 0x7f: return(keyboard_get_keyport(&ace->keyboard, 7));
+      default:  return(255);
+    }
+  return(255);
+}
+
+unsigned int
+ace_out(Ace *ace, int h, int l, int a)
+{
+  return(0);
+}
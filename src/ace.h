@@ -0,0 +1,150 @@
+/* Declarations for an emulated Jupiter Ace
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef ACE_H
+#define ACE_H
+
+#include <stdio.h>
+
+#include "scheduler.h"
+#include "keyboard.h"
+#include "spooler.h"
+#include "tape.h"
+#ifdef OPSTATS
+#include "opstats.h"
+#endif
+
+#define ACE_ROM_SIZE 8192
+#define ACE_FRAME_TSTATES 62500
+#define ACE_SPOOLER_FRAMES 4
+
+/* The displayed video RAM and its bottom rows used as the input buffer */
+#define ACE_VIDEO_RAM 0x2400
+#define ACE_VIDEO_END 0x2700
+#define ACE_INPUT_MAX_ROWS 22
+
+/* ROM system variables */
+#define ACE_RAMTOP 0x3c18  /* One after the last byte of RAM, 0 for 0x10000 */
+#define ACE_SCRPOS 0x3c1c  /* Where the next character will be printed */
+#define ACE_INSCRN 0x3c1e  /* Start of the line being entered */
+#define ACE_CURSOR 0x3c20  /* The cursor in the input buffer */
+#define ACE_ENDBUF 0x3c22  /* End of the line being entered */
+#define ACE_L_HALF 0x3c24  /* Start of the input buffer */
+#define ACE_KEYCOD 0x3c26  /* The key the ROM last saw held, or 0 */
+#define ACE_KEYCNT 0x3c27  /* Counts down the interrupts a key is held */
+#define ACE_STATIN 0x3c28  /* Keyboard state, as below */
+#define ACE_VOCLNK 0x3c35  /* Link field of the newest vocabulary */
+#define ACE_STKBOT 0x3c37  /* One after the end of the dictionary */
+#define ACE_DICT   0x3c39  /* Length field of the newest word */
+#define ACE_SPARE  0x3c3b  /* One after the top of the data stack */
+
+/* Bits of STATIN */
+#define ACE_STATIN_INPUT    0x01  /* A line is being entered */
+#define ACE_STATIN_CAPS     0x02  /* Caps lock */
+#define ACE_STATIN_GRAPHICS 0x04  /* Graphics mode */
+#define ACE_STATIN_INVERSE  0x08  /* Inverse video */
+
+/* The value of KEYCNT once the ROM has taken a held key */
+#define ACE_KEY_TAKEN_COUNT 0x1e
+
+/* The CPU registers.  z80_run() keeps these in local variables, copying
+ * them into z80 before running any events and back out again if an
+ * event sets z80_state_changed, so that events can save and restore the
+ * machine. */
+typedef struct Z80State {
+  unsigned char a, f, b, c, d, e, h, l;
+  unsigned char a1, f1, b1, c1, d1, e1, h1, l1;
+  unsigned char i, r, iff1, iff2, im;
+  unsigned char intsample;
+  unsigned int radjust;
+  unsigned short ix, iy, sp, pc;
+} Z80State;
+
+typedef struct Ace Ace;
+
+/* Called at the end of every frame's events, once the interrupt has
+ * been raised */
+typedef void (*AceFrameHandler)(Ace *ace);
+typedef void (*AceSpoolerHandler)(Ace *ace, SpoolerMessage message);
+
+/* Everything about one machine, so that any number can be run in the
+ * same process.  Nothing here is shared between machines. */
+struct Ace {
+  unsigned char mem[65536];
+  unsigned char *memptr[8];   /* The 8K pages of mem */
+  int memattr[8];             /* MEM_ROM, MEM_RAM or MEM_MIRRORED */
+  unsigned long long tstates;  /* 64 bits, so that it never wraps */
+  /*
+   * interrupted states:
+   *   0 No interrupt
+   *   1 Interrupt pending
+   */
+  int interrupted;
+  int stop;                   /* Set to return from ace_step() early */
+  Z80State z80;
+  int z80_state_changed;
+
+  /* Display cells and character set glyphs written since the last
+   * frame was published.  Bit n of dirty_cells[row] is column n and bit g&31 of
+   * dirty_glyphs[g>>5] is glyph g; display_dirty is set whenever any
+   * bit is. */
+  unsigned long dirty_cells[24];
+  unsigned long dirty_glyphs[4];
+  int display_dirty;
+
+  Scheduler scheduler;
+  int spooler_event;          /* The scheduler's id for spooler_read() */
+  Keyboard keyboard;
+  Spooler spooler;
+  Tape tape;
+#ifdef OPSTATS
+  OpStats opstats;
+#endif
+
+  /* Hooks for the program running the machine, which may be NULL */
+  AceFrameHandler frame_handler;
+  AceSpoolerHandler spooler_handler;
+  void *user_data;
+};
+
+/* Return a newly switched on Ace using the given ROM, or NULL if there
+ * isn't the memory for one */
+extern Ace *ace_create(const unsigned char rom[ACE_ROM_SIZE]);
+extern void ace_destroy(Ace *ace);
+
+/* Run the machine for at least num_tstates T-states, or until stop is
+ * set by an event */
+extern void ace_step(Ace *ace, unsigned long num_tstates);
+
+/* Change how the spooler types, which changes how often it is run */
+extern void ace_set_spooler_mode(Ace *ace, SpoolerMode mode);
+
+/* Clear the RAM and restart the CPU, as the reset button would */
+extern void ace_reset(Ace *ace);
+
+/* Run the ROM's arithmetic primitives natively when on is set, or
+ * return to running the ROM's own code for them */
+extern void ace_set_native_primitives(Ace *ace, int on);
+
+/* Write the Ace's screen to fp as plain text, one line per screen row */
+extern void ace_print_screen_text(Ace *ace, FILE *fp);
+
+extern unsigned int ace_in(Ace *ace, int h, int l);
+extern unsigned int ace_out(Ace *ace, int h, int l, int a);
+
+#endif
@@ -26,7 +26,7 @@
 #define sll(x)  do{var_t=x>>7;x=(x<<1)|1;rflags(x,t);}while(0)
 #define srl(x)  do{var_t=x&1;x>>=1;rflags(x,t);}while(0)
 
-#define rflags(x,c) (f=(c)|(x&0xa8)|((!x)<<6)|parity(x))
+#define rflags(x,c) (f=(c)|szptable[x])
 
 #define bit(n,x) (f=(f&1)|((x&(1<<n))?0x10:0x54)|(x&0x28))
 #define set(n,x) (x|=(1<<n))
@@ -40,11 +40,13 @@
       pc++;
       tstates+=8;
       op=fetch(pc);
+      opstats_op(ixoriy==1?OPSTATS_DDCB:OPSTATS_FDCB,op);
       reg=op&7;
       op=(op&0xf8)|6;
    }
    else{
       op=fetch(pc);
+      opstats_op(OPSTATS_CB,op);
       tstates+=4;
       radjust++;
       addr=hl;
@@ -17,10 +17,14 @@
  */
 #include "tape.h"
 
+/* The ED instructions are always dispatched by a switch */
+#define edinstr(opcode,cycles) case opcode: {tstates+=cycles
+#define endedinstr             }; break
+
 #define input(var) {  unsigned short u;\
                       var=u=in(b,c);\
                       tstates+=u>>8;\
-                      f=(f&1)|(var&0xa8)|((!var)<<6)|parity(var);\
+                      f=(f&1)|szptable[var];\
                    }
 #define sbchl(x) {    unsigned short z=(x);\
                       unsigned long t=(hl-z-cy)&0x1ffff;\
@@ -47,300 +51,301 @@
 
 {
    unsigned char op=fetch(pc);
+   opstats_op(OPSTATS_ED,op);
    pc++;
    radjust++;
    switch(op){
-instr(0x40,8);
+edinstr(0x40,8);
    input(b);
-endinstr;
+endedinstr;
 
-instr(0x41,8);
+edinstr(0x41,8);
    tstates+=out(b,c,b);
-endinstr;
+endedinstr;
 
-instr(0x42,11);
+edinstr(0x42,11);
    sbchl(bc);
-endinstr;
+endedinstr;
 
-instr(0x43,16);
+edinstr(0x43,16);
    {unsigned short addr=fetch2(pc);
     pc+=2;
     store2b(addr,b,c);
    }
-endinstr;
+endedinstr;
 
-instr(0x44,4);
+edinstr(0x44,4);
    neg;
-endinstr;
+endedinstr;
 
-instr(0x45,4);
+edinstr(0x45,4);
    iff1=iff2;
    ret;
-endinstr;
+endedinstr;
 
-instr(0x46,4);
+edinstr(0x46,4);
    im=0;
-endinstr;
+endedinstr;
 
-instr(0x47,5);
+edinstr(0x47,5);
    i=a;
-endinstr;
+endedinstr;
 
-instr(0x48,8);
+edinstr(0x48,8);
    input(c);
-endinstr;
+endedinstr;
 
-instr(0x49,8);
+edinstr(0x49,8);
    tstates+=out(b,c,c);
-endinstr;
+endedinstr;
 
-instr(0x4a,11);
+edinstr(0x4a,11);
    adchl(bc);
-endinstr;
+endedinstr;
 
-instr(0x4b,16);
+edinstr(0x4b,16);
    {unsigned short addr=fetch2(pc);
     pc+=2;
     c=fetch(addr);
     b=fetch(addr+1);
    }
-endinstr;
+endedinstr;
 
-instr(0x4c,4);
+edinstr(0x4c,4);
    neg;
-endinstr;
+endedinstr;
 
-instr(0x4d,4);
+edinstr(0x4d,4);
    ret;
-endinstr;
+endedinstr;
 
-instr(0x4e,4);
+edinstr(0x4e,4);
    im=1;
-endinstr;
+endedinstr;
 
-instr(0x4f,5);
+edinstr(0x4f,5);
    r=a;
    radjust=r;
-endinstr;
+endedinstr;
 
-instr(0x50,8);
+edinstr(0x50,8);
    input(d);
-endinstr;
+endedinstr;
 
-instr(0x51,8);
+edinstr(0x51,8);
    tstates+=out(b,c,d);
-endinstr;
+endedinstr;
 
-instr(0x52,11);
+edinstr(0x52,11);
    sbchl(de);
-endinstr;
+endedinstr;
 
-instr(0x53,16);
+edinstr(0x53,16);
    {unsigned short addr=fetch2(pc);
     pc+=2;
     store2b(addr,d,e);
    }
-endinstr;
+endedinstr;
 
-instr(0x54,4);
+edinstr(0x54,4);
    neg;
-endinstr;
+endedinstr;
 
-instr(0x55,4);
+edinstr(0x55,4);
    ret;
-endinstr;
+endedinstr;
 
-instr(0x56,4);
+edinstr(0x56,4);
    im=2;
-endinstr;
+endedinstr;
 
-instr(0x57,5);
+edinstr(0x57,5);
    a=i;
    f=(f&1)|(a&0xa8)|((!a)<<6)|(iff2<<2);
-endinstr;
+endedinstr;
 
-instr(0x58,8);
+edinstr(0x58,8);
    input(e);
-endinstr;
+endedinstr;
 
-instr(0x59,8);
+edinstr(0x59,8);
    tstates+=out(b,c,e);
-endinstr;
+endedinstr;
 
-instr(0x5a,11);
+edinstr(0x5a,11);
    adchl(de);
-endinstr;
+endedinstr;
 
-instr(0x5b,16);
+edinstr(0x5b,16);
    {unsigned short addr=fetch2(pc);
     pc+=2;
     e=fetch(addr);
     d=fetch(addr+1);
    }
-endinstr;
+endedinstr;
 
-instr(0x5c,4);
+edinstr(0x5c,4);
    neg;
-endinstr;
+endedinstr;
 
-instr(0x5d,4);
+edinstr(0x5d,4);
    ret;
-endinstr;
+endedinstr;
 
-instr(0x5e,4);
+edinstr(0x5e,4);
    im=3;
-endinstr;
+endedinstr;
 
-instr(0x5f,5);
+edinstr(0x5f,5);
    r=(r&0x80)|(radjust&0x7f);
    a=r;
    f=(f&1)|(a&0xa8)|((!a)<<6)|(iff2<<2);
-endinstr;
+endedinstr;
 
-instr(0x60,8);
+edinstr(0x60,8);
    input(h);
-endinstr;
+endedinstr;
 
-instr(0x61,8);
+edinstr(0x61,8);
    tstates+=out(b,c,h);
-endinstr;
+endedinstr;
 
-instr(0x62,11);
+edinstr(0x62,11);
    sbchl(hl);
-endinstr;
+endedinstr;
 
-instr(0x63,16);
+edinstr(0x63,16);
    {unsigned short addr=fetch2(pc);
     pc+=2;
     store2b(addr,h,l);
    }
-endinstr;
+endedinstr;
 
-instr(0x64,4);
+edinstr(0x64,4);
    neg;
-endinstr;
+endedinstr;
 
-instr(0x65,4);
+edinstr(0x65,4);
    ret;
-endinstr;
+endedinstr;
 
-instr(0x66,4);
+edinstr(0x66,4);
    im=0;
-endinstr;
+endedinstr;
 
-instr(0x67,14);
+edinstr(0x67,14);
    {unsigned char t=fetch(hl);
     unsigned char u=(a<<4)|(t>>4);
     a=(a&0xf0)|(t&0x0f);
     store(hl,u);
-    f=(f&1)|(a&0xa8)|((!a)<<6)|parity(a);
+    f=(f&1)|szptable[a];
    }
-endinstr;
+endedinstr;
 
-instr(0x68,8);
+edinstr(0x68,8);
    input(l);
-endinstr;
+endedinstr;
 
-instr(0x69,8);
+edinstr(0x69,8);
    tstates+=out(b,c,l);
-endinstr;
+endedinstr;
 
-instr(0x6a,11);
+edinstr(0x6a,11);
    adchl(hl);
-endinstr;
+endedinstr;
 
-instr(0x6b,16);
+edinstr(0x6b,16);
    {unsigned short addr=fetch2(pc);
     pc+=2;
     l=fetch(addr);
     h=fetch(addr+1);
    }
-endinstr;
+endedinstr;
 
-instr(0x6c,4);
+edinstr(0x6c,4);
    neg;
-endinstr;
+endedinstr;
 
-instr(0x6d,4);
+edinstr(0x6d,4);
    ret;
-endinstr;
+endedinstr;
 
-instr(0x6e,4);
+edinstr(0x6e,4);
    im=1;
-endinstr;
+endedinstr;
 
-instr(0x6f,5);
+edinstr(0x6f,5);
    {unsigned char t=fetch(hl);
     unsigned char u=(a&0x0f)|(t<<4);
     a=(a&0xf0)|(t>>4);
     store(hl,u);
-    f=(f&1)|(a&0xa8)|((!a)<<6)|parity(a);
+    f=(f&1)|szptable[a];
    }
-endinstr;
+endedinstr;
 
-instr(0x70,8);
+edinstr(0x70,8);
    {unsigned char x;input(x);}
-endinstr;
+endedinstr;
 
-instr(0x71,8);
+edinstr(0x71,8);
    tstates+=out(b,c,0);
-endinstr;
+endedinstr;
 
-instr(0x72,11);
+edinstr(0x72,11);
    sbchl(sp);
-endinstr;
+endedinstr;
 
-instr(0x73,16);
+edinstr(0x73,16);
    {unsigned short addr=fetch2(pc);
     pc+=2;
     store2(addr,sp);
    }
-endinstr;
+endedinstr;
 
-instr(0x74,4);
+edinstr(0x74,4);
    neg;
-endinstr;
+endedinstr;
 
-instr(0x75,4);
+edinstr(0x75,4);
    ret;
-endinstr;
+endedinstr;
 
-instr(0x76,4);
+edinstr(0x76,4);
    im=2;
-endinstr;
+endedinstr;
 
-instr(0x78,8);
+edinstr(0x78,8);
    input(a);
-endinstr;
+endedinstr;
 
-instr(0x79,8);
+edinstr(0x79,8);
    tstates+=out(b,c,a);
-endinstr;
+endedinstr;
 
-instr(0x7a,11);
+edinstr(0x7a,11);
    adchl(sp);
-endinstr;
+endedinstr;
 
-instr(0x7b,16);
+edinstr(0x7b,16);
    {unsigned short addr=fetch2(pc);
     pc+=2;
     sp=fetch2(addr);
    }
-endinstr;
+endedinstr;
 
-instr(0x7c,4);
+edinstr(0x7c,4);
    neg;
-endinstr;
+endedinstr;
 
-instr(0x7d,4);
+edinstr(0x7d,4);
    ret;
-endinstr;
+endedinstr;
 
-instr(0x7e,4);
+edinstr(0x7e,4);
    im=3;
-endinstr;
+endedinstr;
 
-instr(0xa0,12);
+edinstr(0xa0,12);
    {unsigned char x=fetch(hl);
     store(de,x);
     if(!++l)h++;
@@ -348,18 +353,18 @@ instr(0xa0,12);
     if(!c--)b--;
     f=(f&0xc1)|(x&0x28)|(((b|c)>0)<<2);
    }
-endinstr;
+endedinstr;
 
-instr(0xa1,12);
+edinstr(0xa1,12);
    {unsigned char carry=cy;
     cpa(fetch(hl));
     if(!++l)h++;
     if(!c--)b--;
     f=(f&0xfa)|carry|(((b|c)>0)<<2);
    }
-endinstr;
+endedinstr;
 
-instr(0xa2,12);
+edinstr(0xa2,12);
    {unsigned short t=in(b,c);
     store(hl,t);
     tstates+=t>>8;
@@ -367,9 +372,9 @@ instr(0xa2,12);
     b--;
     f=(b&0xa8)|((b>0)<<6)|2|((parity(b)^c)&4);
    }
-endinstr;
+endedinstr;
 
-instr(0xa3,12); /* I can't determine the correct flags outcome for the
+edinstr(0xa3,12); /* I can't determine the correct flags outcome for the
                    block OUT instructions.  Spec says that the carry
                    flag is left unchanged and N is set to 1, but that
                    doesn't seem to be the case... */
@@ -379,9 +384,9 @@ instr(0xa3,12); /* I can't determine the correct flags outcome for the
     b--;
     f=(f&1)|0x12|(b&0xa8)|((b==0)<<6);
    }
-endinstr;
+endedinstr;
 
-instr(0xa8,12);
+edinstr(0xa8,12);
    {unsigned char x=fetch(hl);
     store(de,x);
     if(!l--)h--;
@@ -389,18 +394,18 @@ instr(0xa8,12);
     if(!c--)b--;
     f=(f&0xc1)|(x&0x28)|(((b|c)>0)<<2);
    }
-endinstr;
+endedinstr;
 
-instr(0xa9,12);
+edinstr(0xa9,12);
    {unsigned char carry=cy;
     cpa(fetch(hl));
     if(!l--)h--;
     if(!c--)b--;
     f=(f&0xfa)|carry|(((b|c)>0)<<2);
    }
-endinstr;
+endedinstr;
 
-instr(0xaa,12);
+edinstr(0xaa,12);
    {unsigned short t=in(b,c);
     store(hl,t);
     tstates+=t>>8;
@@ -408,21 +413,21 @@ instr(0xaa,12);
     b--;
     f=(b&0xa8)|((b>0)<<6)|2|((parity(b)^c^4)&4);
    }
-endinstr;
+endedinstr;
 
-instr(0xab,12);
+edinstr(0xab,12);
    {unsigned char x=fetch(hl);
     tstates+=out(b,c,x);
     if(!l--)h--;
     b--;
     f=(f&1)|0x12|(b&0xa8)|((b==0)<<6);
    }
-endinstr;
+endedinstr;
 
 /* Note: the Z80 implements "*R" as "*" followed by JR -2.  No reason
    to change this... */
 
-instr(0xb0,12);
+edinstr(0xb0,12);
    {unsigned char x=fetch(hl);
     store(de,x);
     if(!++l)h++;
@@ -431,9 +436,9 @@ instr(0xb0,12);
     f=(f&0xc1)|(x&0x28)|(((b|c)>0)<<2);
     if(b|c)pc-=2,tstates+=5;
    }
-endinstr;
+endedinstr;
 
-instr(0xb1,12);
+edinstr(0xb1,12);
    {unsigned char carry=cy;
     cpa(fetch(hl));
     if(!++l)h++;
@@ -441,9 +446,9 @@ instr(0xb1,12);
     f=(f&0xfa)|carry|(((b|c)>0)<<2);
     if((f&0x44)==4)pc-=2,tstates+=5;
    }
-endinstr;
+endedinstr;
 
-instr(0xb2,12);
+edinstr(0xb2,12);
    {unsigned short t=in(b,c);
     store(hl,t);
     tstates+=t>>8;
@@ -452,9 +457,9 @@ instr(0xb2,12);
     f=(b&0xa8)|((b>0)<<6)|2|((parity(b)^c)&4);
     if(b)pc-=2,tstates+=5;
    }
-endinstr;
+endedinstr;
 
-instr(0xb3,12);
+edinstr(0xb3,12);
    {unsigned char x=fetch(hl);
     tstates+=out(b,c,x);
     if(!++l)h++;
@@ -462,9 +467,9 @@ instr(0xb3,12);
     f=(f&1)|0x12|(b&0xa8)|((b==0)<<6);
     if(b)pc-=2,tstates+=5;
    }
-endinstr;
+endedinstr;
 
-instr(0xb8,12);
+edinstr(0xb8,12);
    {unsigned char x=fetch(hl);
     store(de,x);
     if(!l--)h--;
@@ -473,9 +478,9 @@ instr(0xb8,12);
     f=(f&0xc1)|(x&0x28)|(((b|c)>0)<<2);
     if(b|c)pc-=2,tstates+=5;
    }
-endinstr;
+endedinstr;
 
-instr(0xb9,12);
+edinstr(0xb9,12);
    {unsigned char carry=cy;
     cpa(fetch(hl));
     if(!l--)h--;
@@ -483,9 +488,9 @@ instr(0xb9,12);
     f=(f&0xfa)|carry|(((b|c)>0)<<2);
     if((f&0x44)==4)pc-=2,tstates+=5;
    }
-endinstr;
+endedinstr;
 
-instr(0xba,12);
+edinstr(0xba,12);
    {unsigned short t=in(b,c);
     store(hl,t);
     tstates+=t>>8;
@@ -494,9 +499,9 @@ instr(0xba,12);
     f=(b&0xa8)|((b>0)<<6)|2|((parity(b)^c^4)&4);
     if(b)pc-=2,tstates+=5;
    }
-endinstr;
+endedinstr;
 
-instr(0xbb,12);
+edinstr(0xbb,12);
    {unsigned char x=fetch(hl);
     tstates+=out(b,c,x);
     if(!l--)h--;
@@ -504,18 +509,43 @@ instr(0xbb,12);
     f=(f&1)|0x12|(b&0xa8)|((b==0)<<6);
     if(b)pc-=2,tstates+=5;
    }
-endinstr;
+endedinstr;
 
 /* save/load patches */
-instr(0xfc,4);
-  tape_load_p(mem, hl);
+edinstr(0xfc,4);
+  tape_load_p(&ace->tape, ace->mem, hl);
+  mark_all_dirty();  /* the block may have been loaded into the display */
   f=(f&0xc4)|1|(a&0x28);  /* set carry */
-endinstr;
-
-instr(0xfd,4);
-  tape_save_p(mem+hl, de);
-endinstr;
+endedinstr;
+
+edinstr(0xfd,4);
+  tape_save_p(&ace->tape, ace->mem+hl, de);
+endedinstr;
+
+/* native primitive patches */
+edinstr(PRIMITIVES_TRAP,4);
+  {
+    unsigned short routine;
+
+    switch(primitives_run(ace,pc-2,&routine)) {
+      case PRIMITIVES_RAN:
+        pc=iy;  /* as the primitive's jp (iy) would */
+        break;
+      case PRIMITIVES_CALL_ROM:
+        /* left to the ROM, so make the call the trap replaced */
+        tstates+=9;
+        push2(pc+1);
+        pc=routine;
+        break;
+      case PRIMITIVES_NO_TRAP:
+        break;
+    }
+  }
+endedinstr;
 
 default: tstates+=4;
 
 }}
+
+#undef edinstr
+#undef endedinstr
@@ -0,0 +1,74 @@
+/* A triple buffer that hands frames to the display
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ * --------------------------------------------------------------------------
+ *
+ * The three frames are never copied, only their indices are swapped.  The
+ * exchange on middle releases the writer's frame to the reader and
+ * acquires the frame it gets back, so whole frames pass between threads
+ * without a lock.
+ */
+#include <string.h>
+
+#include "framebuf.h"
+
+/* Set in middle when the writer has published it and cleared once the
+ * reader has taken it */
+#define FRAMEBUF_FRESH 4
+#define FRAMEBUF_INDEX 3
+
+void
+framebuf_init(FrameBuffer *framebuf)
+{
+  memset(framebuf->frames, 0, sizeof(framebuf->frames));
+  framebuf->back = 0;
+  atomic_init(&framebuf->middle, 1);
+  framebuf->front = 2;
+}
+
+Frame *
+framebuf_back(FrameBuffer *framebuf)
+{
+  return &framebuf->frames[framebuf->back];
+}
+
+int
+framebuf_publish(FrameBuffer *framebuf)
+{
+  int old_middle;
+
+  old_middle = atomic_exchange_explicit(&framebuf->middle,
+                                        framebuf->back | FRAMEBUF_FRESH,
+                                        memory_order_acq_rel);
+  framebuf->back = old_middle & FRAMEBUF_INDEX;
+  return (old_middle & FRAMEBUF_FRESH) != 0;
+}
+
+Frame *
+framebuf_take(FrameBuffer *framebuf)
+{
+  int old_middle;
+
+  if (!(atomic_load_explicit(&framebuf->middle, memory_order_relaxed) &
+        FRAMEBUF_FRESH))
+    return NULL;
+
+  old_middle = atomic_exchange_explicit(&framebuf->middle, framebuf->front,
+                                        memory_order_acq_rel);
+  framebuf->front = old_middle & FRAMEBUF_INDEX;
+  return &framebuf->frames[framebuf->front];
+}
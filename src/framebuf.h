@@ -0,0 +1,65 @@
+/* Declarations for the triple buffer that hands frames to the display
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef FRAMEBUF_H
+#define FRAMEBUF_H
+
+#include <stdatomic.h>
+
+#define FRAMEBUF_VIDEO_SIZE 768
+#define FRAMEBUF_CHARSET_SIZE 1024
+
+/* What the display needs of the Ace to draw one frame.  The dirty bits,
+ * laid out as in the Ace's, are those that have changed since the last
+ * frame the reader took. */
+typedef struct Frame {
+  unsigned char video_ram[FRAMEBUF_VIDEO_SIZE];
+  unsigned char charset[FRAMEBUF_CHARSET_SIZE];
+  unsigned long dirty_cells[24];
+  unsigned long dirty_glyphs[4];
+} Frame;
+
+/**
+ * Three frames shared between one writer and one reader.  The writer
+ * fills the back frame and swaps it with the middle one, while the reader
+ * swaps its front frame with the middle one whenever that has been
+ * published since it last looked.  Neither ever waits for the other, so a
+ * slow reader just misses frames.
+ */
+typedef struct FrameBuffer {
+  Frame frames[3];
+  int back;              /* Only used by the writer */
+  int front;             /* Only used by the reader */
+  atomic_int middle;     /* Index of the middle frame | FRAMEBUF_FRESH */
+} FrameBuffer;
+
+extern void framebuf_init(FrameBuffer *framebuf);
+
+/* Return the frame for the writer to fill */
+extern Frame *framebuf_back(FrameBuffer *framebuf);
+
+/* Hand the back frame to the reader and start on another.  Returns 1 if
+ * the frame published before it was never taken, so that the reader will
+ * not have seen its changes. */
+extern int framebuf_publish(FrameBuffer *framebuf);
+
+/* Return the newest published frame if it hasn't already been taken,
+ * otherwise NULL.  It is the reader's until the next call. */
+extern Frame *framebuf_take(FrameBuffer *framebuf);
+
+#endif
@@ -0,0 +1,156 @@
+/* A pool of threads used to run batches of jobs
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ * --------------------------------------------------------------------------
+ *
+ * The jobs are dealt out in runs of consecutive numbers, one run to each
+ * thread's queue.  A thread takes jobs from the front of its own queue
+ * and once that is empty steals from the back of the others, so that a
+ * thread which is given long jobs doesn't hold up the batch.  No jobs are
+ * added once the pool has started, so a thread finishes when it can't
+ * find a job in any queue.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "jobpool.h"
+
+typedef struct JobQueue {
+  pthread_mutex_t lock;
+  int head;              /* The next job to take */
+  int tail;              /* One after the last job to take */
+} JobQueue;
+
+typedef struct JobPool {
+  JobPoolFunc func;
+  void *context;
+  int num_threads;
+  JobQueue *queues;
+} JobPool;
+
+typedef struct JobWorker {
+  JobPool *pool;
+  int id;
+} JobWorker;
+
+/* Return the next job from the front of queue, or -1 if it is empty */
+static int
+jobqueue_take(JobQueue *queue)
+{
+  int job = -1;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail)
+    job = queue->head++;
+  pthread_mutex_unlock(&queue->lock);
+  return job;
+}
+
+/* Return the last job from the back of queue, or -1 if it is empty */
+static int
+jobqueue_steal(JobQueue *queue)
+{
+  int job = -1;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail)
+    job = --queue->tail;
+  pthread_mutex_unlock(&queue->lock);
+  return job;
+}
+
+static int
+jobpool_next_job(JobPool *pool, int id)
+{
+  int job, victim, i;
+
+  job = jobqueue_take(&pool->queues[id]);
+  for (i = 1; job < 0 && i < pool->num_threads; i++) {
+    victim = (id+i) % pool->num_threads;
+    job = jobqueue_steal(&pool->queues[victim]);
+  }
+  return job;
+}
+
+static void *
+jobpool_worker(void *arg)
+{
+  JobWorker *worker = arg;
+  JobPool *pool = worker->pool;
+  int job;
+
+  while ((job = jobpool_next_job(pool, worker->id)) >= 0)
+    pool->func(pool->context, job);
+  return NULL;
+}
+
+int
+jobpool_run(int num_jobs, int num_threads, JobPoolFunc func, void *context)
+{
+  JobPool pool;
+  JobWorker *workers;
+  pthread_t *threads;
+  int *started;
+  int i;
+
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > num_jobs && num_jobs > 0) num_threads = num_jobs;
+
+  pool.func = func;
+  pool.context = context;
+  pool.num_threads = num_threads;
+  pool.queues = calloc(num_threads, sizeof(JobQueue));
+  workers = calloc(num_threads, sizeof(JobWorker));
+  threads = calloc(num_threads, sizeof(pthread_t));
+  started = calloc(num_threads, sizeof(int));
+  if (!pool.queues || !workers || !threads || !started) {
+    free(pool.queues);
+    free(workers);
+    free(threads);
+    free(started);
+    return -1;
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&pool.queues[i].lock, NULL);
+    pool.queues[i].head = (long)num_jobs*i/num_threads;
+    pool.queues[i].tail = (long)num_jobs*(i+1)/num_threads;
+    workers[i].pool = &pool;
+    workers[i].id = i;
+  }
+
+  /* A thread that can't be started just leaves its queue to be stolen
+   * by the others */
+  for (i = 1; i < num_threads; i++) {
+    started[i] = (pthread_create(&threads[i], NULL, jobpool_worker,
+                                 &workers[i]) == 0);
+  }
+  jobpool_worker(&workers[0]);
+
+  for (i = 1; i < num_threads; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+
+  for (i = 0; i < num_threads; i++)
+    pthread_mutex_destroy(&pool.queues[i].lock);
+  free(pool.queues);
+  free(workers);
+  free(threads);
+  free(started);
+  return 0;
+}
@@ -0,0 +1,35 @@
+/* Declarations for the pool of threads used to run batches of jobs
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef JOBPOOL_H
+#define JOBPOOL_H
+
+/* Run job number job.  This is called from several threads at once. */
+typedef void (*JobPoolFunc)(void *context, int job);
+
+/**
+ * Run jobs 0 to num_jobs-1, each once, on num_threads threads including
+ * the calling one, and return once they have all finished.  Returns 0 on
+ * success or -1 if there wasn't the memory to start.
+ * func - Function to run each job
+ * context - Passed to func
+ */
+extern int jobpool_run(int num_jobs, int num_threads, JobPoolFunc func,
+                       void *context);
+
+#endif
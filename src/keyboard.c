@@ -33,13 +33,6 @@
 
 #include "keyboard.h"
 
-static NonAceKeyHandler keyboard_non_ace_key_handler = NULL;
-
-static unsigned char keyboard_ports[8] = {
-  0xff, 0xff, 0xff, 0xff,
-  0xff, 0xff, 0xff, 0xff
-};
-
 
 /* key, keyport_index, and_value, keyport_index, and_value
  * if keyport_index == -1 then no action for that port */
@@ -157,24 +150,31 @@ static const int keypress_response[] = {
 };
 
 void
-keyboard_init(NonAceKeyHandler non_ace_key_handler)
+keyboard_init(Keyboard *keyboard, NonAceKeyHandler non_ace_key_handler)
 {
-  keyboard_non_ace_key_handler = non_ace_key_handler;
-  keyboard_clear();
+  keyboard->non_ace_key_handler = non_ace_key_handler;
+  keyboard_clear(keyboard);
 }
 
 unsigned char
-keyboard_get_keyport(int port)
+keyboard_get_keyport(Keyboard *keyboard, int port)
+{
+  return keyboard->ports[port];
+}
+
+/* Used to restore the keyboard from a snapshot */
+void
+keyboard_set_keyport(Keyboard *keyboard, int port, unsigned char value)
 {
-  return keyboard_ports[port];
+  keyboard->ports[port] = value;
 }
 
 void
-keyboard_clear(void)
+keyboard_clear(Keyboard *keyboard)
 {
   int i;
   for (i = 0; i < 8; i++)
-    keyboard_ports[i] = 0xff;
+    keyboard->ports[i] = 0xff;
 }
 
 static int
@@ -197,7 +197,7 @@ keyboard_get_key_response(KeySym ks, int *keyport1, int *keyport2,
 }
 
 static void
-keyboard_process_keypress_keyports(KeySym ks)
+keyboard_process_keypress_keyports(Keyboard *keyboard, KeySym ks)
 {
   int key_found;
   int keyport1, keyport2;
@@ -206,14 +206,14 @@ keyboard_process_keypress_keyports(KeySym ks)
   key_found = keyboard_get_key_response(ks, &keyport1, &keyport2,
                 &keyport1_and_value, &keyport2_and_value);
   if (key_found) {
-    keyboard_ports[keyport1] &= keyport1_and_value;
+    keyboard->ports[keyport1] &= keyport1_and_value;
     if (keyport2 != -1)
-      keyboard_ports[keyport2] &= keyport2_and_value;
+      keyboard->ports[keyport2] &= keyport2_and_value;
   }
 }
 
 static void
-keyboard_process_keyrelease_keyports(KeySym ks)
+keyboard_process_keyrelease_keyports(Keyboard *keyboard, KeySym ks)
 {
   int key_found;
   int keyport1, keyport2;
@@ -222,23 +222,24 @@ keyboard_process_keyrelease_keyports(KeySym ks)
   key_found = keyboard_get_key_response(ks, &keyport1, &keyport2,
                 &keyport1_or_value, &keyport2_or_value);
   if (key_found) {
-    keyboard_ports[keyport1] |= ~keyport1_or_value;
+    keyboard->ports[keyport1] |= ~keyport1_or_value;
     if (keyport2 != -1)
-      keyboard_ports[keyport2] |= ~keyport2_or_value;
+      keyboard->ports[keyport2] |= ~keyport2_or_value;
   }
 }
 
 void
-keyboard_keypress(KeySym ks, int key_state)
+keyboard_keypress(Keyboard *keyboard, KeySym ks, int key_state)
 {
   if (!(key_state & ControlMask))
-    keyboard_process_keypress_keyports(ks);
-  keyboard_non_ace_key_handler(ks, key_state);
+    keyboard_process_keypress_keyports(keyboard, ks);
+  if (keyboard->non_ace_key_handler)
+    keyboard->non_ace_key_handler(ks, key_state);
 }
 
 void
-keyboard_keyrelease(KeySym ks, int key_state)
+keyboard_keyrelease(Keyboard *keyboard, KeySym ks, int key_state)
 {
   if (!(key_state & ControlMask))
-    keyboard_process_keyrelease_keyports(ks);
+    keyboard_process_keyrelease_keyports(keyboard, ks);
 }
@@ -23,10 +23,19 @@
 
 typedef void (*NonAceKeyHandler)(KeySym ks, int key_state);
 
-extern void keyboard_init(NonAceKeyHandler non_ace_key_handler);
-extern unsigned char keyboard_get_keyport(int port);
-extern void keyboard_clear(void);
-extern void keyboard_keypress(KeySym ks, int key_state);
-extern void keyboard_keyrelease(KeySym ks, int key_state);
+typedef struct Keyboard {
+  unsigned char ports[8];
+  NonAceKeyHandler non_ace_key_handler;
+} Keyboard;
+
+extern void keyboard_init(Keyboard *keyboard,
+                          NonAceKeyHandler non_ace_key_handler);
+extern unsigned char keyboard_get_keyport(Keyboard *keyboard, int port);
+extern void keyboard_set_keyport(Keyboard *keyboard, int port,
+                                 unsigned char value);
+extern void keyboard_clear(Keyboard *keyboard);
+extern void keyboard_keypress(Keyboard *keyboard, KeySym ks, int key_state);
+extern void keyboard_keyrelease(Keyboard *keyboard, KeySym ks,
+                                int key_state);
 
 #endif
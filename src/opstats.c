@@ -0,0 +1,123 @@
+/* Counting the Z80 instructions executed
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ * --------------------------------------------------------------------------
+ *
+ * The counters are only updated by z80_run() when built with OPSTATS.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "opstats.h"
+
+/* How each instruction set's opcodes are written in the report */
+static const char *table_prefixes[OPSTATS_NUM_TABLES] = {
+  "", "dd ", "fd ", "cb ", "ed ", "dd cb ", "fd cb "
+};
+
+static const char *table_names[OPSTATS_NUM_TABLES] = {
+  "Unprefixed", "DD", "FD", "CB", "ED", "DD CB", "FD CB"
+};
+
+typedef struct OpStatsEntry {
+  int key;
+  unsigned long tstates;
+} OpStatsEntry;
+
+/* Most T-states first */
+static int
+compare_entries(const void *a, const void *b)
+{
+  const OpStatsEntry *entry_a = a, *entry_b = b;
+
+  if (entry_a->tstates != entry_b->tstates)
+    return entry_a->tstates < entry_b->tstates ? 1 : -1;
+  return entry_a->key - entry_b->key;
+}
+
+static double
+percent(unsigned long long part, unsigned long long whole)
+{
+  return whole ? 100.0*part/whole : 0.0;
+}
+
+void
+opstats_clear(OpStats *stats)
+{
+  memset(stats, 0, sizeof(OpStats));
+}
+
+void
+opstats_print(OpStats *stats, FILE *fp)
+{
+  OpStatsEntry entries[OPSTATS_NUM_TABLES*256];
+  unsigned long long total_count = 0, total_tstates = 0;
+  unsigned long long table_count, table_tstates;
+  int num_keys = 0, key, table, opcode, i;
+
+  for (key = 0; key < OPSTATS_NUM_TABLES*256; key++) {
+    if (!stats->count[key]) continue;
+    entries[num_keys].key = key;
+    entries[num_keys++].tstates = stats->tstates[key];
+    total_count += stats->count[key];
+    total_tstates += stats->tstates[key];
+  }
+  qsort(entries, num_keys, sizeof(OpStatsEntry), compare_entries);
+
+  fprintf(fp, "%-14s %12s %14s %9s %5s\n",
+          "Opcode", "Count", "T-states", "%T-states", "Avg");
+  for (i = 0; i < num_keys; i++) {
+    key = entries[i].key;
+    table = key / 256;
+    opcode = key % 256;
+    fprintf(fp, "%s%02x%*s %12lu %14lu %9.2f %5.1f\n",
+            table_prefixes[table], opcode,
+            (int)(12-strlen(table_prefixes[table])), "",
+            stats->count[key], stats->tstates[key],
+            percent(stats->tstates[key], total_tstates),
+            (double)stats->tstates[key]/stats->count[key]);
+  }
+
+  fprintf(fp, "\n%-14s %12s %14s %9s\n",
+          "Prefix", "Count", "T-states", "%T-states");
+  for (table = 0; table < OPSTATS_NUM_TABLES; table++) {
+    table_count = table_tstates = 0;
+    for (opcode = 0; opcode < 256; opcode++) {
+      table_count += stats->count[table*256+opcode];
+      table_tstates += stats->tstates[table*256+opcode];
+    }
+    fprintf(fp, "%-14s %12llu %14llu %9.2f\n", table_names[table],
+            table_count, table_tstates, percent(table_tstates, total_tstates));
+  }
+  fprintf(fp, "%-14s %12llu %14llu\n", "Total", total_count, total_tstates);
+
+  fprintf(fp, "\n%-8s %12s %7s\n", "T-states", "Count", "%Count");
+  for (i = 0; i < OPSTATS_MAX_TSTATES; i++) {
+    if (!stats->histogram[i]) continue;
+    fprintf(fp, "%3d%-5s %12lu %7.2f\n", i,
+            i == OPSTATS_MAX_TSTATES-1 ? "+" : " ",
+            stats->histogram[i], percent(stats->histogram[i], total_count));
+  }
+
+  fprintf(fp, "\nInterrupts: %lu", stats->interrupts);
+  if (stats->interrupts) {
+    fprintf(fp, ", %.1f instructions and %.1f T-states per interrupt",
+            (double)total_count/stats->interrupts,
+            (double)total_tstates/stats->interrupts);
+  }
+  fputc('\n', fp);
+}
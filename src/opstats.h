@@ -0,0 +1,65 @@
+/* Declarations for counting the Z80 instructions executed
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef OPSTATS_H
+#define OPSTATS_H
+
+#include <stdio.h>
+
+/* The instruction sets, the first three numbered as ixoriy */
+typedef enum OpStatsTable {
+  OPSTATS_MAIN,
+  OPSTATS_DD,
+  OPSTATS_FD,
+  OPSTATS_CB,
+  OPSTATS_ED,
+  OPSTATS_DDCB,
+  OPSTATS_FDCB,
+  OPSTATS_NUM_TABLES
+} OpStatsTable;
+
+/* Instructions taking this many T-states or more share the last bucket
+ * of the histogram */
+#define OPSTATS_MAX_TSTATES 32
+
+/* Counts for each opcode are at [table*256+opcode] */
+typedef struct OpStats {
+  unsigned long count[OPSTATS_NUM_TABLES*256];
+  unsigned long tstates[OPSTATS_NUM_TABLES*256];
+  unsigned long histogram[OPSTATS_MAX_TSTATES];
+  unsigned long interrupts;
+} OpStats;
+
+/* Record an execution of opcode key taking tstates T-states */
+static inline void
+opstats_record(OpStats *stats, unsigned int key, unsigned long tstates)
+{
+  stats->count[key]++;
+  stats->tstates[key] += tstates;
+  stats->histogram[tstates < OPSTATS_MAX_TSTATES ?
+                   tstates : OPSTATS_MAX_TSTATES-1]++;
+}
+
+extern void opstats_clear(OpStats *stats);
+
+/* Write a report to fp with the opcodes sorted by the T-states spent on
+ * them, then the totals for each instruction set, the histogram of
+ * T-states per instruction and the work done per interrupt */
+extern void opstats_print(OpStats *stats, FILE *fp);
+
+#endif
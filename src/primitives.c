@@ -0,0 +1,746 @@
+/* Running the ROM's Forth primitives natively
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <string.h>
+
+#include "z80.h"
+#include "ace.h"
+#include "primitives.h"
+
+/* The trap is ED PRIMITIVES_TRAP followed by the primitive's number */
+#define TRAP_SIZE 3
+
+/* The code field of a colon definition */
+#define DOCOLON 0x0ec3
+
+/* How far up the Z80 stack to look for return addresses and IPs into
+ * a primitive before patching it */
+#define MAX_STACK_SLOTS 256
+
+/* A primitive whose code starts with a call can leave what is on the
+ * stack to the ROM, by run() returning 0, and the ROM's routine is then
+ * called as the replaced code would have.  Any other run() returns 1. */
+typedef struct Primitive {
+  unsigned short cfa;              /* For a colon definition, else 0 */
+  unsigned short addr;             /* Where the trap goes */
+  unsigned char code[TRAP_SIZE];   /* The ROM's bytes replaced by the trap */
+  unsigned short call;             /* What code calls, else 0 */
+  int (*run)(Ace *ace);
+} Primitive;
+
+static int primitives_umul(Ace *ace);
+static int primitives_udmod(Ace *ace);
+static int primitives_dplus(Ace *ace);
+static int primitives_plus(Ace *ace);
+static int primitives_negate(Ace *ace);
+static int primitives_dnegate(Ace *ace);
+static int primitives_slash_mod(Ace *ace);
+static int primitives_star_slash_mod(Ace *ace);
+static int primitives_fplus(Ace *ace);
+static int primitives_fstar(Ace *ace);
+static int primitives_fslash(Ace *ace);
+static int primitives_fnegate(Ace *ace);
+static int primitives_int(Ace *ace);
+static int primitives_ufloat(Ace *ace);
+
+/* Only primitives that nothing else in the ROM jumps into part way
+ * through the first TRAP_SIZE bytes of.  A colon definition has its code
+ * field pointed at a trap over the start of its body.  The ROM's
+ * star-slash-MOD branches into the body of /MOD, but past the trap.  /,
+ * MOD, star-slash, * and U/MOD are colon definitions that use these, as
+ * F- is of FNEGATE and F+. */
+static const Primitive primitives[] = {
+  {0,      0x0caa, {0xdf, 0xcd, 0x4e}, 0,      primitives_umul},    /* U* */
+  {0,      0x0cc6, {0xdf, 0xd9, 0xdf}, 0,      primitives_udmod},
+  {0,      0x0df0, {0xdf, 0xd5, 0xcd}, 0,      primitives_dplus},   /* D+ */
+  {0,      0x0dd4, {0xdf, 0xd5, 0xdf}, 0,      primitives_plus},    /* + */
+  {0,      0x0dab, {0x01, 0x02, 0x00}, 0,      primitives_negate},
+  {0,      0x0dbc, {0x01, 0x04, 0x00}, 0,      primitives_dnegate},
+  {0x0d00, 0x0d02, {0x85, 0x08, 0xd2}, 0,      primitives_slash_mod},
+  {0x0d31, 0x0d33, {0xff, 0x08, 0xd2}, 0,      primitives_star_slash_mod},
+  {0,      0x1bb3, {0xcd, 0xf4, 0x1a}, 0x1af4, primitives_fplus},   /* F+ */
+  {0,      0x1c4d, {0xcd, 0xf4, 0x1a}, 0x1af4, primitives_fstar},   /* F* */
+  {0,      0x1c7d, {0xcd, 0xf4, 0x1a}, 0x1af4, primitives_fslash},  /* F/ */
+  {0,      0x1d11, {0xdf, 0x7a, 0xa7}, 0,      primitives_fnegate},
+  {0,      0x1d24, {0x2a, 0x3b, 0x3c}, 0,      primitives_int},     /* INT */
+  {0,      0x1d5b, {0xdf, 0xeb, 0x01}, 0,      primitives_ufloat}
+};
+
+#define NUM_PRIMITIVES (int)(sizeof(primitives)/sizeof(primitives[0]))
+
+static unsigned short
+peek2(const unsigned char *mem, unsigned short addr)
+{
+  return mem[addr] | (mem[addr+1] << 8);
+}
+
+static void
+poke2(unsigned char *mem, unsigned short addr, unsigned short value)
+{
+  mem[addr] = value & 0xff;
+  mem[addr+1] = value >> 8;
+}
+
+static int
+within_trap(const Primitive *primitive, unsigned short addr)
+{
+  return addr >= primitive->addr && addr < primitive->addr+TRAP_SIZE;
+}
+
+/* Whether the Z80 is part way through the bytes the trap would replace,
+ * or will return to them or read an IP from them.  This errs on the side
+ * of leaving the primitive alone. */
+static int
+primitives_in_use(Ace *ace, const Primitive *primitive)
+{
+  Z80State *z80 = &ace->z80;
+  unsigned short sp = z80->sp;
+  int i;
+
+  if (z80->pc != primitive->addr && within_trap(primitive, z80->pc))
+    return 1;
+  if (within_trap(primitive, (z80->b << 8) | z80->c) ||
+      within_trap(primitive, (z80->d << 8) | z80->e) ||
+      within_trap(primitive, (z80->h << 8) | z80->l))
+    return 1;
+  for (i = 0; i < MAX_STACK_SLOTS && sp < 0xffff; i++, sp += 2) {
+    if (within_trap(primitive, peek2(ace->mem, sp)))
+      return 1;
+  }
+  return 0;
+}
+
+void
+primitives_patch(Ace *ace)
+{
+  int i;
+
+  for (i = 0; i < NUM_PRIMITIVES; i++) {
+    const Primitive *primitive = &primitives[i];
+    unsigned char *code = ace->mem + primitive->addr;
+
+    if (memcmp(code, primitive->code, TRAP_SIZE) != 0 ||
+        (primitive->cfa && peek2(ace->mem, primitive->cfa) != DOCOLON) ||
+        primitives_in_use(ace, primitive))
+      continue;
+    code[0] = 0xed;
+    code[1] = PRIMITIVES_TRAP;
+    code[2] = i;
+    if (primitive->cfa)
+      poke2(ace->mem, primitive->cfa, primitive->addr);
+  }
+}
+
+void
+primitives_unpatch(Ace *ace)
+{
+  int i;
+
+  for (i = 0; i < NUM_PRIMITIVES; i++) {
+    const Primitive *primitive = &primitives[i];
+    unsigned char *code = ace->mem + primitive->addr;
+
+    if (code[0] != 0xed || code[1] != PRIMITIVES_TRAP || code[2] != i)
+      continue;
+    memcpy(code, primitive->code, TRAP_SIZE);
+    if (primitive->cfa)
+      poke2(ace->mem, primitive->cfa, DOCOLON);
+  }
+}
+
+/* Anywhere else the trap is left as the NOP it is on a real Z80 */
+PrimitivesStatus
+primitives_run(Ace *ace, unsigned short addr, unsigned short *routine)
+{
+  int primitive = ace->mem[(unsigned short)(addr+2)];
+
+  if (primitive >= NUM_PRIMITIVES || primitives[primitive].addr != addr)
+    return PRIMITIVES_NO_TRAP;
+  if (primitives[primitive].run(ace))
+    return PRIMITIVES_RAN;
+  *routine = primitives[primitive].call;
+  return PRIMITIVES_CALL_ROM;
+}
+
+/* The data stack is accessed a byte at a time, wrapping at 0xffff,
+ * as the ROM does */
+static unsigned short
+pop(Ace *ace)
+{
+  unsigned short addr = fetch2(ACE_SPARE) - 2;
+  unsigned short high = addr + 1;
+
+  store2(ACE_SPARE, addr);
+  return (fetch(high) << 8) | fetch(addr);
+}
+
+static void
+push(Ace *ace, unsigned short value)
+{
+  unsigned short addr = fetch2(ACE_SPARE);
+  unsigned short high = addr + 1;
+
+  store(addr, value & 0xff);
+  store(high, value >> 8);
+  store2(ACE_SPARE, addr+2);
+}
+
+/* The ROM's unnamed +- ( n1 n2 -- n3 ), which negates n1 if n2 is
+ * negative.  ABS is DUP +- */
+static unsigned short
+apply_sign(unsigned short n, unsigned short sign)
+{
+  return sign & 0x8000 ? -n : n;
+}
+
+/* Divide the double cell (high << 16) | low by divisor as the ROM's shift
+ * and subtract does, so that dividing by zero gives what the ROM would.
+ * The ROM takes 16 steps instead of 32 when the high cell is 0, and both
+ * take an extra step first that only matters when dividing by 0. */
+static void
+udmod(unsigned long low, unsigned long high, unsigned long divisor,
+      unsigned short *remainder, unsigned long *quotient)
+{
+  unsigned long dividend, rem = 0, quotient_bit, carry = 0;
+  int steps;
+
+  if (high) {
+    dividend = (high << 16) | low;
+    steps = 33;
+  } else {
+    dividend = low << 16;
+    steps = 17;
+  }
+
+  while (steps--) {
+    rem = (rem << 1) | carry;
+    quotient_bit = rem >= divisor;
+    if (quotient_bit)
+      rem = (rem - divisor) & 0xffff;
+    carry = (dividend >> 31) & 1;
+    dividend = ((dividend << 1) | quotient_bit) & 0xffffffff;
+  }
+
+  *remainder = rem;
+  *quotient = dividend;
+}
+
+/* ( u1 u2 -- ud ) */
+static int
+primitives_umul(Ace *ace)
+{
+  unsigned long u2 = pop(ace);
+  unsigned long u1 = pop(ace);
+  unsigned long product = u1*u2;
+
+  push(ace, product & 0xffff);
+  push(ace, product >> 16);
+  return 1;
+}
+
+/* ( ud u -- urem udquot ), which U/MOD follows with DROP */
+static int
+primitives_udmod(Ace *ace)
+{
+  unsigned long divisor = pop(ace);
+  unsigned long high = pop(ace);
+  unsigned long low = pop(ace);
+  unsigned short remainder;
+  unsigned long quotient;
+
+  udmod(low, high, divisor, &remainder, &quotient);
+  push(ace, remainder);
+  push(ace, quotient & 0xffff);
+  push(ace, quotient >> 16);
+  return 1;
+}
+
+/* ( d1 d2 -- d3 ) */
+static int
+primitives_dplus(Ace *ace)
+{
+  unsigned long high2 = pop(ace);
+  unsigned long low2 = pop(ace);
+  unsigned long high1 = pop(ace);
+  unsigned long low1 = pop(ace);
+  unsigned long sum = ((high1 << 16) | low1) + ((high2 << 16) | low2);
+
+  push(ace, sum & 0xffff);
+  push(ace, (sum >> 16) & 0xffff);
+  return 1;
+}
+
+/* ( n1 n2 -- n3 ) */
+static int
+primitives_plus(Ace *ace)
+{
+  unsigned short n2 = pop(ace);
+  unsigned short n1 = pop(ace);
+
+  push(ace, n1 + n2);
+  return 1;
+}
+
+/* Negate the size bytes on top of the data stack in place, borrowing
+ * from the start if the stack is below size as the ROM's SBC HL,BC would
+ * leave */
+static void
+negate_top(Ace *ace, int size)
+{
+  unsigned short top = fetch2(ACE_SPARE);
+  unsigned short addr = top - size;
+  int borrow = top < size;
+  int i;
+
+  for (i = 0; i < size; i++, addr++) {
+    int result = 0 - fetch(addr) - borrow;
+
+    store(addr, result & 0xff);
+    borrow = result < 0;
+  }
+}
+
+/* ( n -- -n ) */
+static int
+primitives_negate(Ace *ace)
+{
+  negate_top(ace, 2);
+  return 1;
+}
+
+/* ( d -- -d ) */
+static int
+primitives_dnegate(Ace *ace)
+{
+  negate_top(ace, 4);
+  return 1;
+}
+
+/* ( n1 n2 -- rem quot )
+ * The ROM divides the sizes and gives the remainder the sign of n1 */
+static int
+primitives_slash_mod(Ace *ace)
+{
+  unsigned short n2 = pop(ace);
+  unsigned short n1 = pop(ace);
+  unsigned short remainder;
+  unsigned long quotient;
+
+  udmod(apply_sign(n1, n1), 0, apply_sign(n2, n2), &remainder, &quotient);
+  push(ace, apply_sign(remainder, n1));
+  push(ace, apply_sign(quotient, n1 ^ n2));
+  return 1;
+}
+
+/* ( n1 n2 n3 -- rem quot ) with a double cell n1*n2 */
+static int
+primitives_star_slash_mod(Ace *ace)
+{
+  unsigned short n3 = pop(ace);
+  unsigned short n2 = pop(ace);
+  unsigned short n1 = pop(ace);
+  unsigned long product = (unsigned long)apply_sign(n1, n1) *
+                          apply_sign(n2, n2);
+  unsigned short remainder;
+  unsigned long quotient;
+
+  udmod(product & 0xffff, product >> 16, apply_sign(n3, n3),
+        &remainder, &quotient);
+  push(ace, apply_sign(remainder, n1 ^ n2));
+  push(ace, apply_sign(quotient, n1 ^ n2 ^ n3));
+  return 1;
+}
+
+/* The ROM's floating point numbers are two cells, with six BCD digits
+ * least significant byte first and then a byte of the sign in bit 7 and
+ * an exponent excess 0x40.  They are unpacked into four byte mantissas,
+ * the last byte giving room for carries, and worked on with the ROM's
+ * workspace at FP_WORKSPACE. */
+#define FLOAT_SIZE 4
+#define FP_WORKSPACE 0x3c00
+#define FP_WORKSPACE_SIZE 0x14
+#define FP_EXPONENT 0   /* The result's, at first the top float's */
+#define FP_EXPONENT2 1  /* That of the float below */
+#define FP_SIGNS 2      /* Bit 7 the lower float's sign, 6 the top's */
+#define FP_DIGITS 3     /* Where F/ puts a quotient digit pair to add it */
+#define FP_PRODUCT 5    /* The top bytes of the product F* works out */
+#define FP_QUOTIENT 7   /* The bottom of the five bytes of F/'s quotient */
+#define FP_REMAINDER 0x10
+
+/* Copies of the top two floats and the workspace, so that a primitive
+ * can still leave them to the ROM part way through */
+typedef struct Floats {
+  unsigned short addr;                        /* The float below the top */
+  unsigned char stack[FLOAT_SIZE*2];
+  unsigned char workspace[FP_WORKSPACE_SIZE];
+} Floats;
+
+static int
+bcd_valid(const unsigned char *digits, int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++) {
+    if ((digits[i] & 0x0f) > 9 || (digits[i] >> 4) > 9)
+      return 0;
+  }
+  return 1;
+}
+
+static int
+from_bcd(unsigned char byte)
+{
+  return (byte >> 4)*10 + (byte & 0x0f);
+}
+
+static unsigned char
+to_bcd(int n)
+{
+  return ((n / 10) << 4) | (n % 10);
+}
+
+static unsigned long
+mantissa_value(const unsigned char *mantissa)
+{
+  unsigned long value = 0;
+  int i;
+
+  for (i = FLOAT_SIZE-1; i >= 0; i--)
+    value = value*100 + from_bcd(mantissa[i]);
+  return value;
+}
+
+static void
+set_mantissa(unsigned char *mantissa, unsigned long value)
+{
+  int i;
+
+  for (i = 0; i < FLOAT_SIZE; i++, value /= 100)
+    mantissa[i] = to_bcd(value % 100);
+}
+
+/* Shift right by up to nine digits, rounding half up on the last digit
+ * shifted out */
+static void
+shift_right(unsigned char *mantissa, int digits)
+{
+  unsigned long value = mantissa_value(mantissa);
+  int last = 0;
+
+  if (digits > 9)
+    digits = 9;
+  while (digits--) {
+    last = value % 10;
+    value /= 10;
+  }
+  set_mantissa(mantissa, value + (last >= 5));
+}
+
+/* Ten's complement */
+static void
+negate_mantissa(unsigned char *mantissa)
+{
+  set_mantissa(mantissa, (100000000 - mantissa_value(mantissa)) % 100000000);
+}
+
+/* Add mantissa times the BCD digit pair n to sum, dropping any carry out
+ * of the last byte */
+static void
+add_product(unsigned char *sum, const unsigned char *mantissa, unsigned char n)
+{
+  int carry = 0, i;
+
+  for (i = 0; i < FLOAT_SIZE; i++) {
+    carry += from_bcd(sum[i]) + from_bcd(mantissa[i])*from_bcd(n);
+    sum[i] = to_bcd(carry % 100);
+    carry /= 100;
+  }
+}
+
+/* Take the top two floats off the stack as the ROM does, unless either
+ * isn't BCD, which is left to the ROM along with errors */
+static int
+load_floats(Ace *ace, Floats *floats)
+{
+  unsigned char *workspace = floats->workspace;
+  unsigned char *x = floats->stack, *y = floats->stack+FLOAT_SIZE;
+  unsigned char x_exponent, y_exponent;
+  int i;
+
+  floats->addr = fetch2(ACE_SPARE) - FLOAT_SIZE*2;
+  for (i = 0; i < FLOAT_SIZE*2; i++)
+    floats->stack[i] = fetch((unsigned short)(floats->addr+i));
+  if (!bcd_valid(x, FLOAT_SIZE-1) || !bcd_valid(y, FLOAT_SIZE-1))
+    return 0;
+  for (i = 0; i < FP_WORKSPACE_SIZE; i++)
+    workspace[i] = fetch(FP_WORKSPACE+i);
+
+  x_exponent = x[FLOAT_SIZE-1];
+  y_exponent = y[FLOAT_SIZE-1];
+  x[FLOAT_SIZE-1] = y[FLOAT_SIZE-1] = 0;
+  memset(workspace, 0, FP_REMAINDER);
+  workspace[FP_EXPONENT] = y_exponent & 0x7f;
+  workspace[FP_EXPONENT2] = x_exponent & 0x7f;
+  workspace[FP_SIGNS] = (x_exponent & 0x80) | y_exponent >> 1;
+  return 1;
+}
+
+static void
+store_floats(Ace *ace, const Floats *floats)
+{
+  int i;
+
+  for (i = 0; i < FLOAT_SIZE*2; i++)
+    store((unsigned short)(floats->addr+i), floats->stack[i]);
+  for (i = 0; i < FP_WORKSPACE_SIZE; i++)
+    store(FP_WORKSPACE+i, floats->workspace[i]);
+  store2(ACE_SPARE, floats->addr+FLOAT_SIZE);
+}
+
+/* Normalise the result in place of the float below the top, as F+, F*
+ * and F/ finish.  Returns 0, leaving everything as it was, if the
+ * exponent overflows. */
+static int
+store_result(Ace *ace, Floats *floats)
+{
+  unsigned char *workspace = floats->workspace;
+  unsigned char *result = floats->stack;
+  unsigned char exponent, signs;
+
+  while (result[FLOAT_SIZE-1]) {
+    int digits = result[FLOAT_SIZE-1] < 0x10 ? 1 : 2;
+
+    workspace[FP_EXPONENT] += digits;
+    shift_right(result, digits);
+  }
+
+  exponent = workspace[FP_EXPONENT];
+  signs = workspace[FP_SIGNS];
+  if (exponent == 0 || exponent >= 0xc0)
+    memset(result, 0, FLOAT_SIZE);
+  else if (exponent >= 0x80)
+    return 0;
+  else
+    result[FLOAT_SIZE-1] = exponent | ((signs ^ signs << 1) & 0x80);
+  store_floats(ace, floats);
+  return 1;
+}
+
+static int
+store_zero(Ace *ace, Floats *floats)
+{
+  memset(floats->stack, 0, FLOAT_SIZE);
+  store_floats(ace, floats);
+  return 1;
+}
+
+/* ( f1 f2 -- f3 )
+ * Aligns the float with the smaller exponent, rounding, and adds in
+ * ten's complement */
+static int
+primitives_fplus(Ace *ace)
+{
+  Floats floats;
+  unsigned char *workspace = floats.workspace;
+  unsigned char *x = floats.stack, *y = floats.stack+FLOAT_SIZE;
+  unsigned char *smaller = x;
+  int digits;
+
+  if (!load_floats(ace, &floats))
+    return 0;
+
+  digits = workspace[FP_EXPONENT] - workspace[FP_EXPONENT2];
+  if (digits < 0) {
+    smaller = y;
+    digits = -digits;
+    workspace[FP_EXPONENT] = workspace[FP_EXPONENT2];
+  }
+  if (digits)
+    shift_right(smaller, digits);
+  if (workspace[FP_SIGNS] & 0x80)
+    negate_mantissa(x);
+  if (workspace[FP_SIGNS] & 0x40)
+    negate_mantissa(y);
+  add_product(x, y, 0x01);
+
+  workspace[FP_SIGNS] = x[FLOAT_SIZE-1] >= 0x98 ? 0x80 : 0;
+  if (workspace[FP_SIGNS])
+    negate_mantissa(x);
+
+  /* Shift up a byte at a time, and a sum of 0 is left as it is */
+  while (x[FLOAT_SIZE-1] == 0) {
+    int nonzero = x[0] | x[1] | x[2];
+
+    workspace[FP_EXPONENT] -= 2;
+    memmove(x+1, x, FLOAT_SIZE-1);
+    x[0] = 0;
+    if (!nonzero) {
+      store_floats(ace, &floats);
+      return 1;
+    }
+  }
+  return store_result(ace, &floats);
+}
+
+/* ( f1 f2 -- f3 )
+ * Without rounding the product's bottom four digits */
+static int
+primitives_fstar(Ace *ace)
+{
+  Floats floats;
+  unsigned char *workspace = floats.workspace;
+  unsigned char *x = floats.stack, *y = floats.stack+FLOAT_SIZE;
+  int i;
+
+  if (!load_floats(ace, &floats))
+    return 0;
+  if (!workspace[FP_EXPONENT] || !workspace[FP_EXPONENT2])
+    return store_zero(ace, &floats);
+
+  for (i = 0; i < FLOAT_SIZE-1; i++)
+    add_product(workspace+FP_DIGITS+i, y, x[i]);
+  workspace[FP_EXPONENT] += workspace[FP_EXPONENT2] - 0x42;
+  memcpy(x, workspace+FP_PRODUCT, FLOAT_SIZE);
+  return store_result(ace, &floats);
+}
+
+/* The ROM's estimate of the next quotient digit pair from the top two
+ * bytes of the remainder and one more than the top digit pair of the
+ * divisor, 0 standing for 100 */
+static unsigned char
+estimate_quotient(unsigned char high, unsigned char low,
+                  unsigned char divisor)
+{
+  if (!divisor)
+    return high;
+  return to_bcd((from_bcd(high)*100 + from_bcd(low)) / from_bcd(divisor));
+}
+
+/* ( f1 f2 -- f3 )
+ * Long division by subtracting multiples of the divisor from the
+ * remainder, five digit pairs' worth, with the quotient built up just
+ * below the remainder in the workspace.  Each digit pair is estimated
+ * from the divisor's top two digits, so the quotient can be one short. */
+static int
+primitives_fslash(Ace *ace)
+{
+  Floats floats;
+  unsigned char *workspace = floats.workspace;
+  unsigned char *x = floats.stack, *y = floats.stack+FLOAT_SIZE;
+  unsigned char divisor, exponent;
+  int top;
+
+  if (!load_floats(ace, &floats))
+    return 0;
+  if (!workspace[FP_EXPONENT2])
+    return store_zero(ace, &floats);
+  /* Dividing by 0 is an error.  The ROM takes ages to divide by an
+   * unnormalised mantissa, and forever if it's 0, so it can have those. */
+  if (!workspace[FP_EXPONENT] || y[FLOAT_SIZE-2] < 0x10)
+    return 0;
+
+  divisor = to_bcd((from_bcd(y[FLOAT_SIZE-2]) + 1) % 100);
+  negate_mantissa(y);
+  memcpy(workspace+FP_REMAINDER, x, FLOAT_SIZE);
+  for (top = FP_REMAINDER+FLOAT_SIZE-1; top >= FP_REMAINDER-1; top--) {
+    unsigned char digits;
+
+    while ((digits = estimate_quotient(workspace[top], workspace[top-1],
+                                       divisor)) != 0) {
+      add_product(workspace+top-3, y, digits);
+      workspace[FP_DIGITS] = digits;
+      add_product(workspace+top-8, workspace+FP_DIGITS, 0x01);
+    }
+  }
+
+  exponent = workspace[FP_EXPONENT2] - workspace[FP_EXPONENT] + 0x40;
+  if (workspace[FP_QUOTIENT+FLOAT_SIZE]) {
+    memcpy(x, workspace+FP_QUOTIENT+1, FLOAT_SIZE);
+  } else {
+    exponent -= 2;
+    memcpy(x, workspace+FP_QUOTIENT, FLOAT_SIZE);
+  }
+  workspace[FP_EXPONENT] = exponent;
+  return store_result(ace, &floats);
+}
+
+/* ( f -- -f ) leaving 0 as it is */
+static int
+primitives_fnegate(Ace *ace)
+{
+  unsigned short high = pop(ace);
+
+  push(ace, high & 0xff00 ? high ^ 0x8000 : high);
+  return 1;
+}
+
+/* ( f -- n )
+ * Shifts the integer digits out of the top of the mantissa, into a
+ * cell that can overflow */
+static int
+primitives_int(Ace *ace)
+{
+  unsigned short addr = fetch2(ACE_SPARE) - FLOAT_SIZE;
+  unsigned char mantissa[FLOAT_SIZE];
+  unsigned short n = 0;
+  int i;
+
+  for (i = 0; i < FLOAT_SIZE; i++)
+    mantissa[i] = fetch((unsigned short)(addr+i));
+
+  /* While the exponent, ignoring the sign, is at least 0x41 */
+  while (((mantissa[3] << 1 | mantissa[3] >> 7) & 0xff) >= 0x82) {
+    n = n*10 + (mantissa[2] >> 4);
+    for (i = FLOAT_SIZE-2; i > 0; i--)
+      mantissa[i] = mantissa[i] << 4 | mantissa[i-1] >> 4;
+    mantissa[0] <<= 4;
+    mantissa[3]--;
+  }
+
+  pop(ace);
+  pop(ace);
+  push(ace, apply_sign(n, mantissa[3] << 8));
+  return 1;
+}
+
+/* ( u -- f ) */
+static int
+primitives_ufloat(Ace *ace)
+{
+  unsigned short u = pop(ace);
+  unsigned char mantissa[FLOAT_SIZE];
+  int i;
+
+  mantissa[0] = to_bcd(u % 100);
+  mantissa[1] = to_bcd(u / 100 % 100);
+  mantissa[2] = u / 10000;
+  mantissa[3] = 0x46;
+  for (i = 0; i < 6 && !(mantissa[2] & 0xf0); i++) {
+    mantissa[2] = mantissa[2] << 4 | mantissa[1] >> 4;
+    mantissa[1] = mantissa[1] << 4 | mantissa[0] >> 4;
+    mantissa[0] <<= 4;
+    mantissa[3]--;
+  }
+  if (i == 6)
+    mantissa[3] = 0;
+
+  push(ace, (mantissa[1] << 8) | mantissa[0]);
+  push(ace, (mantissa[3] << 8) | mantissa[2]);
+  return 1;
+}
@@ -0,0 +1,49 @@
+/* Declarations for running the ROM's Forth primitives natively
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include "ace.h"
+
+/* The ED instruction put at the start of a primitive, followed by the
+ * number of the primitive to run */
+#define PRIMITIVES_TRAP 0xfe
+
+/* Put a trap at the start of each primitive in ace's ROM.  A primitive
+ * that the Z80 or the Forth it is running is part way through is left
+ * alone, as is any whose code isn't that of the Ace's ROM. */
+extern void primitives_patch(Ace *ace);
+
+/* Put back the ROM's code where primitives_patch() put a trap */
+extern void primitives_unpatch(Ace *ace);
+
+typedef enum PrimitivesStatus {
+  PRIMITIVES_NO_TRAP,   /* Nothing was done */
+  PRIMITIVES_RAN,       /* The primitive was run */
+  PRIMITIVES_CALL_ROM   /* The ROM's routine must be called instead */
+} PrimitivesStatus;
+
+/* Run the primitive whose trap is at addr on ace's data stack.  Some
+ * primitives leave what they can't do the same as the ROM to the ROM, in
+ * which case *routine is set to the address of the routine that the code
+ * replaced by the trap calls, for the caller to call instead. */
+extern PrimitivesStatus primitives_run(Ace *ace, unsigned short addr,
+                                       unsigned short *routine);
+
+#endif
@@ -0,0 +1,506 @@
+/* Profiling the Forth words run by an Ace
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ * --------------------------------------------------------------------------
+ *
+ * The ROM's inner interpreter keeps the Forth instruction pointer on the
+ * Z80 stack, which is also the return stack.  Each colon definition
+ * being run leaves the address after the cell it is running, so a sample
+ * walks up the Z80 stack from SP looking for addresses that are just
+ * after a code field address in the body of a colon definition.  The
+ * innermost one gives the word being run and the others the words that
+ * called it.  Other values on the return stack, such as loop counters,
+ * are very unlikely to pass this test.
+ *
+ * The words are found by walking each vocabulary in the dictionary.  A
+ * word's header is its name, with bit 7 set on the last character, a
+ * length field in RAM words only, a link field pointing to the previous
+ * word's name length field, the name length field and then the code
+ * field.  The index is rebuilt whenever the dictionary changes.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+
+#define PROFILER_MAX_WORDS 1024
+#define PROFILER_MAX_NAME 64
+#define PROFILER_MAX_VOCABULARIES 64
+/* Colon definitions being run that will be included in a stack */
+#define PROFILER_MAX_DEPTH 64
+/* Return stack entries looked at for each sample */
+#define PROFILER_MAX_SLOTS 256
+/* Each name can be escaped to three times its length in a stack */
+#define PROFILER_MAX_STACK ((PROFILER_MAX_DEPTH+1)*(PROFILER_MAX_NAME*3+1))
+
+/* The code run for a colon definition */
+#define PROFILER_DOCOLON 0x0ec3
+
+typedef struct ProfilerWord {
+  unsigned short start;       /* First byte of the header */
+  unsigned short cfa;
+  unsigned short end;         /* One after the last byte of the word */
+  int colon;
+  char name[PROFILER_MAX_NAME];
+} ProfilerWord;
+
+typedef struct ProfilerCount {
+  char *key;
+  unsigned long self;         /* Samples with this as the word being run */
+  unsigned long total;        /* Samples with this anywhere in the stack */
+} ProfilerCount;
+
+/* A hash table of counts, kept at most half full */
+typedef struct ProfilerTable {
+  ProfilerCount *counts;
+  int size;
+  int used;
+} ProfilerTable;
+
+struct Profiler {
+  Ace *ace;
+  int event;
+  unsigned long samples;
+  /* The dictionary as it was when the words were indexed */
+  int indexed;
+  unsigned short indexed_voclnk, indexed_stkbot, indexed_dict;
+  /* Sorted by address */
+  ProfilerWord words[PROFILER_MAX_WORDS];
+  int num_words;
+  unsigned char visited[65536/8];
+  ProfilerTable word_counts;
+  ProfilerTable stack_counts;
+};
+
+/* Words compiled by the ROM that aren't in the dictionary */
+static const struct {
+  unsigned short cfa;
+  const char *name;
+} internal_words[] = {
+  {0x04b6, "(EXIT)"},
+  {0x1011, "(LIT)"},
+  {0x1064, "(FLIT)"},
+  {0x1271, "(ELSE)"},
+  {0x1276, "(REPEAT)"},
+  {0x1283, "(IF)"},
+  {0x1288, "(WHILE)"},
+  {0x128d, "(UNTIL)"},
+  {0x129f, "(BEGIN)"},
+  {0x12a4, "(THEN)"},
+  {0x1323, "(DO)"},
+  {0x1332, "(LOOP)"},
+  {0x133c, "(+LOOP)"},
+  {0x1396, "(.\")"}
+};
+
+static unsigned short
+peek2(Profiler *profiler, unsigned int addr)
+{
+  unsigned char *mem = profiler->ace->mem;
+
+  return mem[addr & 0xffff] | (mem[(addr+1) & 0xffff] << 8);
+}
+
+static unsigned long
+hash_key(const char *key)
+{
+  unsigned long hash = 2166136261UL;
+
+  while (*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+/* Return the count for key, adding it if it isn't there, or NULL if
+ * there isn't the memory */
+static ProfilerCount *
+profiler_table_find(ProfilerTable *table, const char *key)
+{
+  ProfilerCount *old_counts = table->counts;
+  int old_size = table->size, i, pos;
+
+  if (table->used*2 >= table->size) {
+    table->size = table->size ? table->size*2 : 256;
+    table->counts = calloc(table->size, sizeof(ProfilerCount));
+    if (!table->counts) {
+      table->counts = old_counts;
+      table->size = old_size;
+      return NULL;
+    }
+    for (i = 0; i < old_size; i++) {
+      if (!old_counts[i].key) continue;
+      pos = hash_key(old_counts[i].key) % table->size;
+      while (table->counts[pos].key)
+        pos = (pos+1) % table->size;
+      table->counts[pos] = old_counts[i];
+    }
+    free(old_counts);
+  }
+
+  pos = hash_key(key) % table->size;
+  while (table->counts[pos].key) {
+    if (strcmp(table->counts[pos].key, key) == 0)
+      return &table->counts[pos];
+    pos = (pos+1) % table->size;
+  }
+  if (!(table->counts[pos].key = strdup(key)))
+    return NULL;
+  table->used++;
+  return &table->counts[pos];
+}
+
+static void
+profiler_table_free(ProfilerTable *table)
+{
+  int i;
+
+  for (i = 0; i < table->size; i++)
+    free(table->counts[i].key);
+  free(table->counts);
+  table->counts = NULL;
+  table->size = table->used = 0;
+}
+
+/* Return the counts in use, sorted by compare, or NULL */
+static ProfilerCount **
+profiler_table_sorted(ProfilerTable *table,
+                      int (*compare)(const void *, const void *))
+{
+  ProfilerCount **sorted;
+  int i, n = 0;
+
+  sorted = malloc((table->used+1)*sizeof(ProfilerCount *));
+  if (!sorted) return NULL;
+  for (i = 0; i < table->size; i++) {
+    if (table->counts[i].key)
+      sorted[n++] = &table->counts[i];
+  }
+  qsort(sorted, n, sizeof(ProfilerCount *), compare);
+  return sorted;
+}
+
+static void
+profiler_add_word(Profiler *profiler, unsigned short nlf)
+{
+  unsigned char *mem = profiler->ace->mem;
+  int length = mem[nlf] & 0x3f;
+  ProfilerWord *word;
+  int i, c;
+
+  if (length == 0 || profiler->num_words == PROFILER_MAX_WORDS)
+    return;
+
+  word = &profiler->words[profiler->num_words++];
+  word->cfa = nlf+1;
+  word->start = (nlf < ACE_ROM_SIZE ? nlf-2 : nlf-4) - length;
+  word->colon = peek2(profiler, word->cfa) == PROFILER_DOCOLON;
+  for (i = 0; i < length; i++) {
+    c = mem[(word->start+i) & 0xffff] & 0x7f;
+    word->name[i] = (c > ' ' && c < 127) ? c : '?';
+  }
+  word->name[length] = 0;
+}
+
+static int
+compare_words(const void *a, const void *b)
+{
+  return ((const ProfilerWord *)a)->start - ((const ProfilerWord *)b)->start;
+}
+
+/* Each word is taken to end where the next one starts, or at the end of
+ * the ROM or dictionary */
+static void
+profiler_index_words(Profiler *profiler)
+{
+  unsigned short voclnk = peek2(profiler, ACE_VOCLNK);
+  unsigned short stkbot = peek2(profiler, ACE_STKBOT);
+  unsigned short vocabulary, nlf, region_end;
+  int vocabularies, i;
+
+  profiler->num_words = 0;
+  memset(profiler->visited, 0, sizeof(profiler->visited));
+  vocabulary = voclnk;
+  for (vocabularies = 0; vocabulary && vocabularies < PROFILER_MAX_VOCABULARIES;
+       vocabularies++) {
+    nlf = peek2(profiler, vocabulary-3);
+    while (nlf && !(profiler->visited[nlf>>3] & (1<<(nlf&7)))) {
+      profiler->visited[nlf>>3] |= 1<<(nlf&7);
+      profiler_add_word(profiler, nlf);
+      nlf = peek2(profiler, nlf-2);
+    }
+    vocabulary = peek2(profiler, vocabulary);
+  }
+
+  qsort(profiler->words, profiler->num_words, sizeof(ProfilerWord),
+        compare_words);
+  for (i = 0; i < profiler->num_words; i++) {
+    region_end = profiler->words[i].start < ACE_ROM_SIZE ?
+                 ACE_ROM_SIZE : stkbot;
+    if (i+1 < profiler->num_words &&
+        profiler->words[i+1].start < region_end)
+      profiler->words[i].end = profiler->words[i+1].start;
+    else
+      profiler->words[i].end = region_end;
+  }
+
+  profiler->indexed = 1;
+  profiler->indexed_voclnk = voclnk;
+  profiler->indexed_stkbot = stkbot;
+  profiler->indexed_dict = peek2(profiler, ACE_DICT);
+}
+
+/* Return the word whose header or body holds addr, or NULL */
+static ProfilerWord *
+profiler_find_word(Profiler *profiler, unsigned short addr)
+{
+  int low = 0, high = profiler->num_words-1, mid;
+  ProfilerWord *word = NULL;
+
+  while (low <= high) {
+    mid = (low+high)/2;
+    if (profiler->words[mid].start <= addr) {
+      word = &profiler->words[mid];
+      low = mid+1;
+    } else {
+      high = mid-1;
+    }
+  }
+  return (word && addr < word->end) ? word : NULL;
+}
+
+/* Return the name of the word with code field address cfa, or NULL */
+static const char *
+profiler_word_name(Profiler *profiler, unsigned short cfa)
+{
+  ProfilerWord *word = profiler_find_word(profiler, cfa);
+  int i;
+
+  if (word && word->cfa == cfa)
+    return word->name;
+  for (i = 0; i < sizeof(internal_words)/sizeof(internal_words[0]); i++) {
+    if (internal_words[i].cfa == cfa)
+      return internal_words[i].name;
+  }
+  return NULL;
+}
+
+/* Add name to a collapsed stack, with any ; escaped as it separates the
+ * words */
+static char *
+append_stack_name(char *stack, const char *name)
+{
+  for (; *name; name++) {
+    if (*name == ';') {
+      memcpy(stack, "%3B", 3);
+      stack += 3;
+    } else {
+      *stack++ = *name;
+    }
+  }
+  *stack = 0;
+  return stack;
+}
+
+static void
+profiler_count_word(Profiler *profiler, const char *name, int self)
+{
+  ProfilerCount *count = profiler_table_find(&profiler->word_counts, name);
+
+  if (!count) return;
+  if (self) count->self++;
+  count->total++;
+}
+
+void
+profiler_sample(Profiler *profiler)
+{
+  Ace *ace = profiler->ace;
+  const char *frames[PROFILER_MAX_DEPTH];
+  char stack[PROFILER_MAX_STACK], *stack_end;
+  const char *leaf = NULL, *callee;
+  ProfilerWord *caller;
+  ProfilerCount *count;
+  unsigned int slot, stack_top;
+  unsigned short ip;
+  int depth = 0, slots, i, j;
+
+  if (!profiler->indexed ||
+      peek2(profiler, ACE_VOCLNK) != profiler->indexed_voclnk ||
+      peek2(profiler, ACE_STKBOT) != profiler->indexed_stkbot ||
+      peek2(profiler, ACE_DICT) != profiler->indexed_dict)
+    profiler_index_words(profiler);
+
+  stack_top = peek2(profiler, ACE_RAMTOP);
+  if (stack_top == 0) stack_top = 0x10000;
+  slot = ace->z80.sp;
+  for (slots = 0; slot+1 < stack_top && slots < PROFILER_MAX_SLOTS &&
+       depth < PROFILER_MAX_DEPTH; slots++, slot += 2) {
+    ip = peek2(profiler, slot);
+    caller = profiler_find_word(profiler, ip-2);
+    if (!caller || !caller->colon || ip-2 < caller->cfa+2) continue;
+    callee = profiler_word_name(profiler, peek2(profiler, ip-2));
+    if (!callee) continue;
+    if (!leaf) leaf = callee;
+    frames[depth++] = caller->name;
+  }
+  if (!leaf)
+    leaf = ace->z80.pc < ACE_ROM_SIZE ? "(ROM code)" : "(RAM code)";
+
+  stack_end = stack;
+  for (i = depth-1; i >= 0; i--) {
+    stack_end = append_stack_name(stack_end, frames[i]);
+    *stack_end++ = ';';
+  }
+  append_stack_name(stack_end, leaf);
+  if ((count = profiler_table_find(&profiler->stack_counts, stack)))
+    count->total++;
+
+  /* A word called recursively still only counts once in its total */
+  profiler_count_word(profiler, leaf, 1);
+  for (i = 0; i < depth; i++) {
+    if (strcmp(frames[i], leaf) == 0) continue;
+    for (j = 0; j < i && strcmp(frames[i], frames[j]) != 0; j++)
+      ;
+    if (j == i)
+      profiler_count_word(profiler, frames[i], 0);
+  }
+  profiler->samples++;
+}
+
+static void
+profiler_event(void *context)
+{
+  profiler_sample(context);
+}
+
+Profiler *
+profiler_create(Ace *ace)
+{
+  Profiler *profiler = calloc(1, sizeof(Profiler));
+
+  if (!profiler) return NULL;
+  profiler->ace = ace;
+  profiler->event = scheduler_add_event(&ace->scheduler,
+                                        ace->tstates+PROFILER_PERIOD,
+                                        PROFILER_PERIOD, profiler_event,
+                                        profiler);
+  if (profiler->event < 0) {
+    free(profiler);
+    return NULL;
+  }
+  return profiler;
+}
+
+void
+profiler_destroy(Profiler *profiler)
+{
+  scheduler_remove_event(&profiler->ace->scheduler, profiler->event);
+  profiler_table_free(&profiler->word_counts);
+  profiler_table_free(&profiler->stack_counts);
+  free(profiler);
+}
+
+void
+profiler_reset(Profiler *profiler)
+{
+  profiler_table_free(&profiler->word_counts);
+  profiler_table_free(&profiler->stack_counts);
+  profiler->samples = 0;
+}
+
+static int
+compare_word_counts(const void *a, const void *b)
+{
+  const ProfilerCount *count_a = *(ProfilerCount * const *)a;
+  const ProfilerCount *count_b = *(ProfilerCount * const *)b;
+
+  if (count_a->self != count_b->self)
+    return count_a->self < count_b->self ? 1 : -1;
+  if (count_a->total != count_b->total)
+    return count_a->total < count_b->total ? 1 : -1;
+  return strcmp(count_a->key, count_b->key);
+}
+
+static int
+compare_stack_counts(const void *a, const void *b)
+{
+  return strcmp((*(ProfilerCount * const *)a)->key,
+                (*(ProfilerCount * const *)b)->key);
+}
+
+static double
+percent(unsigned long part, unsigned long whole)
+{
+  return whole ? 100.0*part/whole : 0.0;
+}
+
+void
+profiler_print_flat(Profiler *profiler, FILE *fp)
+{
+  ProfilerCount **sorted;
+  int i;
+
+  fprintf(fp, "%lu samples, one every %d T-states\n\n", profiler->samples,
+          PROFILER_PERIOD);
+  fprintf(fp, "%10s %7s %10s %7s  %s\n",
+          "Self", "Self%", "Total", "Total%", "Word");
+  sorted = profiler_table_sorted(&profiler->word_counts,
+                                 compare_word_counts);
+  if (!sorted) return;
+  for (i = 0; i < profiler->word_counts.used; i++) {
+    fprintf(fp, "%10lu %7.2f %10lu %7.2f  %s\n",
+            sorted[i]->self, percent(sorted[i]->self, profiler->samples),
+            sorted[i]->total, percent(sorted[i]->total, profiler->samples),
+            sorted[i]->key);
+  }
+  free(sorted);
+}
+
+void
+profiler_print_folded(Profiler *profiler, FILE *fp)
+{
+  ProfilerCount **sorted;
+  int i;
+
+  sorted = profiler_table_sorted(&profiler->stack_counts,
+                                 compare_stack_counts);
+  if (!sorted) return;
+  for (i = 0; i < profiler->stack_counts.used; i++)
+    fprintf(fp, "%s %lu\n", sorted[i]->key, sorted[i]->total);
+  free(sorted);
+}
+
+int
+profiler_write(Profiler *profiler, const char *filename)
+{
+  char folded_filename[FILENAME_MAX];
+  FILE *fp;
+
+  if ((fp = fopen(filename, "w")) == NULL)
+    return -1;
+  profiler_print_flat(profiler, fp);
+  if (fclose(fp) != 0)
+    return -1;
+
+  snprintf(folded_filename, sizeof(folded_filename), "%s.folded", filename);
+  if ((fp = fopen(folded_filename, "w")) == NULL)
+    return -1;
+  profiler_print_folded(profiler, fp);
+  return fclose(fp) == 0 ? 0 : -1;
+}
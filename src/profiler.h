@@ -0,0 +1,57 @@
+/* Declarations for profiling the Forth words run by an Ace
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+
+#include "ace.h"
+
+/* T-states between samples.  This is prime so that the samples don't
+ * keep falling at the same point of a loop or of the frame. */
+#define PROFILER_PERIOD 9973
+
+typedef struct Profiler Profiler;
+
+/* Return a profiler sampling the words being run by ace every
+ * PROFILER_PERIOD T-states, or NULL if there isn't the memory for one */
+extern Profiler *profiler_create(Ace *ace);
+extern void profiler_destroy(Profiler *profiler);
+
+/* Forget the samples taken so far, e.g. to profile a forked run apart
+ * from the machine it was forked from */
+extern void profiler_reset(Profiler *profiler);
+
+/* Take a sample now.  This must be called from an event or between
+ * steps, as it reads the registers from ace->z80. */
+extern void profiler_sample(Profiler *profiler);
+
+/* Write the samples taken for each word, most run first, as the word
+ * itself and including the words it called */
+extern void profiler_print_flat(Profiler *profiler, FILE *fp);
+
+/* Write a count for each stack of words sampled, in the collapsed
+ * format used by flame graph tools, e.g. "QUIT;MAIN;FOO;+ 12" */
+extern void profiler_print_folded(Profiler *profiler, FILE *fp);
+
+/* Write the flat profile to filename and the collapsed stacks to
+ * filename with .folded added.  Returns 0 on success or -1 on failure. */
+extern int profiler_write(Profiler *profiler, const char *filename);
+
+#endif
@@ -0,0 +1,122 @@
+/* T-state driven event scheduler
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ * --------------------------------------------------------------------------
+ *
+ * Events are kept in a small table keyed on the absolute T-state count
+ * at which they are due.  There are only ever a handful of events so the
+ * table is scanned to find the earliest rather than being kept sorted.
+ */
+#include <limits.h>
+#include <stdio.h>
+
+#include "scheduler.h"
+
+static void
+scheduler_update_deadline(Scheduler *scheduler)
+{
+  SchedulerEvent *events = scheduler->events;
+  int i;
+
+  scheduler->deadline = ULLONG_MAX;
+  for (i = 0; i < SCHEDULER_MAX_EVENTS; i++) {
+    if (events[i].active && events[i].due < scheduler->deadline)
+      scheduler->deadline = events[i].due;
+  }
+}
+
+void
+scheduler_init(Scheduler *scheduler)
+{
+  int i;
+
+  for (i = 0; i < SCHEDULER_MAX_EVENTS; i++)
+    scheduler->events[i].active = 0;
+  scheduler_update_deadline(scheduler);
+}
+
+int
+scheduler_add_event(Scheduler *scheduler, unsigned long long due,
+                    unsigned long period, SchedulerEventHandler handler,
+                    void *context)
+{
+  SchedulerEvent *events = scheduler->events;
+  int i;
+
+  for (i = 0; i < SCHEDULER_MAX_EVENTS; i++) {
+    if (!events[i].active) {
+      events[i].active = 1;
+      events[i].due = due;
+      events[i].period = period;
+      events[i].handler = handler;
+      events[i].context = context;
+      scheduler_update_deadline(scheduler);
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+void
+scheduler_remove_event(Scheduler *scheduler, int event_id)
+{
+  if (event_id >= 0 && event_id < SCHEDULER_MAX_EVENTS) {
+    scheduler->events[event_id].active = 0;
+    scheduler_update_deadline(scheduler);
+  }
+}
+
+void
+scheduler_set_period(Scheduler *scheduler, int event_id,
+                     unsigned long period)
+{
+  if (event_id >= 0 && event_id < SCHEDULER_MAX_EVENTS)
+    scheduler->events[event_id].period = period;
+}
+
+void
+scheduler_realign(Scheduler *scheduler, unsigned long long now)
+{
+  SchedulerEvent *events = scheduler->events;
+  int i;
+
+  for (i = 0; i < SCHEDULER_MAX_EVENTS; i++) {
+    if (events[i].active && events[i].period)
+      events[i].due = (now/events[i].period+1)*events[i].period;
+  }
+  scheduler_update_deadline(scheduler);
+}
+
+void
+scheduler_run(Scheduler *scheduler, unsigned long long now)
+{
+  SchedulerEvent *events = scheduler->events;
+  int i;
+
+  for (i = 0; i < SCHEDULER_MAX_EVENTS; i++) {
+    if (events[i].active && events[i].due <= now) {
+      if (events[i].period)
+        events[i].due += events[i].period;
+      else
+        events[i].active = 0;
+      events[i].handler(events[i].context);
+    }
+  }
+
+  scheduler_update_deadline(scheduler);
+}
@@ -0,0 +1,68 @@
+/* Declarations for the T-state driven event scheduler
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#define SCHEDULER_MAX_EVENTS 8
+
+/* context is the pointer given when the event was added */
+typedef void (*SchedulerEventHandler)(void *context);
+
+typedef struct SchedulerEvent {
+  int active;
+  unsigned long long due;
+  unsigned long period;
+  SchedulerEventHandler handler;
+  void *context;
+} SchedulerEvent;
+
+typedef struct Scheduler {
+  /**
+   * The T-state count at which the next event is due.  The CPU loop only
+   * has to compare this against the T-state count after each instruction
+   * and call scheduler_run() once it has been reached.
+   */
+  unsigned long long deadline;
+  SchedulerEvent events[SCHEDULER_MAX_EVENTS];
+} Scheduler;
+
+extern void scheduler_init(Scheduler *scheduler);
+
+/**
+ * Add an event and return its id, or -1 if there is no room
+ * due - Absolute T-state count at which the event is first due
+ * period - T-states between repeats of the event, or 0 to run it once
+ * handler - Function to call when the event is due
+ * context - Passed to handler
+ */
+extern int scheduler_add_event(Scheduler *scheduler, unsigned long long due,
+                               unsigned long period,
+                               SchedulerEventHandler handler, void *context);
+extern void scheduler_remove_event(Scheduler *scheduler, int event_id);
+extern void scheduler_set_period(Scheduler *scheduler, int event_id,
+                                 unsigned long period);
+
+/* Move each repeating event to the first multiple of its period after
+ * now, e.g. after the T-state count has been changed by a snapshot */
+extern void scheduler_realign(Scheduler *scheduler, unsigned long long now);
+
+/* Run every event that is due at T-state count now */
+extern void scheduler_run(Scheduler *scheduler, unsigned long long now);
+
+#endif
@@ -0,0 +1,246 @@
+/* Save and load snapshots of the machine
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ * --------------------------------------------------------------------------
+ *
+ * A snapshot file is made up of:
+ *   "XACESNAP" and a version byte
+ *   The registers: a f b c d e h l a' f' b' c' d' e' h' l' i r iff1 iff2
+ *     im intsample and the low byte of radjust, then ix iy sp pc
+ *   tstates, interrupted and the 8 keyboard ports
+ *   The tape: filename length and filename, position, load_header,
+ *     save_header and empty_tape_bytes
+ *   The 64K of memory, run length encoded
+ *
+ * Words are stored little endian.  In the memory, 0xED 0xED n b stands
+ * for n copies of b.  This is used for runs of 4 or more bytes and for
+ * every 0xED, so a lone 0xED never appears.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "XACESNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_RLE_MARKER 0xed
+#define SNAPSHOT_RLE_MIN_RUN 4
+
+static void
+put_bytes(FILE *fp, unsigned long long value, int num_bytes)
+{
+  int i;
+
+  for (i = 0; i < num_bytes; i++) {
+    fputc(value & 0xff, fp);
+    value >>= 8;
+  }
+}
+
+/* Returns 1 if the end of file is reached */
+static int
+get_bytes(FILE *fp, unsigned long long *value, int num_bytes)
+{
+  int i, c;
+
+  *value = 0;
+  for (i = 0; i < num_bytes; i++) {
+    if ((c = fgetc(fp)) == EOF)
+      return 1;
+    if (i < sizeof(unsigned long long))
+      *value |= (unsigned long long)c << (i*8);
+  }
+  return 0;
+}
+
+static void
+write_registers(FILE *fp, const Z80State *z80)
+{
+  const unsigned char regs[] = {
+    z80->a, z80->f, z80->b, z80->c, z80->d, z80->e, z80->h, z80->l,
+    z80->a1, z80->f1, z80->b1, z80->c1, z80->d1, z80->e1, z80->h1, z80->l1,
+    z80->i, z80->r, z80->iff1, z80->iff2, z80->im, z80->intsample,
+    z80->radjust & 0xff
+  };
+
+  fwrite(regs, 1, sizeof(regs), fp);
+  put_bytes(fp, z80->ix, 2);
+  put_bytes(fp, z80->iy, 2);
+  put_bytes(fp, z80->sp, 2);
+  put_bytes(fp, z80->pc, 2);
+}
+
+static int
+read_registers(FILE *fp, Z80State *z80)
+{
+  unsigned char regs[23];
+  unsigned long long ix, iy, sp, pc;
+
+  if (fread(regs, 1, sizeof(regs), fp) != sizeof(regs) ||
+      get_bytes(fp, &ix, 2) || get_bytes(fp, &iy, 2) ||
+      get_bytes(fp, &sp, 2) || get_bytes(fp, &pc, 2))
+    return 1;
+
+  z80->a = regs[0]; z80->f = regs[1]; z80->b = regs[2]; z80->c = regs[3];
+  z80->d = regs[4]; z80->e = regs[5]; z80->h = regs[6]; z80->l = regs[7];
+  z80->a1 = regs[8]; z80->f1 = regs[9]; z80->b1 = regs[10];
+  z80->c1 = regs[11]; z80->d1 = regs[12]; z80->e1 = regs[13];
+  z80->h1 = regs[14]; z80->l1 = regs[15];
+  z80->i = regs[16]; z80->r = regs[17]; z80->iff1 = regs[18];
+  z80->iff2 = regs[19]; z80->im = regs[20]; z80->intsample = regs[21];
+  z80->radjust = regs[22];
+  z80->ix = ix; z80->iy = iy; z80->sp = sp; z80->pc = pc;
+  return 0;
+}
+
+static void
+write_tape(FILE *fp, const TapeState *tape)
+{
+  int filename_len = strlen(tape->filename);
+
+  put_bytes(fp, filename_len, 2);
+  fwrite(tape->filename, 1, filename_len, fp);
+  put_bytes(fp, tape->pos, 4);
+  fputc(tape->load_header, fp);
+  fputc(tape->save_header, fp);
+  fputc(tape->empty_tape_bytes, fp);
+}
+
+static int
+read_tape(FILE *fp, TapeState *tape)
+{
+  unsigned long long filename_len, pos, flags;
+
+  if (get_bytes(fp, &filename_len, 2) ||
+      filename_len > TAPE_MAX_FILENAME_SIZE ||
+      fread(tape->filename, 1, filename_len, fp) != filename_len ||
+      get_bytes(fp, &pos, 4) || get_bytes(fp, &flags, 3))
+    return 1;
+
+  tape->filename[filename_len] = 0;
+  tape->pos = pos;
+  tape->load_header = flags & 0xff;
+  tape->save_header = (flags >> 8) & 0xff;
+  tape->empty_tape_bytes = flags >> 16;
+  return 0;
+}
+
+static void
+write_mem(FILE *fp, const unsigned char *mem)
+{
+  unsigned int addr = 0;
+  int run;
+
+  while (addr < 65536) {
+    for (run = 1;
+         addr+run < 65536 && run < 255 && mem[addr+run] == mem[addr];
+         run++)
+      ;
+
+    if (run >= SNAPSHOT_RLE_MIN_RUN || mem[addr] == SNAPSHOT_RLE_MARKER) {
+      fputc(SNAPSHOT_RLE_MARKER, fp);
+      fputc(SNAPSHOT_RLE_MARKER, fp);
+      fputc(run, fp);
+      fputc(mem[addr], fp);
+    } else {
+      fwrite(mem+addr, 1, run, fp);
+    }
+    addr += run;
+  }
+}
+
+static int
+read_mem(FILE *fp, unsigned char *mem)
+{
+  unsigned int addr = 0;
+  int c, run, value;
+
+  while (addr < 65536) {
+    if ((c = fgetc(fp)) == EOF)
+      return 1;
+
+    if (c == SNAPSHOT_RLE_MARKER) {
+      if (fgetc(fp) != SNAPSHOT_RLE_MARKER ||
+          (run = fgetc(fp)) == EOF || (value = fgetc(fp)) == EOF ||
+          run == 0 || addr+run > 65536)
+        return 1;
+      memset(mem+addr, value, run);
+      addr += run;
+    } else {
+      mem[addr++] = c;
+    }
+  }
+  return 0;
+}
+
+int
+snapshot_write(const char *filename, const Snapshot *snapshot)
+{
+  FILE *fp;
+  int error;
+
+  if ((fp = fopen(filename, "wb")) == NULL)
+    return 1;
+
+  fwrite(SNAPSHOT_MAGIC, 1, strlen(SNAPSHOT_MAGIC), fp);
+  fputc(SNAPSHOT_VERSION, fp);
+  write_registers(fp, &snapshot->z80);
+  put_bytes(fp, snapshot->tstates, 8);
+  fputc(snapshot->interrupted, fp);
+  fwrite(snapshot->keyboard_ports, 1, 8, fp);
+  write_tape(fp, &snapshot->tape);
+  write_mem(fp, snapshot->mem);
+
+  error = ferror(fp);
+  if (fclose(fp) != 0)
+    error = 1;
+  return error ? 1 : 0;
+}
+
+int
+snapshot_read(const char *filename, Snapshot *snapshot)
+{
+  FILE *fp;
+  char magic[sizeof(SNAPSHOT_MAGIC)];
+  unsigned long long tstates;
+  int interrupted;
+  int error = 1;
+
+  if ((fp = fopen(filename, "rb")) == NULL)
+    return 1;
+
+  if (fread(magic, 1, strlen(SNAPSHOT_MAGIC), fp) != strlen(SNAPSHOT_MAGIC) ||
+      memcmp(magic, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0 ||
+      fgetc(fp) != SNAPSHOT_VERSION)
+    goto done;
+
+  if (read_registers(fp, &snapshot->z80) ||
+      get_bytes(fp, &tstates, 8) ||
+      (interrupted = fgetc(fp)) == EOF ||
+      fread(snapshot->keyboard_ports, 1, 8, fp) != 8 ||
+      read_tape(fp, &snapshot->tape) ||
+      read_mem(fp, snapshot->mem))
+    goto done;
+
+  snapshot->tstates = tstates;
+  snapshot->interrupted = interrupted;
+  error = 0;
+
+done:
+  fclose(fp);
+  return error;
+}
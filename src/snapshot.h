@@ -0,0 +1,43 @@
+/* Declarations for saving and loading snapshots of the machine
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdio.h>
+
+#include "ace.h"
+#include "tape.h"
+
+typedef struct Snapshot {
+  Z80State z80;
+  unsigned long long tstates;
+  int interrupted;
+  unsigned char keyboard_ports[8];
+  TapeState tape;
+  unsigned char mem[65536];
+} Snapshot;
+
+/* Returns 0 on success, or 1 if the file couldn't be written */
+extern int snapshot_write(const char *filename, const Snapshot *snapshot);
+
+/* Returns 0 on success, or 1 if the file couldn't be read or isn't a
+ * snapshot.  snapshot is undefined after a failure. */
+extern int snapshot_read(const char *filename, Snapshot *snapshot);
+
+#endif
@@ -18,87 +18,196 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <X11/Xlib.h>
 
 #include "spooler.h"
 
-static FILE *spooler_file = NULL;
-static enum {
-  SPOOLER_INACTIVE,
-  SPOOLER_READ_CHAR,
-  SPOOLER_CLEAR_CHAR
-} spooler_state = SPOOLER_INACTIVE;
-
-static SpoolerObserver spooler_observer = NULL;
-static ClearKeyboardFunc clear_keyboard = NULL;
-static KeypressFunc keypress = NULL;
+/* In SPOOLER_FAST_KEYS mode, the calls to wait for a key to be taken
+ * before deciding that the machine doesn't have it on its keyboard */
+#define SPOOLER_MAX_KEY_POLLS 8
 
 void
-spooler_init(SpoolerObserver spooler_observer_func,
+spooler_init(Spooler *spooler,
+             SpoolerObserver spooler_observer_func,
              ClearKeyboardFunc clear_keyboard_func,
-             KeypressFunc keypress_func)
+             KeypressFunc keypress_func,
+             KeyStateFunc key_state_func,
+             EnterLineFunc enter_line_func,
+             void *context)
+{
+  spooler->file = NULL;
+  spooler->state = SPOOLER_INACTIVE;
+  spooler->mode = SPOOLER_KEYS;
+  spooler->polls = 0;
+  spooler->line_length = 0;
+  spooler->line_pos = 0;
+  spooler->observer = spooler_observer_func;
+  spooler->clear_keyboard = clear_keyboard_func;
+  spooler->keypress = keypress_func;
+  spooler->key_state = key_state_func;
+  spooler->enter_line = enter_line_func;
+  spooler->context = context;
+}
+
+void
+spooler_set_mode(Spooler *spooler, SpoolerMode mode)
 {
-  spooler_observer = spooler_observer_func;
-  clear_keyboard = clear_keyboard_func;
-  keypress = keypress_func;
-  spooler_state = SPOOLER_INACTIVE;
+  spooler->mode = mode;
+}
+
+int
+spooler_parse_mode(const char *name, SpoolerMode *mode)
+{
+  if (strcmp(name, "keys") == 0) {
+    *mode = SPOOLER_KEYS;
+  } else if (strcmp(name, "fast") == 0) {
+    *mode = SPOOLER_FAST_KEYS;
+  } else if (strcmp(name, "lines") == 0) {
+    *mode = SPOOLER_LINES;
+  } else {
+    return -1;
+  }
+  return 0;
 }
 
 void
-spooler_open(char *filename)
+spooler_open(Spooler *spooler, char *filename)
 {
-  spooler_file = fopen(filename, "rt");
-  if (spooler_file) {
-    spooler_state = SPOOLER_READ_CHAR;
-    spooler_observer(SPOOLER_OPENED);
-    clear_keyboard();
+  spooler->file = fopen(filename, "rt");
+  if (spooler->file) {
+    spooler->state = SPOOLER_READ_CHAR;
+    spooler->line_length = 0;
+    spooler->line_pos = 0;
+    spooler->observer(spooler->context, SPOOLER_OPENED);
+    spooler->clear_keyboard(spooler->context);
   } else {
-    spooler_observer(SPOOLER_OPEN_ERROR);
+    spooler->observer(spooler->context, SPOOLER_OPEN_ERROR);
   }
 }
 
 void
-spooler_close(void)
+spooler_close(Spooler *spooler)
 {
-  if (spooler_active()) {
-    fclose(spooler_file);
-    clear_keyboard();
-    spooler_file = NULL;
-    spooler_state = SPOOLER_INACTIVE;
-    spooler_observer(SPOOLER_CLOSED);
+  if (spooler_active(spooler)) {
+    fclose(spooler->file);
+    spooler->clear_keyboard(spooler->context);
+    spooler->file = NULL;
+    spooler->state = SPOOLER_INACTIVE;
+    spooler->observer(spooler->context, SPOOLER_CLOSED);
   }
 }
 
+/* The rest of the line being typed comes before the rest of the file */
+static int
+spooler_next_char(Spooler *spooler)
+{
+  if (spooler->line_pos < spooler->line_length)
+    return (unsigned char)spooler->line[spooler->line_pos++];
+  return fgetc(spooler->file);
+}
+
 static void
-spooler_read_char(void)
+spooler_read_char(Spooler *spooler)
 {
   KeySym ks;
 
-  ks = fgetc(spooler_file);
+  ks = spooler_next_char(spooler);
   if (ks == EOF) {
-    spooler_close();
+    spooler_close(spooler);
   } else {
-    keypress(ks, 0);
+    spooler->keypress(spooler->context, ks, 0);
   }
 }
 
+/* Press each key as soon as the machine is waiting for one and let go
+ * as soon as it has been taken.  The machine has to see no key held
+ * between keys, otherwise a repeated character would be missed. */
+static void
+spooler_read_fast(Spooler *spooler)
+{
+  SpoolerKeyState key_state = spooler->key_state(spooler->context);
+
+  switch (spooler->state) {
+    case SPOOLER_READ_CHAR:
+      if (key_state == SPOOLER_KEY_WAITING) {
+        spooler->state = SPOOLER_CLEAR_CHAR;
+        spooler->polls = 0;
+        spooler_read_char(spooler);
+      }
+      break;
+    case SPOOLER_CLEAR_CHAR:
+      if (key_state == SPOOLER_KEY_TAKEN ||
+          ++spooler->polls >= SPOOLER_MAX_KEY_POLLS) {
+        spooler->state = SPOOLER_READ_CHAR;
+        spooler->clear_keyboard(spooler->context);
+      }
+      break;
+  }
+}
+
+/* Read the next line and have it entered in one go, leaving just the
+ * newline to be typed.  If the machine can't take it, or it is longer
+ * than SPOOLER_MAX_LINE, the whole line is typed instead. */
+static void
+spooler_read_line(Spooler *spooler)
+{
+  int c, length = 0, text_length;
+
+  while (length < SPOOLER_MAX_LINE && (c = fgetc(spooler->file)) != EOF) {
+    spooler->line[length++] = c;
+    if (c == '\n') break;
+  }
+  spooler->line_length = length;
+  spooler->line_pos = 0;
+  if (length == 0) return;
+
+  text_length = length;
+  if (spooler->line[length-1] == '\n')
+    text_length--;
+  else if (length == SPOOLER_MAX_LINE)
+    return;
+
+  if (spooler->enter_line(spooler->context, spooler->line, text_length) == 0)
+    spooler->line_pos = text_length;
+}
+
+static void
+spooler_read_lines(Spooler *spooler)
+{
+  if (spooler->state == SPOOLER_READ_CHAR &&
+      spooler->line_pos == spooler->line_length &&
+      spooler->key_state(spooler->context) == SPOOLER_KEY_WAITING) {
+    spooler_read_line(spooler);
+  }
+  spooler_read_fast(spooler);
+}
+
 void
-spooler_read(void)
+spooler_read(Spooler *spooler)
 {
-  switch (spooler_state) {
+  if (spooler->mode == SPOOLER_FAST_KEYS) {
+    spooler_read_fast(spooler);
+    return;
+  } else if (spooler->mode == SPOOLER_LINES) {
+    spooler_read_lines(spooler);
+    return;
+  }
+
+  switch (spooler->state) {
     case SPOOLER_READ_CHAR:
-      spooler_state = SPOOLER_CLEAR_CHAR;
-      spooler_read_char();
+      spooler->state = SPOOLER_CLEAR_CHAR;
+      spooler_read_char(spooler);
       break;
     case SPOOLER_CLEAR_CHAR:
-      spooler_state = SPOOLER_READ_CHAR;
-      clear_keyboard();
+      spooler->state = SPOOLER_READ_CHAR;
+      spooler->clear_keyboard(spooler->context);
       break;
   }
 }
 
 int
-spooler_active(void)
+spooler_active(Spooler *spooler)
 {
-  return spooler_state != SPOOLER_INACTIVE;
+  return spooler->state != SPOOLER_INACTIVE;
 }
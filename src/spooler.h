@@ -16,6 +16,7 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
+#include <stdio.h>
 #include <X11/Xlib.h>
 
 #ifndef SPOOLER_H
@@ -28,16 +29,68 @@ typedef enum SpoolerMessage {
   SPOOLER_OPEN_ERROR
 } SpoolerMessage;
 
-typedef void (*SpoolerObserver)(SpoolerMessage message);
-typedef void (*ClearKeyboardFunc)(void);
-typedef void (*KeypressFunc)(KeySym ks, int key_state);
+typedef enum SpoolerMode {
+  SPOOLER_KEYS,       /* Type a key every other call of spooler_read() */
+  SPOOLER_FAST_KEYS,  /* Type each key as soon as the machine takes it */
+  SPOOLER_LINES       /* Enter each line in one go, then type the newline */
+} SpoolerMode;
 
-extern void spooler_init(SpoolerObserver spooler_observer_func,
+/* The longest line that SPOOLER_LINES reads in one go */
+#define SPOOLER_MAX_LINE 1024
+
+/* What the machine is doing with its keyboard, for SPOOLER_FAST_KEYS and
+ * SPOOLER_LINES */
+typedef enum SpoolerKeyState {
+  SPOOLER_KEY_BUSY,      /* Not reading keys */
+  SPOOLER_KEY_WAITING,   /* Waiting for a key to be pressed */
+  SPOOLER_KEY_HELD,      /* A key is held but hasn't been taken yet */
+  SPOOLER_KEY_TAKEN      /* The held key has been taken */
+} SpoolerKeyState;
+
+/* Each callback is passed the context given to spooler_init() */
+typedef void (*SpoolerObserver)(void *context, SpoolerMessage message);
+typedef void (*ClearKeyboardFunc)(void *context);
+typedef void (*KeypressFunc)(void *context, KeySym ks, int key_state);
+typedef SpoolerKeyState (*KeyStateFunc)(void *context);
+/* Put line, without its newline, where the machine would have it if it
+ * had been typed.  Returns 0 on success or -1 if it has to be typed. */
+typedef int (*EnterLineFunc)(void *context, const char *line, int length);
+
+typedef struct Spooler {
+  FILE *file;
+  enum {
+    SPOOLER_INACTIVE,
+    SPOOLER_READ_CHAR,
+    SPOOLER_CLEAR_CHAR
+  } state;
+  SpoolerMode mode;
+  int polls;          /* Calls since the last key was pressed */
+  char line[SPOOLER_MAX_LINE];  /* The line being typed in SPOOLER_LINES */
+  int line_length;
+  int line_pos;       /* The next character of line to type */
+  SpoolerObserver observer;
+  ClearKeyboardFunc clear_keyboard;
+  KeypressFunc keypress;
+  KeyStateFunc key_state;
+  EnterLineFunc enter_line;
+  void *context;
+} Spooler;
+
+extern void spooler_init(Spooler *spooler,
+                         SpoolerObserver spooler_observer_func,
                          ClearKeyboardFunc clear_keyboard_func,
-                         KeypressFunc keypress_func);
-extern void spooler_open(char *filename);
-extern void spooler_close(void);
-extern void spooler_read(void);
-extern int spooler_active(void);
+                         KeypressFunc keypress_func,
+                         KeyStateFunc key_state_func,
+                         EnterLineFunc enter_line_func,
+                         void *context);
+extern void spooler_set_mode(Spooler *spooler, SpoolerMode mode);
+
+/* Set mode from its name on the command line, returning 0 on success or
+ * -1 if the name isn't known */
+extern int spooler_parse_mode(const char *name, SpoolerMode *mode);
+extern void spooler_open(Spooler *spooler, char *filename);
+extern void spooler_close(Spooler *spooler);
+extern void spooler_read(Spooler *spooler);
+extern int spooler_active(Spooler *spooler);
 
 #endif
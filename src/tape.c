@@ -24,24 +24,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-#include "z80.h"
 #include "tape.h"
 
-static void tape_notify_observers(TapeMessageType message_type,
+static void tape_notify_observers(Tape *tape, TapeMessageType message_type,
   char message[TAPE_MAX_MESSAGE_SIZE]);
-static int tape_eof(void);
-static void tape_rewind_to_start(void);
-static void tape_attach_empty_tape(char load_type);
+static void tape_map_image(Tape *tape);
+static void tape_unmap_image(Tape *tape);
+static void tape_index_image(Tape *tape);
+static void tape_seek_file(Tape *tape, const char *filename, char type);
+static int tape_same_type(char type1, char type2);
+static int tape_eof(Tape *tape);
+static void tape_rewind_to_start(Tape *tape);
+static FILE *tape_open_existing(char *filename, int *read_only);
+static void tape_opened(Tape *tape, char *filename);
+static void tape_check_image_size(Tape *tape);
+static void tape_attach_empty_tape(Tape *tape, char load_type);
 static void tape_extract_filename(char *filename, char *mem);
-static int tape_load_block(char *mem, int block_dest_offset);
-static void tape_skip_block(void);
-static void tape_load_empty_tape_block(char *mem, int block_dest_offset);
-static void tape_truncate(void);
-static void tape_save_block(char *block, int block_size);
-static char tape_calc_checksum(char *data, int data_size);
+static int tape_load_block(Tape *tape, char *mem, int block_dest_offset);
+static void tape_skip_block(Tape *tape);
+static void tape_load_empty_tape_block(Tape *tape, char *mem,
+  int block_dest_offset);
+static int tape_commit_saves(Tape *tape);
+static int tape_commit_saves_in_place(Tape *tape, struct iovec *iov);
+static void tape_save_block(Tape *tape, char *block, int block_size);
+static char tape_calc_checksum(const char *data, int data_size);
 
 static unsigned char low_byte(int word) { return(word & 0xff); }
 static unsigned char high_byte(int word) { return(word >> 8); }
@@ -87,26 +100,42 @@ static unsigned char empty_dict[] = {
   0xff,0x00
 };
 
-static FILE *tape_fp = NULL;
-static int empty_tape_pos = 0;
-static unsigned char *empty_tape;
-static char tape_filename[TAPE_MAX_FILENAME_SIZE+1] = "";
-static char requested_filename[11];  /* The file requested on the tape */
-
-static int observer_count = 0;
-static TapeObserver observers[TAPE_MAX_OBSERVERS] = {NULL};
+void
+tape_init(Tape *tape)
+{
+  tape->fp = NULL;
+  tape->image = NULL;
+  tape->image_size = 0;
+  tape->pos = 0;
+  tape->read_only = 0;
+  tape->safe_saves = 0;
+  tape->files = NULL;
+  tape->file_count = 0;
+  tape->index_incomplete = 0;
+  tape->save_buffer = NULL;
+  tape->save_buffer_size = 0;
+  tape->save_length = 0;
+  tape->save_pos = 0;
+  tape->filename[0] = 0;
+  tape->empty_tape = NULL;
+  tape->empty_tape_pos = 0;
+  tape->requested_filename[0] = 0;
+  tape->load_header = 1;
+  tape->save_header = 1;
+  tape->observer_count = 0;
+}
 
 void
-tape_add_observer(TapeObserver tape_observer)
+tape_add_observer(Tape *tape, TapeObserver tape_observer)
 {
-  if (observer_count < TAPE_MAX_OBSERVERS)
-    observers[observer_count++] = tape_observer;
+  if (tape->observer_count < TAPE_MAX_OBSERVERS)
+    tape->observers[tape->observer_count++] = tape_observer;
 }
 
 void
-tape_clear_observers(void)
+tape_clear_observers(Tape *tape)
 {
-  observer_count = 0;
+  tape->observer_count = 0;
 }
 
 void
@@ -123,107 +152,268 @@ tape_patches(char *mem)
 }
 
 FILE *
-tape_attach(char *filename)
+tape_attach(Tape *tape, char *filename)
 {
-  tape_detach();
+  tape_detach(tape);
 
-  if ((tape_fp = fopen(filename, "rb+")) == NULL)
-    tape_fp = fopen(filename, "wb+");
-  else
-    tape_rewind_to_start();
+  if ((tape->fp = tape_open_existing(filename, &tape->read_only)) == NULL) {
+    tape->read_only = 0;
+    tape->fp = fopen(filename, "wb+");
+  }
+
+  if (tape->fp) {
+    tape_opened(tape, filename);
+  } else {
+    tape_notify_observers(tape, TAPE_ERROR, "Couldn't create file.");
+  }
+
+  return tape->fp;
+}
+
+/* Attach a tape image only to look at it, for listing or checking it.  The
+ * image is never created or written to, so this works on read only files
+ * and media. */
+FILE *
+tape_attach_read_only(Tape *tape, char *filename)
+{
+  tape_detach(tape);
 
-  if (tape_fp) {
-    strncpy(tape_filename, filename, TAPE_MAX_FILENAME_SIZE);
-    tape_notify_observers(TAPE_MESSAGE, "Tape image attached.");
+  tape->read_only = 1;
+  if ((tape->fp = fopen(filename, "rb")) != NULL) {
+    tape_opened(tape, filename);
   } else {
-    tape_notify_observers(TAPE_ERROR, "Couldn't create file.");
+    tape_notify_observers(tape, TAPE_ERROR, "Couldn't open file.");
   }
 
-  return tape_fp;
+  return tape->fp;
+}
+
+/* Open a tape image that is already there, read only if it can't be
+ * written to.  Returns NULL if it can't be opened at all. */
+static FILE *
+tape_open_existing(char *filename, int *read_only)
+{
+  FILE *fp;
+
+  *read_only = 0;
+  if ((fp = fopen(filename, "rb+")) == NULL &&
+      (fp = fopen(filename, "rb")) != NULL)
+    *read_only = 1;
+  return fp;
+}
+
+static void
+tape_opened(Tape *tape, char *filename)
+{
+  tape_rewind_to_start(tape);
+  tape_map_image(tape);
+  strncpy(tape->filename, filename, TAPE_MAX_FILENAME_SIZE);
+  tape_notify_observers(tape, TAPE_MESSAGE, "Tape image attached.");
 }
 
 void
-tape_detach(void)
+tape_detach(Tape *tape)
 {
-  if (tape_fp != NULL) {
-    fclose(tape_fp);
-    tape_fp = NULL;
-    tape_notify_observers(TAPE_MESSAGE, "Tape image detached.");
+  if (tape->fp != NULL) {
+    tape_commit_saves(tape);
+    free(tape->save_buffer);
+    tape->save_buffer = NULL;
+    tape->save_buffer_size = 0;
+    tape_unmap_image(tape);
+    fclose(tape->fp);
+    tape->fp = NULL;
+    tape_notify_observers(tape, TAPE_MESSAGE, "Tape image detached.");
   }
 }
 
+static void
+tape_notify_bad_checksum(Tape *tape, const char *filename)
+{
+  char message[TAPE_MAX_MESSAGE_SIZE];
+
+  snprintf(message, sizeof(message), "Bad checksum in file: %s", filename);
+  tape_notify_observers(tape, TAPE_ERROR, message);
+}
+
 void
-tape_load_p(char *mem, int block_dest_offset)
+tape_load_p(Tape *tape, char *mem, int block_dest_offset)
 {
   char found_filename[11];
-  static int load_header = 1;
   char message[TAPE_MAX_MESSAGE_SIZE] = "";
-
-  if (tape_eof()) {
-    tape_notify_observers(TAPE_MESSAGE, "End of tape reached.  Rewinding.");
-    tape_rewind_to_start();
-    load_header = 1;
+  int result;
+
+  tape_commit_saves(tape);
+  tape_check_image_size(tape);
+  if (tape_eof(tape)) {
+    tape_notify_observers(tape, TAPE_MESSAGE,
+      "End of tape reached.  Rewinding.");
+    tape_rewind_to_start(tape);
+    tape->load_header = 1;
   }
 
-  if (load_header) {
-    tape_attach_empty_tape(mem[9985]);
-    tape_extract_filename(requested_filename, mem+9985+1);
-    sprintf(message, "Searching for file: %s", requested_filename);
-    tape_notify_observers(TAPE_MESSAGE, message);
-
-    if (tape_load_block(mem, block_dest_offset)) {
-      sprintf(message, "Incomplete block in file: %s", found_filename);
+  if (tape->load_header) {
+    tape_attach_empty_tape(tape, mem[9985]);
+    tape_extract_filename(tape->requested_filename, mem+9985+1);
+    sprintf(message, "Searching for file: %s", tape->requested_filename);
+    tape_notify_observers(tape, TAPE_MESSAGE, message);
+    tape_seek_file(tape, tape->requested_filename, mem[9985]);
+
+    result = tape_load_block(tape, mem, block_dest_offset);
+    if (result == 1) {
+      sprintf(message, "Incomplete block in file: %s",
+              tape->requested_filename);
     } else {
       tape_extract_filename(found_filename, mem+block_dest_offset+1);
-      if (strcmp(requested_filename, found_filename) != 0) {
+      if (result == 2)
+        tape_notify_bad_checksum(tape, found_filename);
+      if (strcmp(tape->requested_filename, found_filename) != 0 ||
+          !tape_same_type(mem[9985], mem[block_dest_offset])) {
         sprintf(message, "Skipping file: %s", found_filename);
-        tape_skip_block();
+        tape_skip_block(tape);
       } else {
         sprintf(message, "Found file: %s", found_filename);
-        load_header = 0;
+        tape->load_header = 0;
       }
     }
   } else {
-    if (tape_load_block(mem, block_dest_offset)) {
-      sprintf(message, "Incomplete block in file: %s", found_filename);
+    result = tape_load_block(tape, mem, block_dest_offset);
+    if (result == 1) {
+      sprintf(message, "Incomplete block in file: %s",
+              tape->requested_filename);
     } else {
+      if (result == 2)
+        tape_notify_bad_checksum(tape, tape->requested_filename);
       sprintf(message, "Load complete.");
-      load_header = 1;
+      tape->load_header = 1;
     }
   }
 
-  tape_notify_observers(TAPE_MESSAGE, message);
+  tape_notify_observers(tape, TAPE_MESSAGE, message);
 }
 
 void
-tape_save_p(char *mem, int block_size)
+tape_save_p(Tape *tape, char *mem, int block_size)
 {
   char filename[32];
-  static int save_header = 1;
   char message[TAPE_MAX_MESSAGE_SIZE] = "";
 
-  if (!tape_fp) {
-    if (save_header) {
-      tape_notify_observers(TAPE_MESSAGE, "No tape file attached.");
-      save_header = 0;
+  if (!tape->fp) {
+    if (tape->save_header) {
+      tape_notify_observers(tape, TAPE_MESSAGE, "No tape file attached.");
+      tape->save_header = 0;
     }
     return;
   }
 
-  if (save_header) {
+  if (tape->read_only) {
+    if (tape->save_header)
+      tape_notify_observers(tape, TAPE_ERROR, "Tape image is read only.");
+    tape->save_header = !tape->save_header;
+    return;
+  }
+
+  tape_save_block(tape, mem, block_size);
+  if (tape->save_header) {
     tape_extract_filename(filename, mem+1);
     sprintf(message, "Saving to file: %s", filename);
-    tape_truncate();
   } else {
-    sprintf(message, "Save complete.");
+    /* The header and data are written to the tape image together */
+    if (tape_commit_saves(tape) == 0)
+      sprintf(message, "Save complete.");
+  }
+  tape->save_header = !tape->save_header;
+  if (message[0])
+    tape_notify_observers(tape, TAPE_MESSAGE, message);
+}
+
+/* Write the files on the attached tape to fp, one per line, in the way
+ * that the Ace shows their headers */
+void
+tape_print_index(Tape *tape, FILE *fp)
+{
+  TapeFile *file;
+  int i;
+
+  for (i = 0; i < tape->file_count; i++) {
+    file = &tape->files[i];
+    fprintf(fp, "%-6s %-10s %5d bytes", file->type ? "Bytes:" : "Dict:",
+            file->filename, file->length);
+    if (file->data_pos < 0)
+      fprintf(fp, ", no data");
+    else if (!file->checksum_ok)
+      fprintf(fp, ", bad checksum");
+    fputc('\n', fp);
   }
-  save_header = !save_header;
-  tape_save_block(mem, block_size);
-  tape_notify_observers(TAPE_MESSAGE, message);
+}
+
+/* Return how many files on the attached tape image are missing their data
+ * or have a bad checksum.  An incomplete header at the end of the image
+ * counts as another. */
+int
+tape_count_bad_files(Tape *tape)
+{
+  int i, bad_files = 0;
+
+  for (i = 0; i < tape->file_count; i++) {
+    if (tape->files[i].data_pos < 0 || !tape->files[i].checksum_ok)
+      bad_files++;
+  }
+  if (tape->index_incomplete &&
+      (tape->file_count == 0 || tape->files[tape->file_count-1].data_pos >= 0))
+    bad_files++;
+  return bad_files;
+}
+
+void
+tape_get_state(Tape *tape, TapeState *state)
+{
+  tape_commit_saves(tape);
+  if (tape->fp) {
+    strncpy(state->filename, tape->filename, TAPE_MAX_FILENAME_SIZE);
+    state->filename[TAPE_MAX_FILENAME_SIZE] = 0;
+    state->pos = tape->pos;
+  } else {
+    state->filename[0] = 0;
+    state->pos = tape->empty_tape_pos;
+  }
+  state->load_header = tape->load_header;
+  state->save_header = tape->save_header;
+  state->empty_tape_bytes = (tape->empty_tape == empty_bytes);
+}
+
+/* The tape image is only reattached if it is still there, as making a new
+ * empty one in its place would hide that it has gone */
+int
+tape_set_state(Tape *tape, const TapeState *state)
+{
+  char filename[TAPE_MAX_FILENAME_SIZE+1];
+  FILE *fp;
+  int read_only;
+
+  if (state->filename[0]) {
+    strncpy(filename, state->filename, TAPE_MAX_FILENAME_SIZE);
+    filename[TAPE_MAX_FILENAME_SIZE] = 0;
+    if ((fp = tape_open_existing(filename, &read_only)) == NULL) {
+      tape_notify_observers(tape, TAPE_ERROR, "Couldn't open file.");
+      return -1;
+    }
+    tape_detach(tape);
+    tape->fp = fp;
+    tape->read_only = read_only;
+    tape_opened(tape, filename);
+    tape->pos = state->pos;
+  } else {
+    tape_detach(tape);
+    tape->empty_tape_pos = state->pos;
+  }
+  tape->load_header = state->load_header;
+  tape->save_header = state->save_header;
+  tape->empty_tape = state->empty_tape_bytes ? empty_bytes : empty_dict;
+  return 0;
 }
 
 static void
-tape_notify_observers(TapeMessageType message_type,
+tape_notify_observers(Tape *tape, TapeMessageType message_type,
   char message[TAPE_MAX_MESSAGE_SIZE])
 {
   int i;
@@ -235,47 +425,190 @@ tape_notify_observers(TapeMessageType message_type,
   char _tape_filename[TAPE_MAX_FILENAME_SIZE];
   char _message[TAPE_MAX_MESSAGE_SIZE];
 
-  tape_attached = !!tape_fp;
-  if (tape_fp) {
-    tape_pos = ftell(tape_fp);
-    strncpy(_tape_filename, tape_filename, TAPE_MAX_FILENAME_SIZE);
+  tape_attached = !!tape->fp;
+  if (tape->fp) {
+    tape_pos = tape->pos;
+    strncpy(_tape_filename, tape->filename, TAPE_MAX_FILENAME_SIZE);
   } else {
-    tape_pos = empty_tape_pos;
+    tape_pos = tape->empty_tape_pos;
     _tape_filename[0] = 0;
   }
 
   strncpy(_message, message, TAPE_MAX_MESSAGE_SIZE);
-  for (i = 0; i < observer_count; i++) {
-    observers[i](tape_attached, tape_pos, _tape_filename,
+  for (i = 0; i < tape->observer_count; i++) {
+    tape->observers[i](tape_attached, tape_pos, _tape_filename,
       message_type, _message);
   }
 }
 
 /* load_type - If 0 indicates dictionary, else bytes */
 static void
-tape_attach_empty_tape(char load_type)
+tape_attach_empty_tape(Tape *tape, char load_type)
 {
   if (load_type == 0) {
-    empty_tape = empty_dict;
+    tape->empty_tape = empty_dict;
   } else {
-    empty_tape = empty_bytes;
+    tape->empty_tape = empty_bytes;
+  }
+  tape->empty_tape_pos = 0;
+}
+
+static void
+tape_unmap_image(Tape *tape)
+{
+  if (tape->image)
+    munmap((void *)tape->image, tape->image_size);
+  tape->image = NULL;
+  tape->image_size = 0;
+  free(tape->files);
+  tape->files = NULL;
+  tape->file_count = 0;
+  tape->index_incomplete = 0;
+}
+
+/* This has to be done again whenever the tape image is written to, as
+ * the mapping doesn't grow with the file */
+static void
+tape_map_image(Tape *tape)
+{
+  struct stat st;
+  void *image;
+
+  tape_unmap_image(tape);
+  if (fstat(fileno(tape->fp), &st) != 0) {
+    tape_notify_observers(tape, TAPE_ERROR, "Couldn't read file.");
+    return;
+  }
+  if (st.st_size == 0) return;
+
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(tape->fp), 0);
+  if (image == MAP_FAILED) {
+    tape_notify_observers(tape, TAPE_ERROR, "Couldn't read file.");
+    return;
+  }
+  tape->image = image;
+  tape->image_size = st.st_size;
+  tape_index_image(tape);
+}
+
+/* Map the tape image again if something else has changed its size since
+ * it was mapped.  Reading the part of the mapping past the end of a file
+ * cut short would kill the process with SIGBUS. */
+static void
+tape_check_image_size(Tape *tape)
+{
+  struct stat st;
+
+  if (tape->fp && fstat(fileno(tape->fp), &st) == 0 &&
+      st.st_size != (off_t)tape->image_size)
+    tape_map_image(tape);
+}
+
+/* Return the size of the block at pos in the tape image, or -1 if the
+ * image ends before the block does */
+static int
+tape_image_block_size(Tape *tape)
+{
+  int block_size;
+
+  if (tape->pos+2 > (long)tape->image_size) return -1;
+  block_size = tape->image[tape->pos] | (tape->image[tape->pos+1] << 8);
+  if (tape->pos+2+block_size > (long)tape->image_size) return -1;
+  return block_size;
+}
+
+/* Return whether the block at pos, which must be complete, has the right
+ * checksum */
+static int
+tape_image_block_checksum_ok(Tape *tape, int block_size)
+{
+  const unsigned char *block = tape->image+tape->pos+2;
+
+  return block_size > 0 &&
+    tape_calc_checksum((char *)block, block_size-1) == (char)block[block_size-1];
+}
+
+/* The blocks on a tape are in pairs, a header and then its data */
+static void
+tape_index_image(Tape *tape)
+{
+  TapeFile *file, *files;
+  int max_files = 0, block_size;
+  long end_pos = tape->pos;
+
+  tape->pos = 0;
+  while ((block_size = tape_image_block_size(tape)) >= 0) {
+    if (tape->file_count == max_files) {
+      max_files = max_files ? max_files*2 : 16;
+      files = realloc(tape->files, max_files*sizeof(TapeFile));
+      if (!files) break;
+      tape->files = files;
+    }
+    file = &tape->files[tape->file_count++];
+    memset(file, 0, sizeof(TapeFile));
+    if (block_size > 11) {
+      tape_extract_filename(file->filename, (char *)tape->image+tape->pos+3);
+      file->type = tape->image[tape->pos+2];
+    }
+    file->header_pos = tape->pos;
+    file->checksum_ok = tape_image_block_checksum_ok(tape, block_size);
+    tape->pos += 2+block_size;
+
+    file->data_pos = -1;
+    if ((block_size = tape_image_block_size(tape)) >= 0) {
+      file->data_pos = tape->pos;
+      file->length = block_size > 0 ? block_size-1 : 0;
+      file->checksum_ok &= tape_image_block_checksum_ok(tape, block_size);
+      tape->pos += 2+block_size;
+    }
+  }
+  tape->index_incomplete = (tape->pos < (long)tape->image_size);
+  tape->pos = end_pos;
+}
+
+/* Move to the header of the next file called filename of the given type,
+ * going round to the start of the tape if needed.  If there isn't one the
+ * tape is left where it is, so that the search goes on through the tape as
+ * it would on a real cassette. */
+static void
+tape_seek_file(Tape *tape, const char *filename, char type)
+{
+  int i, found = -1;
+
+  for (i = 0; i < tape->file_count; i++) {
+    if (strcmp(tape->files[i].filename, filename) == 0 &&
+        tape_same_type(tape->files[i].type, type)) {
+      if (tape->files[i].header_pos >= tape->pos) {
+        found = i;
+        break;
+      }
+      if (found < 0) found = i;
+    }
   }
-  empty_tape_pos = 0;
+  if (found >= 0) tape->pos = tape->files[found].header_pos;
+}
+
+/* Header type bytes are 0 for a dictionary and anything else for bytes */
+static int
+tape_same_type(char type1, char type2)
+{
+  return ((type1 == 0) == (type2 == 0));
 }
 
 static int
-tape_eof(void)
+tape_eof(Tape *tape)
 {
-  return ((tape_fp && feof(tape_fp)) || (!tape_fp && empty_tape_pos > 28));
+  return ((tape->fp && tape->pos >= (long)tape->image_size) ||
+          (!tape->fp && tape->empty_tape_pos > 28));
 }
 
 static void
-tape_rewind_to_start(void)
+tape_rewind_to_start(Tape *tape)
 {
-  if (tape_fp)
-    fseek(tape_fp, 0, SEEK_SET);
+  if (tape->fp)
+    tape->pos = 0;
   else
-    empty_tape_pos = 0;
+    tape->empty_tape_pos = 0;
 }
 
 /**
@@ -293,79 +626,198 @@ tape_extract_filename(char *filename, char *mem)
 }
 
 static void
-tape_load_empty_tape_block(char *mem, int block_dest_offset)
+tape_load_empty_tape_block(Tape *tape, char *mem, int block_dest_offset)
 {
   int block_size;
 
-  block_size = empty_tape[empty_tape_pos++];
-  block_size += empty_tape[empty_tape_pos++] << 8;
-  memcpy(mem+block_dest_offset, &empty_tape[empty_tape_pos], block_size);
-  empty_tape_pos += block_size;
+  block_size = tape->empty_tape[tape->empty_tape_pos++];
+  block_size += tape->empty_tape[tape->empty_tape_pos++] << 8;
+  memcpy(mem+block_dest_offset, &tape->empty_tape[tape->empty_tape_pos],
+         block_size);
+  tape->empty_tape_pos += block_size;
 }
 
+/* Returns 0 on success, 1 if the block is incomplete or 2 if it has a bad
+ * checksum, in which case it is loaded anyway */
 static int
-tape_load_block(char *mem, int block_dest_offset)
+tape_load_block(Tape *tape, char *mem, int block_dest_offset)
 {
-  int block_size;
+  int block_size, checksum_ok;
 
-  if (tape_fp) {
-    block_size = fgetc(tape_fp);
-    if (!feof(tape_fp)) {
-      block_size += fgetc(tape_fp) << 8;
-      /* Read block less the checksum */
-      if (fread(mem+block_dest_offset, 1, block_size-1, tape_fp) != block_size-1)
-        return 1;
-      fgetc(tape_fp); /* skip checksum */
+  if (tape->fp) {
+    block_size = tape_image_block_size(tape);
+    if (block_size < 1) {
+      tape->pos = tape->image_size;
+      return 1;
     }
+    checksum_ok = tape_image_block_checksum_ok(tape, block_size);
+    /* Copy the block less the checksum */
+    memcpy(mem+block_dest_offset, tape->image+tape->pos+2, block_size-1);
+    tape->pos += 2+block_size;
+    if (!checksum_ok) return 2;
   } else {
-    tape_load_empty_tape_block(mem, block_dest_offset);
+    tape_load_empty_tape_block(tape, mem, block_dest_offset);
   }
 
   return 0;
 }
 
 static void
-tape_skip_block(void)
+tape_skip_block(Tape *tape)
 {
   int block_size;
 
-  if (tape_fp) {
-    block_size = fgetc(tape_fp);
-    block_size += fgetc(tape_fp) << 8;
-    fseek(tape_fp, block_size, SEEK_CUR);
+  if (tape->fp) {
+    block_size = tape_image_block_size(tape);
+    if (block_size < 0)
+      tape->pos = tape->image_size;
+    else
+      tape->pos += 2+block_size;
   } else {
-    block_size = empty_tape[empty_tape_pos++];
-    block_size += empty_tape[empty_tape_pos++] << 8;
-    empty_tape_pos += block_size;
+    block_size = tape->empty_tape[tape->empty_tape_pos++];
+    block_size += tape->empty_tape[tape->empty_tape_pos++] << 8;
+    tape->empty_tape_pos += block_size;
   }
 }
 
+/* Add the block to those waiting to be written to the tape image */
 static void
-tape_save_block(char *block, int block_size)
+tape_save_block(Tape *tape, char *block, int block_size)
 {
-  fputc(low_byte(block_size+1), tape_fp);
-  fputc(high_byte(block_size+1), tape_fp);
-  fwrite(block, 1, block_size, tape_fp);
-  fputc(tape_calc_checksum(block, block_size), tape_fp);
-  fflush(tape_fp);
+  unsigned char *save_buffer, *dest;
+  size_t size_needed = tape->save_length+block_size+3;
+
+  if (size_needed > tape->save_buffer_size) {
+    save_buffer = realloc(tape->save_buffer, size_needed*2);
+    if (!save_buffer) {
+      tape_notify_observers(tape, TAPE_ERROR, "Couldn't get memory to save.");
+      return;
+    }
+    tape->save_buffer = save_buffer;
+    tape->save_buffer_size = size_needed*2;
+  }
+
+  if (tape->save_length == 0)
+    tape->save_pos = tape->pos;
+  dest = tape->save_buffer+tape->save_length;
+  dest[0] = low_byte(block_size+1);
+  dest[1] = high_byte(block_size+1);
+  memcpy(dest+2, block, block_size);
+  dest[block_size+2] = tape_calc_checksum(block, block_size);
+  tape->save_length += block_size+3;
+  tape->pos += block_size+3;
 }
 
-static void
-tape_truncate(void)
+/* Write the blocks saved to the tape image where saving started.
+ * Everything after them is lost, as it would be on a cassette.  With
+ * safe_saves the image up to where saving started and the blocks saved
+ * are written to a new file, which is synced and renamed over the old one,
+ * so that if anything goes wrong the old tape image is left as it was.
+ * Where the tape is a symlink or has other links, which the rename would
+ * break, or a new file can't be made next to it, the blocks are written in
+ * place and synced instead.  Returns 0 on success or -1 on failure. */
+static int
+tape_commit_saves(Tape *tape)
 {
-  if (ftruncate(fileno(tape_fp), ftell(tape_fp)) != 0) {
-    tape_notify_observers(TAPE_ERROR, "Couldn't truncate file.");
+  char temp_filename[TAPE_MAX_FILENAME_SIZE+8];
+  struct iovec iov[2];
+  struct stat st;
+  long pos = tape->pos;
+  int fd = -1, ok;
+  FILE *fp;
+
+  if (tape->save_length == 0) return 0;
+
+  iov[0].iov_base = (void *)tape->image;
+  iov[0].iov_len = tape->save_pos < (long)tape->image_size ?
+                   tape->save_pos : tape->image_size;
+  iov[1].iov_base = tape->save_buffer;
+  iov[1].iov_len = tape->save_length;
+  tape->save_length = 0;
+
+  if (!tape->safe_saves) return tape_commit_saves_in_place(tape, iov);
+  if (lstat(tape->filename, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_nlink == 1) {
+    snprintf(temp_filename, sizeof(temp_filename), "%s.XXXXXX",
+             tape->filename);
+    fd = mkstemp(temp_filename);
+  }
+  if (fd < 0) return tape_commit_saves_in_place(tape, iov);
+
+  fchmod(fd, st.st_mode & 07777);
+  ok = writev(fd, iov, 2) == (ssize_t)(iov[0].iov_len+iov[1].iov_len);
+  ok = ok && fsync(fd) == 0;
+  if (close(fd) != 0) ok = 0;
+  ok = ok && rename(temp_filename, tape->filename) == 0;
+  if (!ok) {
+    unlink(temp_filename);
+    tape->pos = tape->save_pos;
+    tape_notify_observers(tape, TAPE_ERROR, "Couldn't save to file.");
+    return -1;
   }
+
+  /* If the new image can't be opened the old one is kept attached */
+  if ((fp = fopen(tape->filename, "rb+")) == NULL) {
+    tape->pos = tape->save_pos;
+    tape_notify_observers(tape, TAPE_ERROR, "Couldn't reopen file.");
+    return -1;
+  }
+  tape_unmap_image(tape);
+  fclose(tape->fp);
+  tape->fp = fp;
+  tape_map_image(tape);
+  tape->pos = pos;
+  return 0;
 }
 
-/* Returns a checksum calculated by XORing each value in data */
+/* Write the blocks saved over the tape image where saving started and cut
+ * it off after them, leaving the rest of the image alone.  This doesn't
+ * protect the image against a crash part way through, as the rename does,
+ * but works wherever the tape file itself is writable.  iov is as set up
+ * by tape_commit_saves(). */
+static int
+tape_commit_saves_in_place(Tape *tape, struct iovec *iov)
+{
+  off_t end = iov[0].iov_len+iov[1].iov_len;
+  long pos = tape->pos;
+  int fd = fileno(tape->fp);
+  int ok;
+
+  ok = pwrite(fd, iov[1].iov_base, iov[1].iov_len, iov[0].iov_len) ==
+       (ssize_t)iov[1].iov_len;
+  ok = ok && ftruncate(fd, end) == 0;
+  if (tape->safe_saves)
+    ok = ok && fsync(fd) == 0;
+  tape_map_image(tape);
+  if (!ok) {
+    tape->pos = tape->save_pos;
+    tape_notify_observers(tape, TAPE_ERROR, "Couldn't save to file.");
+    return -1;
+  }
+  tape->pos = pos;
+  return 0;
+}
+
+/* Returns a checksum calculated by XORing each value in data.  This is
+ * done a word at a time, the bytes of the word being XORed together at the
+ * end, which the compiler can also turn into vector instructions. */
 static char
-tape_calc_checksum(char *data, int data_size)
+tape_calc_checksum(const char *data, int data_size)
 {
+  uint64_t word, words = 0;
+  char checksum;
   int i;
-  char checksum = 0;
 
-  for (i = 0; i < data_size; i++) {
+  for (i = 0; i+8 <= data_size; i += 8) {
+    memcpy(&word, data+i, 8);
+    words ^= word;
+  }
+  words ^= words >> 32;
+  words ^= words >> 16;
+  words ^= words >> 8;
+  checksum = words & 0xff;
+
+  for (; i < data_size; i++) {
     checksum ^= data[i];
   }
 
@@ -19,6 +19,9 @@
 #ifndef TAPE_H
 #define TAPE_H
 
+#include <stdio.h>
+#include <stddef.h>
+
 #define TAPE_MAX_FILENAME_SIZE 256
 #define TAPE_MAX_MESSAGE_SIZE 256
 #define TAPE_MAX_OBSERVERS 10
@@ -43,12 +46,67 @@ typedef void (*TapeObserver)(int tape_attached, int tape_pos,
   TapeMessageType message_type,
   const char message[TAPE_MAX_MESSAGE_SIZE]);
 
-void tape_clear_observers(void);
-void tape_add_observer(TapeObserver tape_observer);
+/* Everything needed to put the tape back where it was for a snapshot */
+typedef struct TapeState {
+  char filename[TAPE_MAX_FILENAME_SIZE+1];  /* Empty if no tape attached */
+  long pos;                /* Position in the tape image or empty tape */
+  int load_header;         /* Whether the next block loaded is a header */
+  int save_header;         /* Whether the next block saved is a header */
+  int empty_tape_bytes;    /* Whether the empty tape holds bytes */
+} TapeState;
+
+/* A file on the tape image, found when it was attached */
+typedef struct TapeFile {
+  char filename[11];
+  int type;              /* 0 for a dictionary, otherwise bytes */
+  long header_pos;       /* Position of the header block in the image */
+  long data_pos;         /* Position of the data block, or -1 if missing */
+  int length;            /* Size of the data, less its checksum */
+  int checksum_ok;       /* Whether both blocks have the right checksum */
+} TapeFile;
+
+/* The state of one cassette machine.  The attached tape image is mapped
+ * into memory and read from there, so fp is only used to write to it. */
+typedef struct Tape {
+  FILE *fp;
+  const unsigned char *image;   /* The mapped tape image, or NULL if empty */
+  size_t image_size;
+  long pos;                     /* Position in the tape image */
+  int read_only;                /* Whether the tape image can't be saved to */
+  int safe_saves;               /* Whether saves are synced and renamed */
+  TapeFile *files;              /* The files on the tape image */
+  int file_count;
+  int index_incomplete;         /* Whether the image ends within a block */
+  /* Blocks saved but not yet written to the tape image, which are to go
+   * at save_pos */
+  unsigned char *save_buffer;
+  size_t save_buffer_size;
+  size_t save_length;
+  long save_pos;
+  char filename[TAPE_MAX_FILENAME_SIZE+1];
+  unsigned char *empty_tape;
+  int empty_tape_pos;
+  char requested_filename[11];  /* The file requested on the tape */
+  int load_header;
+  int save_header;
+  int observer_count;
+  TapeObserver observers[TAPE_MAX_OBSERVERS];
+} Tape;
+
+extern void tape_init(Tape *tape);
+void tape_clear_observers(Tape *tape);
+void tape_add_observer(Tape *tape, TapeObserver tape_observer);
 extern void tape_patches(char *mem);
-extern FILE* tape_attach(char *filename);
-extern void tape_detach();
-extern void tape_load_p(char *mem, int block_dest_offset);
-extern void tape_save_p(char *mem, int block_size);
+extern FILE* tape_attach(Tape *tape, char *filename);
+extern FILE* tape_attach_read_only(Tape *tape, char *filename);
+extern void tape_detach(Tape *tape);
+extern void tape_load_p(Tape *tape, char *mem, int block_dest_offset);
+extern void tape_save_p(Tape *tape, char *mem, int block_size);
+extern void tape_print_index(Tape *tape, FILE *fp);
+extern int tape_count_bad_files(Tape *tape);
+extern void tape_get_state(Tape *tape, TapeState *state);
+/* Returns 0 on success, or -1 if the tape image has gone, in which case
+ * the tape is left as it was */
+extern int tape_set_state(Tape *tape, const TapeState *state);
 
 #endif
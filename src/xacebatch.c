@@ -0,0 +1,346 @@
+/* xacebatch, runs a batch of spool files on Jupiter ACEs in parallel
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ * --------------------------------------------------------------------------
+ *
+ * Each spool file is run on its own Ace, in the same way as xace's
+ * headless mode, with the screen written to the spool file's name with
+ * .out added.  The machines are shared out between a pool of threads.
+ *
+ * With -verifytapes the files named are tape images instead, which are
+ * checked for incomplete blocks and bad checksums.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "z80.h"
+#include "ace.h"
+#include "jobpool.h"
+#include "profiler.h"
+
+#define HEADLESS_EXIT_DELAY 50
+
+typedef enum JobStatus {
+  JOB_FINISHED,
+  JOB_OPEN_ERROR,
+  JOB_OUT_ERROR,
+  JOB_TIMED_OUT,
+  JOB_NO_MEMORY,
+  JOB_BAD_TAPE
+} JobStatus;
+
+static const char *job_status_names[] = {
+  "ok",
+  "couldn't open file",
+  "couldn't write output",
+  "timed out",
+  "out of memory",
+  "bad tape"
+};
+
+typedef struct Job {
+  char *filename;          /* The spool file or tape image */
+  JobStatus status;
+  int done;
+  /* Interrupts left to run after the spool file closes */
+  int exit_countdown;
+  unsigned long frame_count;
+  double wall_secs;
+  unsigned long long tstates;
+  int tape_files;          /* Files found on the tape image */
+  int bad_tape_files;
+} Job;
+
+static unsigned char rom[ACE_ROM_SIZE];
+/* Frames after which a run is given up, or 0 to run until finished */
+static unsigned long timeout_frames=0;
+static SpoolerMode spooler_mode=SPOOLER_KEYS;
+static int verify_tapes=0;
+/* When set each run's profile is written to <spool file>.profile */
+static int profile=0;
+/* When set the ROM's arithmetic primitives are run natively */
+static int native_primitives=0;
+
+static void
+loadrom(unsigned char *x)
+{
+  FILE *in;
+
+  if ((in = fopen("ace.rom", "rb")) == NULL ||
+      fread(x, 1, ACE_ROM_SIZE, in) != ACE_ROM_SIZE) {
+    printf("Couldn't load ROM.\n");
+    exit(1);
+  }
+  fclose(in);
+}
+
+static void
+job_finish(Ace *ace, JobStatus status)
+{
+  Job *job = ace->user_data;
+
+  job->status = status;
+  job->done = 1;
+  ace->stop = 1;
+}
+
+static void
+job_frame_handler(Ace *ace)
+{
+  Job *job = ace->user_data;
+
+  job->frame_count++;
+  if (job->exit_countdown > 0 && --job->exit_countdown == 0)
+    job_finish(ace, JOB_FINISHED);
+  else if (job->frame_count == timeout_frames)
+    job_finish(ace, JOB_TIMED_OUT);
+}
+
+static void
+job_spooler_handler(Ace *ace, SpoolerMessage message)
+{
+  Job *job = ace->user_data;
+
+  switch (message) {
+    case SPOOLER_OPEN_ERROR:
+      job_finish(ace, JOB_OPEN_ERROR);
+      break;
+
+    case SPOOLER_CLOSED:
+      job->exit_countdown = HEADLESS_EXIT_DELAY;
+      break;
+
+    default:
+      break;
+  }
+}
+
+static double
+elapsed_secs(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-start->tv_sec) + (now.tv_nsec-start->tv_nsec)/1e9;
+}
+
+static void
+run_job(void *context, int job_num)
+{
+  Job *job = (Job *)context + job_num;
+  char out_filename[FILENAME_MAX];
+  struct timespec start;
+  Profiler *profiler = NULL;
+  FILE *out;
+  Ace *ace;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ace = ace_create(rom);
+  if (!ace) {
+    job->status = JOB_NO_MEMORY;
+    return;
+  }
+  ace->user_data = job;
+  ace->frame_handler = job_frame_handler;
+  ace->spooler_handler = job_spooler_handler;
+  ace_set_spooler_mode(ace, spooler_mode);
+  ace_set_native_primitives(ace, native_primitives);
+  if (profile && !(profiler = profiler_create(ace))) {
+    ace_destroy(ace);
+    job->status = JOB_NO_MEMORY;
+    return;
+  }
+
+  spooler_open(&ace->spooler, job->filename);
+  while (!job->done)
+    ace_step(ace, ACE_FRAME_TSTATES*HEADLESS_EXIT_DELAY);
+
+  if (job->status == JOB_FINISHED) {
+    snprintf(out_filename, sizeof(out_filename), "%s.out",
+             job->filename);
+    if ((out = fopen(out_filename, "w"))) {
+      ace_print_screen_text(ace, out);
+      fclose(out);
+    } else {
+      job->status = JOB_OUT_ERROR;
+    }
+#ifdef OPSTATS
+    snprintf(out_filename, sizeof(out_filename), "%s.opstats",
+             job->filename);
+    if ((out = fopen(out_filename, "w"))) {
+      opstats_print(&ace->opstats, out);
+      fclose(out);
+    }
+#endif
+  }
+
+  /* A run that timed out is still worth profiling */
+  if (profiler) {
+    if (job->status == JOB_FINISHED || job->status == JOB_TIMED_OUT) {
+      snprintf(out_filename, sizeof(out_filename), "%s.profile",
+               job->filename);
+      if (profiler_write(profiler, out_filename))
+        job->status = JOB_OUT_ERROR;
+    }
+    profiler_destroy(profiler);
+  }
+
+  job->tstates = ace->tstates;
+  ace_destroy(ace);
+  job->wall_secs = elapsed_secs(&start);
+}
+
+static void
+verify_tape_job(void *context, int job_num)
+{
+  Job *job = (Job *)context + job_num;
+  Tape tape;
+
+  tape_init(&tape);
+  if (!tape_attach_read_only(&tape, job->filename)) {
+    job->status = JOB_OPEN_ERROR;
+    return;
+  }
+  job->tape_files = tape.file_count;
+  job->bad_tape_files = tape_count_bad_files(&tape);
+  job->status = job->bad_tape_files ? JOB_BAD_TAPE : JOB_FINISHED;
+  tape_detach(&tape);
+}
+
+/* Read the names of spool files or tape images from fp, one per line */
+static int
+read_filenames(FILE *fp, Job **jobs)
+{
+  char filename[FILENAME_MAX];
+  int num_jobs = 0, max_jobs = 0;
+
+  while (fgets(filename, sizeof(filename), fp)) {
+    filename[strcspn(filename, "\r\n")] = 0;
+    if (!filename[0]) continue;
+    if (num_jobs == max_jobs) {
+      max_jobs = max_jobs ? max_jobs*2 : 64;
+      *jobs = realloc(*jobs, max_jobs*sizeof(Job));
+      if (!*jobs) {
+        perror("Couldn't get memory for jobs");
+        exit(1);
+      }
+    }
+    memset(&(*jobs)[num_jobs], 0, sizeof(Job));
+    (*jobs)[num_jobs].filename = strdup(filename);
+    num_jobs++;
+  }
+  return num_jobs;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr,
+          "Usage: xacebatch [-jobs n] [-timeout n] [-spoolmode m] [-profile]"
+          " [-nativeprims] [spool file]...\n");
+  fprintf(stderr, "       xacebatch -verifytapes [-jobs n] [tape image]...\n");
+  fprintf(stderr, "\t-jobs n    - Runs to have going at once\n");
+  fprintf(stderr, "\t-timeout n - Give up on a run after n frames\n");
+  fprintf(stderr, "\t-spoolmode m - Spool by keys, fast keys or lines\n");
+  fprintf(stderr, "\t-profile   - Write a profile of the Forth words run\n");
+  fprintf(stderr,
+          "\t-nativeprims - Run the ROM's arithmetic primitives natively\n");
+  fprintf(stderr, "\t-verifytapes - Check tape images instead\n");
+  fprintf(stderr, "With no files their names are read from stdin\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  Job *jobs = NULL;
+  int num_jobs = 0, num_threads = 0, failures = 0;
+  int arg_pos, job;
+  unsigned long long total_tstates = 0;
+  struct timespec start;
+
+  for (arg_pos = 1; arg_pos < argc && argv[arg_pos][0] == '-'; arg_pos++) {
+    if (strcmp("-jobs", argv[arg_pos]) == 0 && arg_pos+1 < argc) {
+      num_threads = atoi(argv[++arg_pos]);
+    } else if (strcmp("-timeout", argv[arg_pos]) == 0 && arg_pos+1 < argc) {
+      timeout_frames = strtoul(argv[++arg_pos], NULL, 10);
+    } else if (strcmp("-spoolmode", argv[arg_pos]) == 0 && arg_pos+1 < argc) {
+      if (spooler_parse_mode(argv[++arg_pos], &spooler_mode) != 0)
+        usage();
+    } else if (strcmp("-profile", argv[arg_pos]) == 0) {
+      profile = 1;
+    } else if (strcmp("-nativeprims", argv[arg_pos]) == 0) {
+      native_primitives = 1;
+    } else if (strcmp("-verifytapes", argv[arg_pos]) == 0) {
+      verify_tapes = 1;
+    } else {
+      usage();
+    }
+  }
+
+  if (arg_pos < argc) {
+    jobs = calloc(argc-arg_pos, sizeof(Job));
+    if (!jobs) {
+      perror("Couldn't get memory for jobs");
+      exit(1);
+    }
+    for (; arg_pos < argc; arg_pos++)
+      jobs[num_jobs++].filename = argv[arg_pos];
+  } else {
+    num_jobs = read_filenames(stdin, &jobs);
+  }
+  if (num_threads < 1)
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (!verify_tapes) {
+    loadrom(rom);
+    z80_init();
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (jobpool_run(num_jobs, num_threads,
+                  verify_tapes ? verify_tape_job : run_job, jobs)) {
+    fprintf(stderr, "Couldn't run jobs: out of memory\n");
+    exit(1);
+  }
+
+  for (job = 0; job < num_jobs; job++) {
+    if (verify_tapes) {
+      printf("%s: %s, %d files, %d bad\n", jobs[job].filename,
+             job_status_names[jobs[job].status], jobs[job].tape_files,
+             jobs[job].bad_tape_files);
+    } else {
+      printf("%s: %s, %.3fs, %llu T-states\n", jobs[job].filename,
+             job_status_names[jobs[job].status], jobs[job].wall_secs,
+             jobs[job].tstates);
+    }
+    if (jobs[job].status != JOB_FINISHED) failures++;
+    total_tstates += jobs[job].tstates;
+  }
+  if (verify_tapes) {
+    printf("%d tapes, %d failed, %.3fs\n", num_jobs, failures,
+           elapsed_secs(&start));
+  } else {
+    printf("%d runs, %d failed, %.3fs, %llu T-states\n", num_jobs, failures,
+           elapsed_secs(&start), total_tstates);
+  }
+
+  exit(failures ? 1 : 0);
+}
@@ -21,116 +21,413 @@
  */
 
 #include <limits.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
+#ifdef MITSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 #include "z80.h"
+#include "ace.h"
 #include "tape.h"
 #include "keyboard.h"
 #include "spooler.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "framebuf.h"
+#include "profiler.h"
 #include "xace_icon.h"
 
 #define MAX_DISP_LEN 256
-#define BORDER_WIDTH  (20*SCALE)
-
-int rrnoshm=4;
-unsigned char mem[65536];
-unsigned char *memptr[8] = {
-  mem,
-  mem+0x2000,
-  mem+0x4000,
-  mem+0x6000,
-  mem+0x8000,
-  mem+0xa000,
-  mem+0xc000,
-  mem+0xe000
-};
-
-unsigned long tstates=0,tsmax=62500;
-
-int memattr[8]={0,1,1,1,1,1,1,1}; /* 8K RAM Banks */
-
-int hsize=256*SCALE,vsize=192*SCALE;
-
-/*
- * interrupted states:
- *   0 No interrupt
- *   1 Interrupted
- *   2 Processing Interrupt
- */
-volatile int interrupted=0;
-int reset_ace = 0;
-int scrn_freq=2;
-
-/* Used to see if image needs refreshing on X display */
-unsigned char video_ram_old[24*32];
-
-int refresh_screen=1;
+#define BORDER_WIDTH  (20*scale)
+#define DEFAULT_SCALE 2
+#define MAX_SCALE 4
+#define HEADLESS_EXIT_DELAY 50
+#define FRAME_NSECS 20000000L  /* 50 frames/sec */
+#define FORK_SERVER_BOOT_FRAMES 100
+#define FORK_RUN_TIMEOUT_FRAMES 30000  /* 10 minutes of the Ace's time */
+/* The exit status of a forked run that was given up on */
+#define FORK_RUN_TIMED_OUT 2
+#define KEY_QUEUE_SIZE 64
+
+static Ace *ace;
+
+/* Size of each Ace pixel on the display */
+static int scale=DEFAULT_SCALE;
+int hsize=256*DEFAULT_SCALE,vsize=192*DEFAULT_SCALE;
+
+/* When set no X display is opened and input only comes from the
+ * spooler and tape */
+static int headless=0;
+/* Interrupts left to run after the spool file closes in headless mode */
+static int headless_exit_countdown=-1;
+/* Frames to run before quitting, or 0 to run until told to quit */
+static unsigned long max_frames=0;
+static unsigned long frame_count=0;
+/* When set the emulator is kept to the speed of a real Ace */
+static int throttle=1;
+/* When set the emulator always runs unthrottled */
+static int turbo=0;
+/* Wall clock time by which the current frame should have finished */
+static struct timespec frame_end_time;
+/* Snapshot to load before starting and to save when a run finishes */
+static char *start_snapshot_filename=NULL;
+static char *finish_snapshot_filename=NULL;
+/* Where to write the profile of the Forth words run, if anywhere */
+static char *profile_filename=NULL;
+static char fork_profile_filename[FILENAME_MAX];
+static Profiler *profiler=NULL;
+/* When set the ROM's arithmetic primitives are run natively */
+static int native_primitives=0;
+/* Built up here rather than on the stack because of the size of mem */
+static Snapshot snapshot;
+/* In fork server mode, the number of test runs to have going at once,
+ * otherwise 0 */
+static int fork_jobs=0;
+static int boot_spooled=0;
+/* Frames a forked run can take before it is given up on */
+static unsigned long fork_timeout_frames=FORK_RUN_TIMEOUT_FRAMES;
+/* In a forked run, the frame to give up at, otherwise 0 */
+static unsigned long timeout_frames=0;
 
 /* Prototypes */
 void loadrom(unsigned char *x);
 void startup(int *argc, char **argv);
-void check_events(void);
-void refresh(void);
+void take_key_events(void);
+void publish_frame(void);
 void closedown(void);
 
-/* Handle the SIGALRM signal used for the Ace's interrupt */
-void
-sigint_handler(int signum)
+static void
+write_profile(void)
 {
-  if (interrupted == 0) interrupted = 1;
+  if (profiler && profiler_write(profiler, profile_filename))
+    fprintf(stderr, "Couldn't write profile: %s\n", profile_filename);
 }
 
-/* Handle any Signals to do with quiting the program */
+/* Set by sigquit_handler() for the emulation to quit at the end of the
+ * frame */
+static volatile sig_atomic_t quit_requested=0;
+
+/* Handle any Signals to do with quiting the program.  Closing down isn't
+ * safe from a signal handler, so it is left to the end of the frame. */
 void
 sigquit_handler(int signum)
 {
-  tape_detach();
-  closedown();
-  exit(1);
+  (void)signum;
+  quit_requested = 1;
 }
 
-/* ints_per_sec   Interrupts per second up to 1000 */
+/* A fault can't be returned from to close down, so just go */
 static void
-set_itimer(int ints_per_sec)
+sigfault_handler(int signum)
 {
-  struct itimerval itv;
-  int freq = 1000/ints_per_sec;
+  (void)signum;
+  _exit(1);
+}
 
-  itv.it_interval.tv_sec = 0;
-  itv.it_interval.tv_usec = (freq % 1000) * 1000;
-  itv.it_value.tv_sec = itv.it_interval.tv_sec;
-  itv.it_value.tv_usec = itv.it_interval.tv_usec;
-  setitimer(ITIMER_REAL, &itv, NULL);
+static void
+quit(void)
+{
+  write_profile();
+#ifdef OPSTATS
+  opstats_print(&ace->opstats, stderr);
+#endif
+  tape_detach(&ace->tape);
+  closedown();
+  exit(1);
 }
 
 static void
 normal_speed(void)
 {
-  set_itimer(50);    /* 50 ints/sec */
-  scrn_freq = 4;
-  tsmax = 62500;
+  throttle = 1;
+  turbo = 0;
+  clock_gettime(CLOCK_MONOTONIC, &frame_end_time);
 }
 
 static void
 fast_speed(void)
 {
-  set_itimer(1000);  /* 1000 ints/sec */
-  scrn_freq = 4;
-  tsmax = ULONG_MAX;
+  throttle = 0;
+  turbo = 0;
+}
+
+/* Run as fast as possible for the rest of the session.  As interrupts
+ * are driven by the T-state count a run doesn't depend on the speed of
+ * the host */
+static void
+turbo_speed(void)
+{
+  throttle = 0;
+  turbo = 1;
+}
+
+/* Sleep until the wall clock catches up with the end of the frame */
+static void
+wait_for_frame_end(void)
+{
+  struct timespec now;
+
+  frame_end_time.tv_nsec += FRAME_NSECS;
+  if (frame_end_time.tv_nsec >= 1000000000L) {
+    frame_end_time.tv_nsec -= 1000000000L;
+    frame_end_time.tv_sec++;
+  }
+
+  /* If we have fallen too far behind, e.g. after being stopped, then
+   * don't try to catch up */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec > frame_end_time.tv_sec+1) {
+    frame_end_time = now;
+    return;
+  }
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                         &frame_end_time, NULL) != 0)
+    ;
+}
+
+/* This must be called from an event so that z80_state is up to date */
+static void
+save_snapshot(char *filename)
+{
+  int port;
+
+  snapshot.z80 = ace->z80;
+  snapshot.tstates = ace->tstates;
+  snapshot.interrupted = ace->interrupted;
+  for (port = 0; port < 8; port++)
+    snapshot.keyboard_ports[port] =
+      keyboard_get_keyport(&ace->keyboard, port);
+  tape_get_state(&ace->tape, &snapshot.tape);
+  memcpy(snapshot.mem, ace->mem, sizeof(snapshot.mem));
+
+  if (snapshot_write(filename, &snapshot))
+    fprintf(stderr, "Couldn't save snapshot: %s\n", filename);
+}
+
+/* Quit with status once a run has finished, in headless mode printing
+ * the screen */
+static void
+finish_run(int status)
+{
+  if (finish_snapshot_filename)
+    save_snapshot(finish_snapshot_filename);
+  write_profile();
+  if (headless)
+    ace_print_screen_text(ace, stdout);
+#ifdef OPSTATS
+  opstats_print(&ace->opstats, stderr);
+#endif
+  tape_detach(&ace->tape);
+  closedown();
+  exit(status);
+}
+
+/* Set up a forked child to run one test from the booted machine, with
+ * the screen written to <spool filename>.out when it finishes */
+static void
+start_fork_child(char *spool_filename)
+{
+  char out_filename[FILENAME_MAX];
+  TapeState tape_state;
+  int null_fd;
+
+  /* Keep the child's stdio away from the list of spool files, which the
+   * server is still reading */
+  if ((null_fd = open("/dev/null", O_RDONLY)) >= 0) {
+    dup2(null_fd, STDIN_FILENO);
+    close(null_fd);
+  }
+
+  snprintf(out_filename, sizeof(out_filename), "%s.out", spool_filename);
+  if (!freopen(out_filename, "w", stdout)) {
+    perror(out_filename);
+    exit(1);
+  }
+
+  /* Reattach any tape so that its file position isn't shared */
+  tape_get_state(&ace->tape, &tape_state);
+  if (tape_set_state(&ace->tape, &tape_state)) {
+    fprintf(stderr, "Couldn't reattach tape image: %s\n", tape_state.filename);
+    exit(1);
+  }
+
+  fork_jobs = 0;
+  finish_snapshot_filename = NULL;
+  if (profile_filename) {
+    snprintf(fork_profile_filename, sizeof(fork_profile_filename),
+             "%s.profile", spool_filename);
+    profile_filename = fork_profile_filename;
+    profiler_reset(profiler);
+  }
+  frame_count = 0;
+  max_frames = 0;
+  timeout_frames = fork_timeout_frames;
+  headless_exit_countdown = -1;
+  spooler_open(&ace->spooler, spool_filename);
+}
+
+/* Wait for a child to finish, returning 1 if its run failed */
+static int
+wait_for_fork_child(pid_t *pids, char (*spool_filenames)[FILENAME_MAX])
+{
+  pid_t pid;
+  int status, job;
+
+  while ((pid = wait(&status)) < 0)
+    ;
+
+  for (job = 0; job < fork_jobs && pids[job] != pid; job++)
+    ;
+  if (job == fork_jobs) return 0;
+  pids[job] = 0;
+
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    return 0;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == FORK_RUN_TIMED_OUT)
+    fprintf(stderr, "Run timed out for spool file: %s\n",
+            spool_filenames[job]);
+  else
+    fprintf(stderr, "Run failed for spool file: %s\n", spool_filenames[job]);
+  return 1;
+}
+
+/* Once booted, fork a child for each spool file named on stdin, with up
+ * to fork_jobs running at once.  Each child shares the booted machine
+ * copy-on-write and returns from here to run its spool file, while the
+ * server quits once every run has finished. */
+static void
+fork_server(void)
+{
+  char spool_filename[FILENAME_MAX];
+  char (*spool_filenames)[FILENAME_MAX];
+  pid_t *pids;
+  pid_t pid;
+  int running = 0, failures = 0, job;
+
+  pids = calloc(fork_jobs, sizeof(pid_t));
+  spool_filenames = calloc(fork_jobs, FILENAME_MAX);
+  if (!pids || !spool_filenames) {
+    perror("Couldn't get memory for fork server");
+    exit(1);
+  }
+
+  fflush(stdout);
+  while (!quit_requested &&
+         fgets(spool_filename, sizeof(spool_filename), stdin)) {
+    spool_filename[strcspn(spool_filename, "\r\n")] = 0;
+    if (!spool_filename[0]) continue;
+    if (access(spool_filename, R_OK) != 0) {
+      fprintf(stderr, "Couldn't open spool file: %s\n", spool_filename);
+      failures++;
+      continue;
+    }
+
+    if (running == fork_jobs) {
+      failures += wait_for_fork_child(pids, spool_filenames);
+      running--;
+    }
+    for (job = 0; pids[job] != 0; job++)
+      ;
+
+    pid = fork();
+    if (pid == 0) {
+      free(pids);
+      free(spool_filenames);
+      start_fork_child(spool_filename);
+      return;
+    } else if (pid < 0) {
+      perror("fork failed");
+      failures++;
+    } else {
+      pids[job] = pid;
+      strcpy(spool_filenames[job], spool_filename);
+      running++;
+    }
+  }
+
+  while (running > 0) {
+    failures += wait_for_fork_child(pids, spool_filenames);
+    running--;
+  }
+
+  tape_detach(&ace->tape);
+  closedown();
+  exit(failures || quit_requested ? 1 : 0);
+}
+
+/* Called by the Ace at the end of every frame */
+static void
+frame_handler(Ace *ace)
+{
+  (void)ace;
+  take_key_events();
+  if (quit_requested) quit();
+  publish_frame();
+
+  frame_count++;
+  if ((headless_exit_countdown > 0 && --headless_exit_countdown == 0) ||
+      frame_count == max_frames) {
+    if (fork_jobs)
+      fork_server();
+    else
+      finish_run(0);
+  } else if (frame_count == timeout_frames) {
+    finish_run(FORK_RUN_TIMED_OUT);
+  }
+
+  if (throttle) wait_for_frame_end();
 }
 
+/* This must be called from an event or between steps, as the registers
+ * are picked up by z80_run() afterwards */
+static void
+load_snapshot(char *filename)
+{
+  int port;
+
+  if (snapshot_read(filename, &snapshot)) {
+    fprintf(stderr, "Couldn't load snapshot: %s\n", filename);
+    return;
+  }
+  if (tape_set_state(&ace->tape, &snapshot.tape)) {
+    fprintf(stderr, "Couldn't load snapshot: %s: missing tape image: %s\n",
+            filename, snapshot.tape.filename);
+    return;
+  }
+
+  ace->z80 = snapshot.z80;
+  ace->z80_state_changed = 1;
+  ace->tstates = snapshot.tstates;
+  ace->interrupted = snapshot.interrupted;
+  for (port = 0; port < 8; port++)
+    keyboard_set_keyport(&ace->keyboard, port, snapshot.keyboard_ports[port]);
+  memcpy(ace->mem, snapshot.mem, sizeof(snapshot.mem));
+  /* The snapshot's ROM may have been saved with the other setting */
+  ace_set_native_primitives(ace, native_primitives);
+
+  mark_all_dirty();
+  scheduler_realign(&ace->scheduler, ace->tstates);
+}
 
 static void
 tape_observer(int tape_attached, int tape_pos,
@@ -163,8 +460,9 @@ tape_observer(int tape_attached, int tape_pos,
 }
 
 static void
-spooler_observer(SpoolerMessage message)
+spooler_handler(Ace *ace, SpoolerMessage message)
 {
+  (void)ace;
   switch (message) {
     case SPOOLER_OPENED:
       printf("Opened spool file.\n");
@@ -175,27 +473,132 @@ spooler_observer(SpoolerMessage message)
       break;
 
     case SPOOLER_CLOSED:
-      normal_speed();
+      if (headless && !max_frames)
+        headless_exit_countdown = HEADLESS_EXIT_DELAY;
+      else if (!turbo)
+        normal_speed();
       printf("Closed spool file.\n");
       break;
+
+    case SPOOLER_NO_MESSAGE:
+      break;
   }
 }
 
+/* Print the files on a tape image, without attaching it to the Ace */
+static void
+list_tape(char *filename)
+{
+  Tape tape;
+
+  tape_init(&tape);
+  if (!tape_attach_read_only(&tape, filename)) {
+    fprintf(stderr, "Couldn't open tape image: %s\n", filename);
+    exit(1);
+  }
+  tape_print_index(&tape, stdout);
+  tape_detach(&tape);
+  exit(0);
+}
+
 void
 handle_cli_args(int argc, char **argv)
 {
   int arg_pos = 0;
   char *cli_switch;
+  SpoolerMode spooler_mode;
 
   while (arg_pos < argc) {
     cli_switch = argv[arg_pos];
-    if (strcasecmp("-s", cli_switch) == 0) {
-      if (strcmp("-S", cli_switch) == 0) {
+    if (strcmp("-headless", cli_switch) == 0) {
+      headless = 1;
+      turbo_speed();
+    } else if (strcmp("-turbo", cli_switch) == 0) {
+      turbo_speed();
+    } else if (strcmp("-frames", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        max_frames = strtoul(argv[arg_pos], NULL, 10);
+      } else {
+        fprintf(stderr, "Error: Missing number for %s arg\n", cli_switch);
+      }
+    } else if (strcmp("-forkserver", cli_switch) == 0) {
+      headless = 1;
+      turbo_speed();
+      if (!fork_jobs)
+        fork_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+      if (fork_jobs < 1)
+        fork_jobs = 1;
+    } else if (strcmp("-timeout", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        fork_timeout_frames = strtoul(argv[arg_pos], NULL, 10);
+      } else {
+        fprintf(stderr, "Error: Missing number for %s arg\n", cli_switch);
+      }
+    } else if (strcmp("-jobs", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        fork_jobs = atoi(argv[arg_pos]);
+      } else {
+        fprintf(stderr, "Error: Missing number for %s arg\n", cli_switch);
+      }
+    } else if (strcmp("-loadsnap", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        start_snapshot_filename = argv[arg_pos];
+      } else {
+        fprintf(stderr, "Error: Missing filename for %s arg\n", cli_switch);
+      }
+    } else if (strcmp("-savesnap", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        finish_snapshot_filename = argv[arg_pos];
+      } else {
+        fprintf(stderr, "Error: Missing filename for %s arg\n", cli_switch);
+      }
+    } else if (strcmp("-profile", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        profile_filename = argv[arg_pos];
+      } else {
+        fprintf(stderr, "Error: Missing filename for %s arg\n", cli_switch);
+      }
+    } else if (strcmp("-nativeprims", cli_switch) == 0) {
+      native_primitives = 1;
+      ace_set_native_primitives(ace, native_primitives);
+    } else if (strcmp("-safesaves", cli_switch) == 0) {
+      ace->tape.safe_saves = 1;
+    } else if (strcmp("-scale", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        scale = atoi(argv[arg_pos]);
+        if (scale < 1 || scale > MAX_SCALE) {
+          fprintf(stderr, "Error: Scale must be from 1 to %d\n", MAX_SCALE);
+          exit(1);
+        }
+        hsize = 256*scale;
+        vsize = 192*scale;
+      } else {
+        fprintf(stderr, "Error: Missing number for %s arg\n", cli_switch);
+      }
+    } else if (strcmp("-listtape", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        list_tape(argv[arg_pos]);
+      } else {
+        fprintf(stderr, "Error: Missing filename for %s arg\n", cli_switch);
+      }
+    } else if (strcmp("-spoolmode", cli_switch) == 0) {
+      if (++arg_pos < argc) {
+        if (spooler_parse_mode(argv[arg_pos], &spooler_mode) != 0) {
+          fprintf(stderr, "Error: Spool mode must be keys, fast or lines\n");
+          exit(1);
+        }
+        ace_set_spooler_mode(ace, spooler_mode);
+      } else {
+        fprintf(stderr, "Error: Missing mode for %s arg\n", cli_switch);
+      }
+    } else if (strcasecmp("-s", cli_switch) == 0) {
+      if (strcmp("-S", cli_switch) == 0 && !turbo) {
         fast_speed();
       }
 
       if (++arg_pos < argc) {
-        spooler_open(argv[arg_pos]);
+        spooler_open(&ace->spooler, argv[arg_pos]);
+        boot_spooled = 1;
       } else {
         fprintf(stderr, "Error: Missing filename for %s arg\n", cli_switch);
       }
@@ -207,23 +610,21 @@ handle_cli_args(int argc, char **argv)
 static void
 setup_sighandlers(void)
 {
-  struct sigaction sa_quit;
-  struct sigaction sa_alarm;
+  struct sigaction sa_quit, sa_fault;
   memset(&sa_quit, 0, sizeof(sa_quit));
-  memset(&sa_alarm, 0, sizeof(sa_alarm));
+  memset(&sa_fault, 0, sizeof(sa_fault));
 
   sa_quit.sa_handler = sigquit_handler;
   sa_quit.sa_flags = 0;
-  sa_alarm.sa_handler = sigint_handler;
-  sa_alarm.sa_flags = SA_RESTART;
+  sa_fault.sa_handler = sigfault_handler;
+  sa_fault.sa_flags = 0;
 
   if (sigaction(SIGINT,  &sa_quit, NULL) < 0) goto error;
   if (sigaction(SIGHUP,  &sa_quit, NULL) < 0) goto error;
-  if (sigaction(SIGILL,  &sa_quit, NULL) < 0) goto error;
+  if (sigaction(SIGILL,  &sa_fault, NULL) < 0) goto error;
   if (sigaction(SIGTERM, &sa_quit, NULL) < 0) goto error;
   if (sigaction(SIGQUIT, &sa_quit, NULL) < 0) goto error;
-  if (sigaction(SIGSEGV, &sa_quit, NULL) < 0) goto error;
-  if (sigaction(SIGALRM, &sa_alarm, NULL) < 0) goto error;
+  if (sigaction(SIGSEGV, &sa_fault, NULL) < 0) goto error;
   return;
 
 error:
@@ -236,33 +637,53 @@ emu_key_handler(KeySym ks, int key_state)
 {
   char spool_filename[257];
   char tape_filename[257];
+  char snapshot_filename[257];
 
   switch (ks) {
     case XK_q:
       /* If Ctrl-q then Quit xAce */
-      if (key_state & ControlMask) {
-        raise(SIGQUIT);
-        /* doesn't return */
-      }
+      if (key_state & ControlMask)
+        quit_requested = 1;
       break;
 
     case XK_F3:
       printf("Enter tape image file:");
       scanf("%256s", tape_filename);
-      tape_attach(tape_filename);
+      tape_attach(&ace->tape, tape_filename);
+      break;
+
+    case XK_F6:
+      printf("Enter snapshot file to save:");
+      scanf("%256s", snapshot_filename);
+      save_snapshot(snapshot_filename);
+      break;
+
+    case XK_F7:
+      printf("Enter snapshot file to load:");
+      scanf("%256s", snapshot_filename);
+      load_snapshot(snapshot_filename);
       break;
 
+    case XK_F5:
+      native_primitives = !native_primitives;
+      ace_set_native_primitives(ace, native_primitives);
+      printf("Native primitives %s\n", native_primitives ? "on" : "off");
+      break;
+
+#ifdef OPSTATS
+    case XK_F8:
+      opstats_print(&ace->opstats, stderr);
+      break;
+#endif
+
     case XK_F11:
       printf("Enter spool file:");
       scanf("%256s", spool_filename);
-      spooler_open(spool_filename);
+      spooler_open(&ace->spooler, spool_filename);
       break;
 
     case XK_F12:
-      reset_ace = 1; /* will cause a reset */
-      memset(mem+8192, 0xff, 57344);
-      refresh_screen = 1;
-      keyboard_clear();
+      ace_reset(ace);
       break;
   }
 }
@@ -270,30 +691,67 @@ emu_key_handler(KeySym ks, int key_state)
 void
 main(int argc, char **argv)
 {
+  unsigned char rom[ACE_ROM_SIZE];
+
   printf("xace: Jupiter ACE emulator v%s (by Edward Patel)\n", XACE_VERSION);
   printf("Keys:\n");
   printf("\tF1     - Delete Line\n");
   printf("\tF3     - Attach a tape image\n");
   printf("\tF4     - Inverse Video\n");
+  printf("\tF5     - Toggle native primitives\n");
+  printf("\tF6     - Save a snapshot\n");
+  printf("\tF7     - Load a snapshot\n");
+#ifdef OPSTATS
+  printf("\tF8     - Print the opcode counts\n");
+#endif
   printf("\tF9     - Graphics\n");
   printf("\tF11    - Spool from a file\n");
   printf("\tF12    - Reset\n");
   printf("\tEsc    - Break\n");
   printf("\tCtrl-Q - Quit xAce\n");
+  printf("Options:\n");
+  printf("\t-s file   - Spool from a file\n");
+  printf("\t-S file   - Spool from a file quickly\n");
+  printf("\t-spoolmode m - Spool by keys, fast keys or lines\n");
+  printf("\t-turbo    - Run as fast as possible\n");
+  printf("\t-headless - Run without an X display\n");
+  printf("\t-frames n - Quit after n frames\n");
+  printf("\t-scale n  - Scale the display by n, from 1 to %d\n", MAX_SCALE);
+  printf("\t-forkserver - Boot, then fork a run for each spool file on stdin\n");
+  printf("\t-jobs n   - Runs to have going at once with -forkserver\n");
+  printf("\t-timeout n - Give up on a -forkserver run after n frames\n");
+  printf("\t-loadsnap file - Start from a snapshot\n");
+  printf("\t-savesnap file - Save a snapshot when the run finishes\n");
+  printf("\t-listtape file - List the files on a tape image and quit\n");
+  printf("\t-safesaves - Sync each save and rename it over the tape image\n");
+  printf("\t-profile file - Write a profile of the Forth words run\n");
+  printf("\t-nativeprims - Run the ROM's arithmetic primitives natively\n");
+
+  loadrom(rom);
+  ace = ace_create(rom);
+  if (!ace) {
+    fprintf(stderr, "Couldn't get memory for the Ace\n");
+    exit(1);
+  }
+  ace->frame_handler = frame_handler;
+  ace->spooler_handler = spooler_handler;
 
-  loadrom(mem);
-  tape_patches(mem);
-  memset(mem+8192, 0xff, 57344);
-  memset(video_ram_old, 0xff, 768);
-
-  spooler_init(spooler_observer, keyboard_clear, keyboard_keypress);
-  startup(&argc, argv);
   setup_sighandlers();
   normal_speed();
   handle_cli_args(argc, argv);
-  tape_add_observer(tape_observer);
-  keyboard_init(emu_key_handler);
-  mainloop();
+  if (fork_jobs && !boot_spooled && !max_frames)
+    max_frames = FORK_SERVER_BOOT_FRAMES;
+  if (profile_filename && !(profiler = profiler_create(ace))) {
+    fprintf(stderr, "Couldn't start the profiler\n");
+    exit(1);
+  }
+  startup(&argc, argv);
+  tape_add_observer(&ace->tape, tape_observer);
+  keyboard_init(&ace->keyboard, emu_key_handler);
+  if (start_snapshot_filename)
+    load_snapshot(start_snapshot_filename);
+  while (1)
+    ace_step(ace, ACE_FRAME_TSTATES);
 }
 
 void
@@ -318,60 +776,6 @@ loadrom(unsigned char *x)
 }
 
 
-unsigned int
-in(int h, int l)
-{
-  if(l==0xfe) /* keyboard */
-    switch(h) {
-      case 0xfe: return(keyboard_get_keyport(0));
-      case 0xfd: return(keyboard_get_keyport(1));
-      case 0xfb: return(keyboard_get_keyport(2));
-      case 0xf7: return(keyboard_get_keyport(3));
-      case 0xef: return(keyboard_get_keyport(4));
-      case 0xdf: return(keyboard_get_keyport(5));
-      case 0xbf: return(keyboard_get_keyport(6));
-      case 0x7f: return(keyboard_get_keyport(7));
-      default:  return(255);
-    }
-  return(255);
-}
-
-
-unsigned int
-out(int h, int l, int a)
-{
-  return(0);
-}
-
-
-void
-fix_tstates(void)
-{
-  tstates=0;
-  pause();
-}
-
-
-void
-do_interrupt(void)
-{
-  static int count=0;
-  if (interrupted == 1) {
-    interrupted = 2;
-
-    /* only do refresh() every 1/Nth */
-    count++;
-    if (count >= scrn_freq) {
-      count=0;
-      spooler_read();
-      refresh();
-    }
-
-    check_events();
-
-    interrupted = 0;
-  }
-}
 
 /* the remainder of xmain.c is based on xz80's xspectrum.c. */
 static Display *display;
@@ -385,10 +789,59 @@ static Window borderwin, mainwin;
 static XImage *ximage;
 static unsigned char *image;
 static int linelen;
+/* Bytes from one row of the image to the next, which X may pad */
+static int image_stride;
 static int bytes_per_pixel;
 static int black,white;
 static int invert=0;
+/* Every character rendered at the current scale and pixel format, with
+ * the 128 glyphs followed by their inverse.  Each character is 8 rows
+ * of glyph_row_len bytes, which are copied scale times into the image */
+static unsigned char *glyph_cache;
+static int glyph_row_len;
+/* Copies a character from the glyph cache into the image */
+typedef void (*GlyphDrawer)(unsigned char *image_row,
+                            unsigned char *glyph_row, int stride);
+static GlyphDrawer draw_glyph;
+/* Set when the image is in memory shared with the X server */
+static int mitshm=0;
+#ifdef MITSHM
+static XShmSegmentInfo xshminfo;
+static int shm_attach_failed;
+#endif
 static int borderchange=1;
+/* Set by the display thread when the whole image must be redrawn */
+static int refresh_screen=1;
+/* The frame last drawn into the image */
+static Frame shown;
+/* Cells and glyphs changed in frames published since the last one the
+ * display thread is known to have taken */
+static unsigned long untaken_cells[24], untaken_glyphs[4];
+static struct timespec last_refresh_time;
+
+/* The emulation runs on the main thread and hands each changed frame to
+ * a display thread, which alone uses the X display once started.  Key
+ * events are handed back through key_queue, so that a slow X server
+ * never holds up the Z80 and the keyboard is read while it is busy. */
+static FrameBuffer framebuf;
+static pthread_t display_thread;
+static int display_thread_started=0;
+static atomic_int display_quit;
+/* Written to wake the display thread when a frame is published */
+static int wakeup_pipe[2];
+
+typedef struct KeyEvent {
+  KeySym ks;
+  unsigned int state;
+  int pressed;
+} KeyEvent;
+
+/* Only the display thread adds to the tail and only the emulation thread
+ * takes from the head */
+static KeyEvent key_queue[KEY_QUEUE_SIZE];
+static atomic_uint key_queue_head, key_queue_tail;
+
+static void *display_thread_main(void *arg);
 
 static Display *
 open_display(int *argc, char **argv)
@@ -412,29 +865,162 @@ open_display(int *argc, char **argv)
 }
 
 
-static int image_init()
+/* Glyph drawers for each scale and common pixel size, so that the row
+ * length is a constant the compiler can work with */
+#define GLYPH_DRAWER(s, bpp) \
+static void \
+draw_glyph_##s##x##bpp(unsigned char *image_row, unsigned char *glyph_row, \
+                       int stride) \
+{ \
+  int charbmap_y, sy; \
+  for (charbmap_y = 0; charbmap_y < 8; charbmap_y++) { \
+    for (sy = 0; sy < s; sy++) { \
+      memcpy(image_row, glyph_row, 8*s*bpp); \
+      image_row += stride; \
+    } \
+    glyph_row += 8*s*bpp; \
+  } \
+}
+
+GLYPH_DRAWER(1, 1) GLYPH_DRAWER(1, 2) GLYPH_DRAWER(1, 4)
+GLYPH_DRAWER(2, 1) GLYPH_DRAWER(2, 2) GLYPH_DRAWER(2, 4)
+GLYPH_DRAWER(3, 1) GLYPH_DRAWER(3, 2) GLYPH_DRAWER(3, 4)
+GLYPH_DRAWER(4, 1) GLYPH_DRAWER(4, 2) GLYPH_DRAWER(4, 4)
+
+/* Indexed by [scale-1][bytes_per_pixel-1] */
+static const GlyphDrawer glyph_drawers[MAX_SCALE][4] = {
+  {draw_glyph_1x1, draw_glyph_1x2, NULL, draw_glyph_1x4},
+  {draw_glyph_2x1, draw_glyph_2x2, NULL, draw_glyph_2x4},
+  {draw_glyph_3x1, draw_glyph_3x2, NULL, draw_glyph_3x4},
+  {draw_glyph_4x1, draw_glyph_4x2, NULL, draw_glyph_4x4}
+};
+
+/* For pixel sizes without a specialised drawer */
+static void
+draw_glyph_generic(unsigned char *image_row, unsigned char *glyph_row,
+                   int stride)
 {
-  ximage=XCreateImage(display,DefaultVisual(display,screen),
-         DefaultDepth(display,screen),ZPixmap,0,NULL,hsize,vsize,
-         8,0);
-  if(!ximage){
-    perror("XCreateImage failed");
+  int charbmap_y, sy;
+
+  for (charbmap_y = 0; charbmap_y < 8; charbmap_y++) {
+    for (sy = 0; sy < scale; sy++) {
+      memcpy(image_row, glyph_row, glyph_row_len);
+      image_row += stride;
+    }
+    glyph_row += glyph_row_len;
+  }
+}
+
+static GlyphDrawer
+select_glyph_drawer(void)
+{
+  GlyphDrawer drawer = NULL;
+
+  if (bytes_per_pixel >= 1 && bytes_per_pixel <= 4)
+    drawer = glyph_drawers[scale-1][bytes_per_pixel-1];
+  return drawer ? drawer : draw_glyph_generic;
+}
+
+#ifdef MITSHM
+static int
+shm_error_handler(Display *display, XErrorEvent *event)
+{
+  (void)display;
+  (void)event;
+  shm_attach_failed=1;
+  return 0;
+}
+
+/* Try to create the image in memory shared with the X server.  Returns 1
+ * if this isn't possible, such as with a remote display, so that the
+ * caller can fall back to an ordinary XImage. */
+static int
+image_init_shm(void)
+{
+  int (*old_handler)(Display *, XErrorEvent *);
+
+  if(!XShmQueryExtension(display))
+    return 1;
+  ximage=XShmCreateImage(display,DefaultVisual(display,screen),
+         DefaultDepth(display,screen),ZPixmap,NULL,&xshminfo,hsize,vsize);
+  if(!ximage)
+    return 1;
+  xshminfo.shmid=shmget(IPC_PRIVATE,
+                        ximage->bytes_per_line*(ximage->height+1),
+                        IPC_CREAT|0600);
+  if(xshminfo.shmid==-1){
+    XDestroyImage(ximage);
     return 1;
   }
-  ximage->data=malloc(ximage->bytes_per_line*(ximage->height+1));
-  if(!ximage->data){
-    perror("Couldn't get memory for XImage data");
+  xshminfo.shmaddr=ximage->data=shmat(xshminfo.shmid,NULL,0);
+  if(xshminfo.shmaddr==(char *)-1){
+    shmctl(xshminfo.shmid,IPC_RMID,NULL);
+    ximage->data=NULL;
+    XDestroyImage(ximage);
     return 1;
   }
-  scrn_freq=rrnoshm;
-  linelen=ximage->bytes_per_line/SCALE;
-  bytes_per_pixel = linelen / 256;
+  xshminfo.readOnly=True;
+
+  /* XShmAttach only reports failure through an X error */
+  shm_attach_failed=0;
+  XSync(display,False);
+  old_handler=XSetErrorHandler(shm_error_handler);
+  XShmAttach(display,&xshminfo);
+  XSync(display,False);
+  XSetErrorHandler(old_handler);
+
+  /* The segment goes once both we and the server have detached from it */
+  shmctl(xshminfo.shmid,IPC_RMID,NULL);
+  if(shm_attach_failed){
+    shmdt(xshminfo.shmaddr);
+    ximage->data=NULL;
+    XDestroyImage(ximage);
+    return 1;
+  }
+  return 0;
+}
+#endif
+
+static int image_init()
+{
+#ifdef MITSHM
+  if(!image_init_shm()){
+    mitshm=1;
+  } else
+#endif
+  {
+    ximage=XCreateImage(display,DefaultVisual(display,screen),
+           DefaultDepth(display,screen),ZPixmap,0,NULL,hsize,vsize,
+           8,0);
+    if(!ximage){
+      perror("XCreateImage failed");
+      return 1;
+    }
+    ximage->data=malloc(ximage->bytes_per_line*(ximage->height+1));
+    if(!ximage->data){
+      perror("Couldn't get memory for XImage data");
+      return 1;
+    }
+  }
+  linelen=ximage->bytes_per_line/scale;
+  image_stride=ximage->bytes_per_line;
+  bytes_per_pixel = ximage->bits_per_pixel / 8;
 
   /* The following represent 4, 8, 16 or 32 bpp repectively */
   if(linelen!=32 && linelen!=256 && linelen!=512 && linelen!=1024)
     fprintf(stderr,"Line length=%d; expect strange results!\n",linelen);
 
   image=ximage->data;
+
+  if (linelen != 32) {
+    glyph_row_len=8*scale*bytes_per_pixel;
+    draw_glyph=select_glyph_drawer();
+    glyph_cache=malloc(256*8*glyph_row_len);
+    if(!glyph_cache){
+      perror("Couldn't get memory for glyph cache");
+      return 1;
+    }
+  }
   return 0;
 }
 
@@ -485,9 +1071,59 @@ notify(int *argc, char **argv)
 }
 
 
+/* Start the display thread with every signal blocked, so that they are
+ * all handled on the emulation thread */
+static void
+start_display_thread(void)
+{
+  sigset_t all_signals, old_signals;
+
+  if (pipe(wakeup_pipe) < 0) {
+    perror("Couldn't create pipe for display thread");
+    exit(1);
+  }
+  fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+  framebuf_init(&framebuf);
+  atomic_init(&display_quit, 0);
+
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  if (pthread_create(&display_thread, NULL, display_thread_main, NULL)) {
+    fputs("Couldn't start display thread\n", stderr);
+    exit(1);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  display_thread_started=1;
+}
+
+/* Write to the pipe the display thread polls.  If the pipe is full the
+ * write fails with EAGAIN, but the thread is then already due to wake. */
+static void
+wake_display_thread(void)
+{
+  while (write(wakeup_pipe[1], "", 1) < 0 && errno == EINTR)
+    ;
+}
+
+static void
+stop_display_thread(void)
+{
+  if (!display_thread_started) return;
+  atomic_store(&display_quit, 1);
+  wake_display_thread();
+  pthread_join(display_thread, NULL);
+  display_thread_started=0;
+  close(wakeup_pipe[0]);
+  close(wakeup_pipe[1]);
+}
+
 void
 startup(int *argc, char **argv)
 {
+  if (headless)
+    return;
+
   display=open_display(argc,argv);
   if(!display){
     fputs("Failed to open X display\n",stderr);
@@ -530,10 +1166,85 @@ startup(int *argc, char **argv)
   XMapRaised(display,mainwin);
   XFlush(display);
 
-  refresh_screen=1;
+  start_display_thread();
+}
+
+/* Called on the display thread.  If the queue is full the key is lost. */
+static void
+queue_key_event(KeySym ks, unsigned int state, int pressed)
+{
+  unsigned int tail, head;
+  KeyEvent *event;
+
+  tail = atomic_load_explicit(&key_queue_tail, memory_order_relaxed);
+  head = atomic_load_explicit(&key_queue_head, memory_order_acquire);
+  if (tail-head == KEY_QUEUE_SIZE)
+    return;
+
+  event = &key_queue[tail % KEY_QUEUE_SIZE];
+  event->ks = ks;
+  event->state = state;
+  event->pressed = pressed;
+  atomic_store_explicit(&key_queue_tail, tail+1, memory_order_release);
+}
+
+/* Pass the keys queued by the display thread to the Ace */
+void
+take_key_events(void)
+{
+  unsigned int tail, head;
+  KeyEvent *event;
+
+  if (headless) return;
+
+  head = atomic_load_explicit(&key_queue_head, memory_order_relaxed);
+  tail = atomic_load_explicit(&key_queue_tail, memory_order_acquire);
+  for (; head != tail; head++) {
+    event = &key_queue[head % KEY_QUEUE_SIZE];
+    if (spooler_active(&ace->spooler)) continue;
+    if (event->pressed)
+      keyboard_keypress(&ace->keyboard, event->ks, event->state);
+    else
+      keyboard_keyrelease(&ace->keyboard, event->ks, event->state);
+  }
+  atomic_store_explicit(&key_queue_head, head, memory_order_release);
 }
 
+/* Hand the screen to the display thread if it has changed since the last
+ * frame.  The display may not see every frame, so the cells and glyphs
+ * changed in frames it skips are carried on into the next one. */
 void
+publish_frame(void)
+{
+  Frame *frame;
+  int i;
+
+  if (headless || !ace->display_dirty) return;
+
+  frame = framebuf_back(&framebuf);
+  memcpy(frame->video_ram, ace->mem+0x2400, FRAMEBUF_VIDEO_SIZE);
+  memcpy(frame->charset, ace->mem+0x2c00, FRAMEBUF_CHARSET_SIZE);
+  for (i = 0; i < 24; i++)
+    frame->dirty_cells[i] = untaken_cells[i] | ace->dirty_cells[i];
+  for (i = 0; i < 4; i++)
+    frame->dirty_glyphs[i] = untaken_glyphs[i] | ace->dirty_glyphs[i];
+
+  if (framebuf_publish(&framebuf)) {
+    for (i = 0; i < 24; i++) untaken_cells[i] |= ace->dirty_cells[i];
+    for (i = 0; i < 4; i++) untaken_glyphs[i] |= ace->dirty_glyphs[i];
+  } else {
+    memcpy(untaken_cells, ace->dirty_cells, sizeof(untaken_cells));
+    memcpy(untaken_glyphs, ace->dirty_glyphs, sizeof(untaken_glyphs));
+  }
+
+  memset(ace->dirty_cells, 0, sizeof(ace->dirty_cells));
+  memset(ace->dirty_glyphs, 0, sizeof(ace->dirty_glyphs));
+  ace->display_dirty = 0;
+
+  wake_display_thread();
+}
+
+static void
 check_events(void)
 {
   KeySym ks;
@@ -543,6 +1254,8 @@ check_events(void)
   XCrossingEvent *cev;
   XConfigureEvent *conf_ev;
 
+  if (headless) return;
+
   while (XEventsQueued(display,QueuedAfterReading)){
     XNextEvent(display,&xev);
     switch(xev.type){
@@ -568,18 +1281,14 @@ check_events(void)
           XAutoRepeatOn(display),XFlush(display);
         break;
       case KeyPress:
-        if (!spooler_active()) {
-          kev = (XKeyEvent *)&xev;
-          XLookupString(kev, key_buf, 20, &ks, NULL);
-          keyboard_keypress(ks, kev->state);
-        }
+        kev = (XKeyEvent *)&xev;
+        XLookupString(kev, key_buf, 20, &ks, NULL);
+        queue_key_event(ks, kev->state, 1);
         break;
       case KeyRelease:
-        if (!spooler_active()) {
-          kev = (XKeyEvent *)&xev;
-          XLookupString(kev, key_buf, 20, &ks, NULL);
-          keyboard_keyrelease(ks, kev->state);
-        }
+        kev = (XKeyEvent *)&xev;
+        XLookupString(kev, key_buf, 20, &ks, NULL);
+        queue_key_event(ks, kev->state, 0);
         break;
       default:
         fprintf(stderr,"unhandled X event, type %d\n",xev.type);
@@ -587,65 +1296,78 @@ check_events(void)
   }
 }
 
-/* Set a pixel in the image */
-void
-set_pixel(int x, int y, int colour)
+/* Render glyph and its inverse into the glyph cache
+ * glyph          Glyph number, 0-127
+ * charbmap       Ptr to the glyph's bit map
+ */
+static void
+glyph_cache_render(int glyph, unsigned char *charbmap)
 {
-  int sx, sy;
-  int imageIndex = (y*hsize+x)*SCALE*bytes_per_pixel;
+  unsigned char *normal_row, *inverse_row;
+  int pixel_len = scale*bytes_per_pixel;
+  int charbmap_x, charbmap_y;
+  unsigned char charbmap_row;
+  unsigned char charbmap_row_mask;
 
-  for(sy = 0; sy < SCALE; sy++) {
-    for(sx = 0; sx < SCALE*bytes_per_pixel; sx++) {
-      image[imageIndex+(sy*hsize*bytes_per_pixel+sx)] = colour;
+  normal_row = glyph_cache + glyph*8*glyph_row_len;
+  inverse_row = normal_row + 128*8*glyph_row_len;
+  for (charbmap_y = 0; charbmap_y < 8; charbmap_y++) {
+    charbmap_row = charbmap[charbmap_y];
+    charbmap_row_mask = 128;
+    for (charbmap_x = 0; charbmap_x < 8; charbmap_x++) {
+      if (charbmap_row & charbmap_row_mask) {
+        memset(normal_row+charbmap_x*pixel_len, black, pixel_len);
+        memset(inverse_row+charbmap_x*pixel_len, white, pixel_len);
+      } else {
+        memset(normal_row+charbmap_x*pixel_len, white, pixel_len);
+        memset(inverse_row+charbmap_x*pixel_len, black, pixel_len);
+      }
+      charbmap_row_mask >>= 1;
     }
+    normal_row += glyph_row_len;
+    inverse_row += glyph_row_len;
   }
 }
 
 /* Set a character in the image
  * x              Column in image to draw character
  * y              Row in image to draw character
- * inv            Whether an inverted character
- * charbmap       Ptr to the character bit map
+ * c              Character, with bit 7 set if inverted
+ * charset        Ptr to the character set bit maps
  */
 void
-set_image_character(int x, int y, int inv, unsigned char *charbmap)
+set_image_character(int x, int y, int c, unsigned char *charset)
 {
-  int colour;
-  int charbmap_x, charbmap_y;
   unsigned char charbmap_row;
-  unsigned char charbmap_row_mask;
-
-  for (charbmap_y = 0; charbmap_y < 8; charbmap_y++) {
-    charbmap_row = charbmap[charbmap_y];
-    if (inv) charbmap_row ^= 255;
-
-    if (linelen == 32) {
-      /* 1-bit mono */
-      /* doesn't support SCALE>1 */
+  int charbmap_y;
+
+  if (linelen == 32) {
+    /* 1-bit mono */
+    /* doesn't support scale>1 */
+    for (charbmap_y = 0; charbmap_y < 8; charbmap_y++) {
+      charbmap_row = charset[(c&127)*8+charbmap_y];
+      if (c&128) charbmap_row ^= 255;
       image[(y*8+charbmap_y)*linelen+x]=~charbmap_row;
-    } else {
-      charbmap_row_mask = 128;
-      for (charbmap_x = 0; charbmap_x < 8; charbmap_x++) {
-        colour = (charbmap_row & charbmap_row_mask) ? black : white;
-        set_pixel(x*8+charbmap_x, y*8+charbmap_y, colour);
-        charbmap_row_mask >>= 1;
-      }
     }
+    return;
   }
+
+  draw_glyph(image + y*8*scale*image_stride + x*8*scale*bytes_per_pixel,
+             glyph_cache + c*8*glyph_row_len, image_stride);
 }
 
 
-/* To redraw the screen, we translate it into a char. map, then find
- * the smallest rectangle which covers all the changes, and update that.
+/* To redraw the screen, we redraw the cells the frame marks as changed,
+ * or whose glyph has been redefined.  Then find the smallest rectangle
+ * which covers all the changes, and update that.
  */
-void
-refresh(void)
+static void
+refresh(Frame *frame)
 {
-  unsigned char *video_ram,*charset;
-  int x,y,c,inv;
+  unsigned char redefined[128];
+  unsigned long cells;
+  int glyph, any_redefined = 0, c, x, y;
   int xmin,ymin,xmax,ymax;
-  int video_ram_old_ofs;
-  int chrmap_changed = 0;
 
   if (borderchange > 0) {
     /* FIX: what about expose events? need to set borderchange... */
@@ -655,56 +1377,123 @@ refresh(void)
     borderchange=0;
   }
 
-  charset = mem+0x2c00;
-  video_ram = mem+0x2400;
+  for (glyph = 0; glyph < 128; glyph++) {
+    redefined[glyph] = refresh_screen ||
+      ((frame->dirty_glyphs[glyph>>5] >> (glyph&31)) & 1);
+    any_redefined |= redefined[glyph];
+    if (redefined[glyph] && linelen != 32)
+      glyph_cache_render(glyph, frame->charset+glyph*8);
+  }
+
   xmin = 31; ymin = 23; xmax = 0; ymax = 0;
+  for (y = 0; y < 24; y++) {
+    cells = frame->dirty_cells[y];
+    if (!cells && !any_redefined) continue;
+    for (x = 0; x < 32; x++) {
+      c = frame->video_ram[y*32+x];
+      if (!((cells >> x) & 1) && !redefined[c&127])
+        continue;
+
+      /* update size of area to be drawn */
+      if (y < ymin) ymin=y;
+      if (y > ymax) ymax=y;
+      if (x < xmin) xmin=x;
+      if (x > xmax) xmax=x;
+
+      set_image_character(x, y, c, frame->charset);
+    }
+  }
 
-  /* since we can't just do "don't bother if it's junk" as we always
-   * need to draw a screen, just draw *valid* junk that won't result
-   * in a segfault or anything. :-)
-   */
-  if (video_ram-mem > 0xf000) video_ram = mem+0xf000;
+  if (xmax >= xmin && ymax >= ymin) {
+#ifdef MITSHM
+    if (mitshm)
+      XShmPutImage(display, mainwin, maingc, ximage,
+                   xmin*8*scale, ymin*8*scale, xmin*8*scale, ymin*8*scale,
+                   (xmax-xmin+1)*8*scale, (ymax-ymin+1)*8*scale, False);
+    else
+#endif
+      XPutImage(display, mainwin, maingc, ximage,
+                xmin*8*scale, ymin*8*scale, xmin*8*scale, ymin*8*scale,
+                (xmax-xmin+1)*8*scale, (ymax-ymin+1)*8*scale);
+    XFlush(display);
+  }
 
-  video_ram_old_ofs=0;
-  for (y = 0; y < 24; y++) {
-    for (x = 0; x < 32; x++, video_ram++, video_ram_old_ofs++) {
-      c = *video_ram;
+  if (frame != &shown)
+    memcpy(&shown, frame, sizeof(shown));
+  refresh_screen = 0;
+}
 
-      if (c != video_ram_old[video_ram_old_ofs] || refresh_screen) {
-        video_ram_old[video_ram_old_ofs] = c;
+static long
+nsecs_since(struct timespec *start)
+{
+  struct timespec now;
 
-        /* update size of area to be drawn */
-        if (x < xmin) xmin=x;
-        if (y < ymin) ymin=y;
-        if (x > xmax) xmax=x;
-        if (y > ymax) ymax=y;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec-start->tv_sec)*1000000000L + (now.tv_nsec-start->tv_nsec);
+}
 
-        inv = c&128;
-        c &= 127;
+/* Handle X events as they arrive and draw the newest frame published by
+ * the emulation thread, no more often than a real Ace's display would */
+static void *
+display_thread_main(void *arg)
+{
+  struct pollfd fds[2];
+  Frame *frame;
+  char wakeups[64];
+  long since_refresh;
+  int timeout;
+
+  (void)arg;
+
+  fds[0].fd = ConnectionNumber(display);
+  fds[0].events = POLLIN;
+  fds[1].fd = wakeup_pipe[0];
+  fds[1].events = POLLIN;
+  clock_gettime(CLOCK_MONOTONIC, &last_refresh_time);
+  last_refresh_time.tv_sec--;
+
+  while (!atomic_load(&display_quit)) {
+    check_events();
 
-        set_image_character(x, y, inv, charset+c*8);
+    timeout = -1;
+    since_refresh = nsecs_since(&last_refresh_time);
+    if (since_refresh < FRAME_NSECS) {
+      timeout = (FRAME_NSECS-since_refresh)/1000000 + 1;
+    } else {
+      frame = framebuf_take(&framebuf);
+      if (!frame && refresh_screen)
+        frame = &shown;
+      if (frame) {
+        refresh(frame);
+        clock_gettime(CLOCK_MONOTONIC, &last_refresh_time);
+        continue;
       }
     }
-  }
-
-  if (refresh_screen)
-    xmin=0; ymin=0; xmax=31; ymax=23;
 
-  if (xmax >= xmin && ymax >= ymin) {
-    XPutImage(display, mainwin, maingc, ximage,
-              xmin*8*SCALE, ymin*8*SCALE, xmin*8*SCALE, ymin*8*SCALE,
-              (xmax-xmin+1)*8*SCALE, (ymax-ymin+1)*8*SCALE);
-    XFlush(display);
+    if (XEventsQueued(display, QueuedAlready))
+      continue;
+    if (poll(fds, 2, timeout) > 0 && (fds[1].revents & POLLIN)) {
+      while (read(wakeup_pipe[0], wakeups, sizeof(wakeups)) > 0)
+        ;
+    }
   }
-
-  refresh_screen = 0;
+  return NULL;
 }
 
 void
 closedown(void)
 {
-  tape_clear_observers();
-  free(ximage->data);
+  tape_clear_observers(&ace->tape);
+  if (headless) return;
+  stop_display_thread();
+#ifdef MITSHM
+  if (mitshm) {
+    XShmDetach(display, &xshminfo);
+    shmdt(xshminfo.shmaddr);
+  } else
+#endif
+    free(ximage->data);
+  free(glyph_cache);
   XAutoRepeatOn(display);
   XCloseDisplay(display);
 }
@@ -20,8 +20,13 @@
 #include <stdio.h>
 
 #include "z80.h"
+#include "scheduler.h"
+#include "tape.h"
+#include "primitives.h"
 
 #define parity(a) (partable[a])
+#define in(h,l) ace_in(ace,h,l)
+#define out(h,l,a) ace_out(ace,h,l,a)
 
 unsigned char partable[256] = {
   4, 0, 0, 4, 0, 4, 4, 0, 0, 4, 4, 0, 4, 0, 0, 4,
@@ -42,23 +47,205 @@ unsigned char partable[256] = {
   4, 0, 0, 4, 0, 4, 4, 0, 0, 4, 4, 0, 4, 0, 0, 4
 };
 
+/* Flag lookup tables, built by z80_init().  They are kept to
+ * 256 entries each so that they stay in the host's L1 cache; tables
+ * indexed by both operands of an add or subtract measured slower.
+ */
+unsigned char sztable[256];      /* S, Z, 5 and 3 for a result */
+unsigned char szptable[256];     /* As sztable with P/V set for parity */
+unsigned char inctable[256];     /* All but C after an 8-bit increment */
+unsigned char dectable[256];     /* All but C after an 8-bit decrement */
+
+static int flag_tables_built=0;
 
 void
-mainloop(void) {
+z80_init(void)
+{
+  int a;
+
+  if (flag_tables_built) return;
+  for (a = 0; a < 256; a++) {
+    sztable[a] = (a&0xa8)|((!a)<<6);
+    szptable[a] = sztable[a]|parity(a);
+    inctable[a] = sztable[a]|((!(a&15))<<4)|((a==128)<<2);
+    dectable[a] = sztable[a]|(((a&15)==15)<<4)|((a==127)<<2)|2;
+  }
+  flag_tables_built=1;
+}
+
+
+#define save_state() do{\
+      ace->tstates=tstates;\
+      ace->z80.a=a; ace->z80.f=f; ace->z80.b=b; ace->z80.c=c;\
+      ace->z80.d=d; ace->z80.e=e; ace->z80.h=h; ace->z80.l=l;\
+      ace->z80.a1=a1; ace->z80.f1=f1; ace->z80.b1=b1; ace->z80.c1=c1;\
+      ace->z80.d1=d1; ace->z80.e1=e1; ace->z80.h1=h1; ace->z80.l1=l1;\
+      ace->z80.i=i; ace->z80.r=r; ace->z80.iff1=iff1;\
+      ace->z80.iff2=iff2; ace->z80.im=im;\
+      ace->z80.intsample=intsample; ace->z80.radjust=radjust;\
+      ace->z80.ix=ix; ace->z80.iy=iy; ace->z80.sp=sp; ace->z80.pc=pc;\
+   } while(0)
+
+/* Pick up registers that have been replaced, e.g. by loading a snapshot */
+#define restore_changed_state() do{\
+      tstates=ace->tstates;\
+      if(ace->z80_state_changed) {\
+        a=ace->z80.a; f=ace->z80.f; b=ace->z80.b; c=ace->z80.c;\
+        d=ace->z80.d; e=ace->z80.e; h=ace->z80.h; l=ace->z80.l;\
+        a1=ace->z80.a1; f1=ace->z80.f1; b1=ace->z80.b1; c1=ace->z80.c1;\
+        d1=ace->z80.d1; e1=ace->z80.e1; h1=ace->z80.h1; l1=ace->z80.l1;\
+        i=ace->z80.i; r=ace->z80.r; iff1=ace->z80.iff1;\
+        iff2=ace->z80.iff2; im=ace->z80.im;\
+        intsample=ace->z80.intsample; radjust=ace->z80.radjust;\
+        ix=ace->z80.ix; iy=ace->z80.iy; sp=ace->z80.sp; pc=ace->z80.pc;\
+        ace->z80_state_changed=0;\
+      }\
+   } while(0)
+
+#ifdef OPSTATS
+/* The opcode being executed is noted as each prefix is decoded, and once
+ * the whole instruction has run it is charged with the T-states taken
+ * since the last one finished */
+#define opstats_op(table,opcode) (stat_key=(table)*256+(opcode))
+#define opstats_start() (stat_start=tstates)
+#define opstats_end() do{\
+      opstats_record(&ace->opstats,stat_key,tstates-stat_start);\
+      stat_start=tstates;\
+   } while(0)
+#define opstats_interrupt() (ace->opstats.interrupts++)
+#else
+#define opstats_op(table,opcode)
+#define opstats_start()
+#define opstats_end()
+#define opstats_interrupt()
+#endif
+
+/* Run any events that are due, then take a pending interrupt if the
+ * last instruction allows it */
+#define service_events() do{\
+      save_state();\
+      scheduler_run(&ace->scheduler,tstates);\
+      restore_changed_state();\
+      opstats_start();\
+      if(ace->interrupted == 1) {\
+        if(intsample && iff1) {\
+          push2(pc);\
+          pc=0x38;\
+          ace->interrupted=0;\
+          opstats_interrupt();\
+        } else {\
+          /* keep the interrupt pending until it can be taken */\
+          ace->scheduler.deadline=tstates;\
+        }\
+      }\
+   } while(0)
+
+#if defined(COMPUTED_GOTO) && defined(__GNUC__)
+
+/* Threaded dispatch using GCC's labels as values.  z80ops.c is included
+ * once for each of HL, IX and IY with ixoriy as a constant, so that the
+ * compiler removes the tests on ixoriy, and each instruction jumps
+ * straight to the next rather than going back through one switch.
+ */
+#include "z80optable.h"
+
+#define opcase(opcode) oplabel(OPS,opcode)
+#define fetchop() (op=fetch(pc),pc++,radjust++)
+#define endop \
+   opstats_end();\
+   if(tstates>=ace->scheduler.deadline) goto events;\
+   intsample=1;\
+   fetchop();\
+   goto *hl_ops[op]
+#define prefix(n) do{\
+      fetchop();\
+      goto *((n)==1?ix_ops:iy_ops)[op];\
+   } while(0)
+
+void
+z80_run(Ace *ace) {
   unsigned char a, f, b, c, d, e, h, l;
   unsigned char r, a1, f1, b1, c1, d1, e1, h1, l1, i, iff1, iff2, im;
   unsigned short pc;
   unsigned short ix, iy, sp;
-  extern unsigned long tstates,tsmax;
+  unsigned long long tstates;
+  unsigned int radjust;
+  unsigned char intsample;
+  unsigned char op;
+#ifdef OPSTATS
+  unsigned int stat_key=0;
+  unsigned long long stat_start=0;
+#endif
+  static void * const hl_ops[256] = OPTABLE(hl_op);
+  static void * const ix_ops[256] = OPTABLE(ix_op);
+  static void * const iy_ops[256] = OPTABLE(iy_op);
+
+  z80_init();
+
+  /* Carry on from where the last run stopped */
+  ace->z80_state_changed=1;
+  restore_changed_state();
+  goto events;
+
+#define OPS hl_op
+#define ixoriy 0
+#include "z80ops.c"
+#undef ixoriy
+#undef OPS
+
+#define OPS ix_op
+#define ixoriy 1
+#include "z80ops.c"
+#undef ixoriy
+#undef OPS
+
+#define OPS iy_op
+#define ixoriy 2
+#include "z80ops.c"
+#undef ixoriy
+#undef OPS
+
+events:
+  service_events();
+  if (ace->stop) {
+    ace->stop=0;
+    save_state();
+    return;
+  }
+  intsample=1;
+  fetchop();
+  goto *hl_ops[op];
+}
+
+#else
+
+#define opcase(opcode) case opcode
+#define endop break
+#define prefix(n) (new_ixoriy=(n),intsample=0)
+
+void
+z80_run(Ace *ace) {
+  unsigned char a, f, b, c, d, e, h, l;
+  unsigned char r, a1, f1, b1, c1, d1, e1, h1, l1, i, iff1, iff2, im;
+  unsigned short pc;
+  unsigned short ix, iy, sp;
+  unsigned long long tstates;
   unsigned int radjust;
   unsigned char ixoriy, new_ixoriy;
   unsigned char intsample;
   unsigned char op;
-  
-  a=f=b=c=d=e=h=l=a1=f1=b1=c1=d1=e1=h1=l1=i=r=iff1=iff2=im=0;
+#ifdef OPSTATS
+  unsigned int stat_key=0;
+  unsigned long long stat_start=0;
+#endif
+
+  z80_init();
+
+  /* Carry on from where the last run stopped */
+  ace->z80_state_changed=1;
+  restore_changed_state();
   ixoriy=new_ixoriy=0;
-  ix=iy=sp=pc=0;
-  tstates=radjust=0;
+  goto events;  /* for an interrupt pending or a stop */
   while(1) {
     ixoriy=new_ixoriy;
     new_ixoriy=0;
@@ -70,26 +257,20 @@ mainloop(void) {
     switch(op) {
       #include "z80ops.c"
     }
+    if(!new_ixoriy) opstats_end();
 
-    if(tstates>tsmax)
-      fix_tstates();
-
-    if(interrupted == 1 && intsample && iff1) {
-      do_interrupt();
-      push2(pc);
-      pc=0x38;
-      interrupted=0;
-    }
-
-    if (reset_ace) {
-      /* actually a kludge to let us do a reset */
-      a=f=b=c=d=e=h=l=a1=f1=b1=c1=d1=e1=h1=l1=i=r=iff1=iff2=im=0;
-      ixoriy=new_ixoriy=0;
-      ix=iy=sp=pc=0;
-      tstates=radjust=0;
-      reset_ace = 0;
+    /* Events wait for the end of a prefixed instruction so that they
+     * always see the machine between instructions */
+    if(tstates>=ace->scheduler.deadline && !new_ixoriy) {
+events:
+      service_events();
+      if (ace->stop) {
+        ace->stop=0;
+        save_state();
+        return;
+      }
     }
   }
 }
 
-
+#endif
@@ -14,6 +14,8 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
+#ifndef Z80_H
+#define Z80_H
 
 #define Z80_quit  1
 #define Z80_NMI   2
@@ -22,86 +24,134 @@
 #define Z80_save  5
 #define Z80_log   6
 
-extern unsigned char mem[65536];
-extern unsigned char *memptr[];
-extern int memattr[];
-extern int hsize,vsize;
-extern volatile int interrupted;
-extern int reset_ace;
+#include "ace.h"
 
-extern unsigned int in(int h, int l);
-extern unsigned int out(int h,int l, int a);
-extern void do_interrupt(void);
-extern void mainloop(void);
-extern void fix_tstates(void);
+/* Build the tables shared by every Ace.  This must be called before
+ * more than one thread can be running an Ace. */
+extern void z80_init(void);
 
-#define fetch(x) (memptr[(unsigned short)(x&0xe000)>>13][(x)&0x1fff])
+/* Run the CPU of ace until an event sets ace->stop */
+extern void z80_run(Ace *ace);
+
+/* The macros below act on the Ace in the variable ace */
+#define fetch(x) (ace->memptr[(unsigned short)(x&0xe000)>>13][(x)&0x1fff])
 #define fetch2(x) ((fetch((x)+1)<<8)|fetch(x))
 
+/* Classes of 8K page, as held in ace->memattr[] */
+#define MEM_ROM      0
+#define MEM_RAM      1
+#define MEM_MIRRORED 2  /* Video and character set RAM at 0x2000-0x3fff */
+
+/* Record a write to offset off of the mirrored page.  Both copies of the
+ * video RAM and character set are displayed from the same memory, so only
+ * the offset within the 1K copy matters. */
+#define mark_dirty(off) do {\
+  if ((off)<0x800) { \
+    unsigned short vofs=(off)&0x3ff; \
+    if (vofs<768) { \
+      ace->dirty_cells[vofs>>5]|=1UL<<(vofs&31); \
+      ace->display_dirty=1; \
+    } \
+  } else if ((off)<0x1000) { \
+    unsigned short glyph=((off)&0x3ff)>>3; \
+    ace->dirty_glyphs[glyph>>5]|=1UL<<(glyph&31); \
+    ace->display_dirty=1; \
+  } \
+} while(0)
+
+/* Force every cell to be redrawn, for when memory is changed behind the
+ * back of store() */
+#define mark_all_dirty() do {\
+  int glyph_word; \
+  for (glyph_word=0; glyph_word<4; glyph_word++) \
+    ace->dirty_glyphs[glyph_word]=0xffffffffUL; \
+  ace->display_dirty=1; \
+} while(0)
+
+/* Writes to the mirrored page also go to the areas that mirror it */
+#define store_mirrored(x,y) do {\
+  unsigned short off=(x)&0x1fff;\
+  ace->memptr[1][off]=(y); \
+  mark_dirty(off); \
+  if ((x>=0x2000&&x<=0x23ff)||(x>=0x2800&&x<=0x2bff)) \
+    ace->memptr[1][off+0x400]=(y); \
+  else if ((x>=0x2400&&x<=0x27ff)||(x>=0x2c00&&x<=0x2fff)) \
+    ace->memptr[1][off-0x400]=(y); \
+  else if (x>=0x3000&&x<=0x3fff) { \
+    ace->memptr[1][(x&0x03ff)+0x1000]=(y); \
+    ace->memptr[1][(x&0x03ff)+0x1400]=(y); \
+    ace->memptr[1][(x&0x03ff)+0x1800]=(y); \
+    ace->memptr[1][(x&0x03ff)+0x1c00]=(y); \
+  } \
+} while(0)
+
+#define store2b_mirrored(x,hi,lo) do {\
+  unsigned short off=(x)&0x1fff;\
+  ace->memptr[1][off]=(lo);\
+  ace->memptr[1][off+1]=(hi);\
+  mark_dirty(off);\
+  mark_dirty(off+1);\
+  if ((x>=0x2000&&x<=0x23ff)||(x>=0x2800&&x<=0x2bff)) { \
+    ace->memptr[1][off+0x400]=(lo); \
+    ace->memptr[1][off+0x401]=(hi); \
+  } else if ((x>=0x2400&&x<=0x27ff)||(x>=0x2c00&&x<=0x2fff)) { \
+    ace->memptr[1][off-0x400]=(lo); \
+    ace->memptr[1][off-0x3ff]=(hi); \
+  } else if (x>=0x3000&&x<=0x3fff) { \
+    ace->memptr[1][(x&0x03ff)+0x1000]=(lo); \
+    ace->memptr[1][(x&0x03ff)+0x1001]=(hi); \
+    ace->memptr[1][(x&0x03ff)+0x1400]=(lo); \
+    ace->memptr[1][(x&0x03ff)+0x1401]=(hi); \
+    ace->memptr[1][(x&0x03ff)+0x1800]=(lo); \
+    ace->memptr[1][(x&0x03ff)+0x1801]=(hi); \
+    ace->memptr[1][(x&0x03ff)+0x1c00]=(lo); \
+    ace->memptr[1][(x&0x03ff)+0x1c01]=(hi); \
+  } \
+} while(0)
+
+/* Plain RAM, by far the most common case, is a single indexed store */
 #define store(x,y) do {\
   unsigned short off=(x)&0x1fff;\
   unsigned char page=(unsigned short)(x&0xe000)>>13;\
-  int attr=memattr[page];\
-  if (attr) {\
-    memptr[page][off]=(y); \
-    if ((x>=0x2000&&x<=0x23ff)||(x>=0x2800&&x<=0x2bff)) \
-      memptr[page][off+0x400]=(y); \
-    else if ((x>=0x2400&&x<=0x27ff)||(x>=0x2c00&&x<=0x2fff)) \
-      memptr[page][off-0x400]=(y); \
-    else if (x>=0x3000&&x<=0x3fff) { \
-      memptr[page][(x&0x03ff)+0x1000]=(y); \
-      memptr[page][(x&0x03ff)+0x1400]=(y); \
-      memptr[page][(x&0x03ff)+0x1800]=(y); \
-      memptr[page][(x&0x03ff)+0x1c00]=(y); \
-    } \
-  } \
+  int attr=ace->memattr[page];\
+  if (attr==MEM_RAM) \
+    ace->memptr[page][off]=(y); \
+  else if (attr==MEM_MIRRORED) \
+    store_mirrored(x,y); \
 } while(0)
 
 #define store2b(x,hi,lo) do {\
   unsigned short off=(x)&0x1fff;\
   unsigned char page=(unsigned short)(x&0xe000)>>13;\
-  int attr=memattr[page];\
-  if (attr) { \
-    memptr[page][off]=(lo);\
-    memptr[page][off+1]=(hi);\
-    if ((x>=0x2000&&x<=0x23ff)||(x>=0x2800&&x<=0x2bff)) { \
-      memptr[page][off+0x400]=(lo); \
-      memptr[page][off+0x401]=(hi); \
-    } else if ((x>=0x2400&&x<=0x27ff)||(x>=0x2c00&&x<=0x2fff)) { \
-      memptr[page][off-0x400]=(lo); \
-      memptr[page][off-0x3ff]=(hi); \
-    } else if (x>=0x3000&&x<=0x3fff) { \
-      memptr[page][(x&0x03ff)+0x1000]=(lo); \
-      memptr[page][(x&0x03ff)+0x1001]=(hi); \
-      memptr[page][(x&0x03ff)+0x1400]=(lo); \
-      memptr[page][(x&0x03ff)+0x1401]=(hi); \
-      memptr[page][(x&0x03ff)+0x1800]=(lo); \
-      memptr[page][(x&0x03ff)+0x1801]=(hi); \
-      memptr[page][(x&0x03ff)+0x1c00]=(lo); \
-      memptr[page][(x&0x03ff)+0x1c01]=(hi); \
-    } \
-  } \
+  int attr=ace->memattr[page];\
+  if (attr==MEM_RAM) { \
+    ace->memptr[page][off]=(lo);\
+    ace->memptr[page][off+1]=(hi);\
+  } else if (attr==MEM_MIRRORED) \
+    store2b_mirrored(x,hi,lo); \
 } while(0)
 
 #define store2(x,y) store2b(x,(y)>>8,(y)&255)
 
 #ifdef __GNUC__
 static void inline
-storefunc(unsigned short ad,unsigned char b)
+storefunc(Ace *ace,unsigned short ad,unsigned char b)
 {
   store(ad,b);
 }
 #undef store
-#define store(x,y) storefunc(x,y)
+#define store(x,y) storefunc(ace,x,y)
 
 static void inline
-store2func(unsigned short ad,unsigned char b1,unsigned char b2){
+store2func(Ace *ace,unsigned short ad,unsigned char b1,unsigned char b2){
   store2b(ad,b1,b2);
 }
 #undef store2b
-#define store2b(x,hi,lo) store2func(x,hi,lo)
+#define store2b(x,hi,lo) store2func(ace,x,hi,lo)
 #endif
 
 #define bc ((b<<8)|c)
 #define de ((d<<8)|e)
 #define hl ((h<<8)|l)
+
+#endif
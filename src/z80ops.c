@@ -16,16 +16,20 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
-#define instr(opcode,cycles) case opcode: {tstates+=cycles
+/* opcase(), endop and prefix() are defined by z80.c to suit the way that
+ * instructions are dispatched */
+#define instr(opcode,cycles) opcase(opcode): {opstats_op(ixoriy,opcode); \
+                                tstates+=cycles
 #define HLinstr(opcode,cycles,morecycles) \
-                             case opcode: {unsigned short addr; \
+                             opcase(opcode): {unsigned short addr; \
+                                opstats_op(ixoriy,opcode); \
                                 tstates+=cycles; \
                                 if(ixoriy==0)addr=hl; \
                                 else tstates+=morecycles, \
                                    addr=(ixoriy==1?ix:iy)+ \
                                         (signed char)fetch(pc),\
                                    pc++
-#define endinstr             }; break
+#define endinstr             }; endop
 
 #define cy (f&1)
 
@@ -38,14 +42,10 @@
                   (iy=(iy&0xff00)|(x)))
 
 #define inc(var) /* 8-bit increment */ ( var++,\
-                                         f=(f&1)|(var&0xa8)|\
-                                           ((!(var&15))<<4)|((!var)<<6)|\
-                                           ((var==128)<<2)\
+                                         f=(f&1)|inctable[var]\
                                        )
-#define dec(var) /* 8-bit decrement */ ( f=(f&1)|((!(var&15))<<4)|2,\
-                                         --var,\
-                                         f|=(var&0xa8)|((var==127)<<2)|\
-                                            ((!var)<<6)\
+#define dec(var) /* 8-bit decrement */ ( --var,\
+                                         f=(f&1)|dectable[var]\
                                        )
 #define swap(x,y) {unsigned char t=x; x=y; y=t;}
 #define addhl(hi,lo) /* 16-bit add */ if(!ixoriy){\
@@ -64,34 +64,34 @@
 #define adda(x,c) /* 8-bit add */ do{unsigned short y;\
                       unsigned char z=(x);\
                       y=a+z+(c);\
-                      f=(y&0xa8)|(y>>8)|(((a&0x0f)+(z&0x0f)+(c)>15)<<4)|\
+                      f=sztable[y&0xff]|(y>>8)|((a^z^y)&0x10)|\
                         (((~a^z)&0x80&(y^a))>>5);\
-                      f|=(!(a=y))<<6;\
+                      a=y;\
                    } while(0)
 #define suba(x,c) /* 8-bit subtract */ do{unsigned short y;\
                       unsigned char z=(x);\
                       y=(a-z-(c))&0x1ff;\
-                      f=(y&0xa8)|(y>>8)|(((a&0x0f)<(z&0x0f)+(c))<<4)|\
+                      f=sztable[y&0xff]|(y>>8)|((a^z^y)&0x10)|\
                         (((a^z)&0x80&(y^a))>>5)|2;\
-                      f|=(!(a=y))<<6;\
+                      a=y;\
                    } while(0)
 #define cpa(x) /* 8-bit compare */ do{unsigned short y;\
                       unsigned char z=(x);\
                       y=(a-z)&0x1ff;\
-                      f=(y&0xa8)|(y>>8)|(((a&0x0f)<(z&0x0f))<<4)|\
-                        (((a^z)&0x80&(y^a))>>5)|2|((!y)<<6);\
+                      f=sztable[y&0xff]|(y>>8)|((a^z^y)&0x10)|\
+                        (((a^z)&0x80&(y^a))>>5)|2;\
                    } while(0)
 #define anda(x) /* logical and */ do{\
                       a&=(x);\
-                      f=(a&0xa8)|((!a)<<6)|0x10|parity(a);\
+                      f=szptable[a]|0x10;\
                    } while(0)
 #define xora(x) /* logical xor */ do{\
                       a^=(x);\
-                      f=(a&0xa8)|((!a)<<6)|parity(a);\
+                      f=szptable[a];\
                    } while(0)
 #define ora(x) /* logical or */ do{\
                       a|=(x);\
-                      f=(a&0xa8)|((!a)<<6)|parity(a);\
+                      f=szptable[a];\
                    } while(0)
 
 #define jr /* execute relative jump */ do{int j=(signed char)fetch(pc);\
@@ -1121,8 +1121,7 @@ instr(0xdc,10);
 endinstr;
 
 instr(0xdd,4);
-   new_ixoriy=1;
-   intsample=0;
+   prefix(1);
 endinstr;
 
 instr(0xde,7);
@@ -1288,8 +1287,7 @@ instr(0xfc,10);
 endinstr;
 
 instr(0xfd,4);
-   new_ixoriy=2;
-   intsample=0;
+   prefix(2);
 endinstr;
 
 instr(0xfe,7);
@@ -0,0 +1,95 @@
+/* Label tables for the computed goto dispatch of the Z80 instructions
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef Z80OPTABLE_H
+#define Z80OPTABLE_H
+
+/* The labels are spelt the same as the opcodes given to instr() in
+ * z80ops.c, with the name of the instruction set prefixed */
+#define oplabel(ops,opcode)  oplabel2(ops,opcode)
+#define oplabel2(ops,opcode) ops##_##opcode
+#define opaddr(ops,opcode)   &&oplabel(ops,opcode)
+
+#define OPTABLE(ops) { \
+  opaddr(ops,0), opaddr(ops,1), opaddr(ops,2), opaddr(ops,3), \
+  opaddr(ops,4), opaddr(ops,5), opaddr(ops,6), opaddr(ops,7), \
+  opaddr(ops,8), opaddr(ops,9), opaddr(ops,10), opaddr(ops,11), \
+  opaddr(ops,12), opaddr(ops,13), opaddr(ops,14), opaddr(ops,15), \
+  opaddr(ops,16), opaddr(ops,17), opaddr(ops,18), opaddr(ops,19), \
+  opaddr(ops,20), opaddr(ops,21), opaddr(ops,22), opaddr(ops,23), \
+  opaddr(ops,24), opaddr(ops,25), opaddr(ops,26), opaddr(ops,27), \
+  opaddr(ops,28), opaddr(ops,29), opaddr(ops,30), opaddr(ops,31), \
+  opaddr(ops,32), opaddr(ops,33), opaddr(ops,34), opaddr(ops,35), \
+  opaddr(ops,36), opaddr(ops,37), opaddr(ops,38), opaddr(ops,39), \
+  opaddr(ops,40), opaddr(ops,41), opaddr(ops,42), opaddr(ops,43), \
+  opaddr(ops,44), opaddr(ops,45), opaddr(ops,46), opaddr(ops,47), \
+  opaddr(ops,48), opaddr(ops,49), opaddr(ops,50), opaddr(ops,51), \
+  opaddr(ops,52), opaddr(ops,53), opaddr(ops,54), opaddr(ops,55), \
+  opaddr(ops,56), opaddr(ops,57), opaddr(ops,58), opaddr(ops,59), \
+  opaddr(ops,60), opaddr(ops,61), opaddr(ops,62), opaddr(ops,63), \
+  opaddr(ops,0x40), opaddr(ops,0x41), opaddr(ops,0x42), opaddr(ops,0x43), \
+  opaddr(ops,0x44), opaddr(ops,0x45), opaddr(ops,0x46), opaddr(ops,0x47), \
+  opaddr(ops,0x48), opaddr(ops,0x49), opaddr(ops,0x4a), opaddr(ops,0x4b), \
+  opaddr(ops,0x4c), opaddr(ops,0x4d), opaddr(ops,0x4e), opaddr(ops,0x4f), \
+  opaddr(ops,0x50), opaddr(ops,0x51), opaddr(ops,0x52), opaddr(ops,0x53), \
+  opaddr(ops,0x54), opaddr(ops,0x55), opaddr(ops,0x56), opaddr(ops,0x57), \
+  opaddr(ops,0x58), opaddr(ops,0x59), opaddr(ops,0x5a), opaddr(ops,0x5b), \
+  opaddr(ops,0x5c), opaddr(ops,0x5d), opaddr(ops,0x5e), opaddr(ops,0x5f), \
+  opaddr(ops,0x60), opaddr(ops,0x61), opaddr(ops,0x62), opaddr(ops,0x63), \
+  opaddr(ops,0x64), opaddr(ops,0x65), opaddr(ops,0x66), opaddr(ops,0x67), \
+  opaddr(ops,0x68), opaddr(ops,0x69), opaddr(ops,0x6a), opaddr(ops,0x6b), \
+  opaddr(ops,0x6c), opaddr(ops,0x6d), opaddr(ops,0x6e), opaddr(ops,0x6f), \
+  opaddr(ops,0x70), opaddr(ops,0x71), opaddr(ops,0x72), opaddr(ops,0x73), \
+  opaddr(ops,0x74), opaddr(ops,0x75), opaddr(ops,0x76), opaddr(ops,0x77), \
+  opaddr(ops,0x78), opaddr(ops,0x79), opaddr(ops,0x7a), opaddr(ops,0x7b), \
+  opaddr(ops,0x7c), opaddr(ops,0x7d), opaddr(ops,0x7e), opaddr(ops,0x7f), \
+  opaddr(ops,0x80), opaddr(ops,0x81), opaddr(ops,0x82), opaddr(ops,0x83), \
+  opaddr(ops,0x84), opaddr(ops,0x85), opaddr(ops,0x86), opaddr(ops,0x87), \
+  opaddr(ops,0x88), opaddr(ops,0x89), opaddr(ops,0x8a), opaddr(ops,0x8b), \
+  opaddr(ops,0x8c), opaddr(ops,0x8d), opaddr(ops,0x8e), opaddr(ops,0x8f), \
+  opaddr(ops,0x90), opaddr(ops,0x91), opaddr(ops,0x92), opaddr(ops,0x93), \
+  opaddr(ops,0x94), opaddr(ops,0x95), opaddr(ops,0x96), opaddr(ops,0x97), \
+  opaddr(ops,0x98), opaddr(ops,0x99), opaddr(ops,0x9a), opaddr(ops,0x9b), \
+  opaddr(ops,0x9c), opaddr(ops,0x9d), opaddr(ops,0x9e), opaddr(ops,0x9f), \
+  opaddr(ops,0xa0), opaddr(ops,0xa1), opaddr(ops,0xa2), opaddr(ops,0xa3), \
+  opaddr(ops,0xa4), opaddr(ops,0xa5), opaddr(ops,0xa6), opaddr(ops,0xa7), \
+  opaddr(ops,0xa8), opaddr(ops,0xa9), opaddr(ops,0xaa), opaddr(ops,0xab), \
+  opaddr(ops,0xac), opaddr(ops,0xad), opaddr(ops,0xae), opaddr(ops,0xaf), \
+  opaddr(ops,0xb0), opaddr(ops,0xb1), opaddr(ops,0xb2), opaddr(ops,0xb3), \
+  opaddr(ops,0xb4), opaddr(ops,0xb5), opaddr(ops,0xb6), opaddr(ops,0xb7), \
+  opaddr(ops,0xb8), opaddr(ops,0xb9), opaddr(ops,0xba), opaddr(ops,0xbb), \
+  opaddr(ops,0xbc), opaddr(ops,0xbd), opaddr(ops,0xbe), opaddr(ops,0xbf), \
+  opaddr(ops,0xc0), opaddr(ops,0xc1), opaddr(ops,0xc2), opaddr(ops,0xc3), \
+  opaddr(ops,0xc4), opaddr(ops,0xc5), opaddr(ops,0xc6), opaddr(ops,0xc7), \
+  opaddr(ops,0xc8), opaddr(ops,0xc9), opaddr(ops,0xca), opaddr(ops,0xcb), \
+  opaddr(ops,0xcc), opaddr(ops,0xcd), opaddr(ops,0xce), opaddr(ops,0xcf), \
+  opaddr(ops,0xd0), opaddr(ops,0xd1), opaddr(ops,0xd2), opaddr(ops,0xd3), \
+  opaddr(ops,0xd4), opaddr(ops,0xd5), opaddr(ops,0xd6), opaddr(ops,0xd7), \
+  opaddr(ops,0xd8), opaddr(ops,0xd9), opaddr(ops,0xda), opaddr(ops,0xdb), \
+  opaddr(ops,0xdc), opaddr(ops,0xdd), opaddr(ops,0xde), opaddr(ops,0xdf), \
+  opaddr(ops,0xe0), opaddr(ops,0xe1), opaddr(ops,0xe2), opaddr(ops,0xe3), \
+  opaddr(ops,0xe4), opaddr(ops,0xe5), opaddr(ops,0xe6), opaddr(ops,0xe7), \
+  opaddr(ops,0xe8), opaddr(ops,0xe9), opaddr(ops,0xea), opaddr(ops,0xeb), \
+  opaddr(ops,0xec), opaddr(ops,0xed), opaddr(ops,0xee), opaddr(ops,0xef), \
+  opaddr(ops,0xf0), opaddr(ops,0xf1), opaddr(ops,0xf2), opaddr(ops,0xf3), \
+  opaddr(ops,0xf4), opaddr(ops,0xf5), opaddr(ops,0xf6), opaddr(ops,0xf7), \
+  opaddr(ops,0xf8), opaddr(ops,0xf9), opaddr(ops,0xfa), opaddr(ops,0xfb), \
+  opaddr(ops,0xfc), opaddr(ops,0xfd), opaddr(ops,0xfe), opaddr(ops,0xff) \
+}
+
+#endif
@@ -0,0 +1,153 @@
+/* Tests for the emulated Jupiter Ace
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "z80.h"
+#include "ace.h"
+
+/* T-states taken to set up the counter and for each count */
+#define COUNTER_START_TSTATES 10
+#define COUNTER_LOOP_TSTATES 23
+
+/* A ROM that counts in the RAM at 0x4000:
+ *   ld hl,0x4000
+ *   inc (hl)
+ *   jr -3
+ */
+static unsigned char rom[ACE_ROM_SIZE] = {
+  0x21, 0x00, 0x40,
+  0x34,
+  0x18, 0xfd
+};
+
+static int frames;
+
+static void
+count_frames(Ace *ace)
+{
+  frames++;
+}
+
+static void
+stop_at_frame(Ace *ace)
+{
+  ace->stop = 1;
+}
+
+static unsigned long
+counter_tstates(int count)
+{
+  return COUNTER_START_TSTATES + count*COUNTER_LOOP_TSTATES;
+}
+
+static void
+test_ace_create()
+{
+  Ace *ace = ace_create(rom);
+
+  assert(ace);
+  assert(memcmp(ace->mem, rom, 6) == 0);
+  assert(ace->mem[0x2000] == 0xff && ace->mem[0xffff] == 0xff);
+  assert(ace->tstates == 0);
+  assert(ace->z80.pc == 0);
+  ace_destroy(ace);
+}
+
+static void
+test_ace_step()
+{
+  Ace *ace = ace_create(rom);
+
+  ace_step(ace, counter_tstates(100));
+  assert(ace->tstates == counter_tstates(100));
+  assert(ace->mem[0x4000] == (0xff+100) % 256);
+  assert(ace->z80.pc == 3);
+  ace_destroy(ace);
+}
+
+static void
+test_ace_separate_machines()
+{
+  Ace *ace_a = ace_create(rom);
+  Ace *ace_b = ace_create(rom);
+
+  ace_step(ace_a, counter_tstates(100));
+  ace_step(ace_b, counter_tstates(50));
+  assert(ace_a->mem[0x4000] == (0xff+100) % 256);
+  assert(ace_b->mem[0x4000] == (0xff+50) % 256);
+
+  /* Each carries on from where it stopped */
+  ace_step(ace_a, 10*COUNTER_LOOP_TSTATES);
+  assert(ace_a->mem[0x4000] == (0xff+110) % 256);
+  assert(ace_b->mem[0x4000] == (0xff+50) % 256);
+  ace_destroy(ace_a);
+  ace_destroy(ace_b);
+}
+
+static void
+test_ace_frame_handler()
+{
+  Ace *ace = ace_create(rom);
+
+  frames = 0;
+  ace->frame_handler = count_frames;
+  ace_step(ace, 2*ACE_FRAME_TSTATES);
+  assert(frames == 2);
+  /* Interrupts are disabled so it stays pending */
+  assert(ace->interrupted == 1);
+  ace_destroy(ace);
+}
+
+static void
+test_ace_stop()
+{
+  Ace *ace = ace_create(rom);
+
+  ace->frame_handler = stop_at_frame;
+  ace_step(ace, 10*ACE_FRAME_TSTATES);
+  assert(ace->tstates >= ACE_FRAME_TSTATES);
+  assert(ace->tstates < ACE_FRAME_TSTATES+COUNTER_LOOP_TSTATES);
+  ace_destroy(ace);
+}
+
+static void
+test_ace_reset()
+{
+  Ace *ace = ace_create(rom);
+
+  ace_step(ace, counter_tstates(100));
+  ace_reset(ace);
+  assert(ace->mem[0x4000] == 0xff);
+  ace_step(ace, counter_tstates(10));
+  assert(ace->mem[0x4000] == (0xff+10) % 256);
+  ace_destroy(ace);
+}
+
+int main()
+{
+  test_ace_create();
+  test_ace_step();
+  test_ace_separate_machines();
+  test_ace_frame_handler();
+  test_ace_stop();
+  test_ace_reset();
+  exit(0);
+}
@@ -0,0 +1,164 @@
+/* Tests for the triple buffer that hands frames to the display
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuf.h"
+
+#define STRESS_FRAMES 200000
+
+static FrameBuffer framebuf;
+static atomic_int writer_done;
+
+static void
+fill_frame(Frame *frame, unsigned char value)
+{
+  memset(frame->video_ram, value, sizeof(frame->video_ram));
+  memset(frame->charset, value, sizeof(frame->charset));
+}
+
+/* Return the value the frame was filled with, or -1 if it is torn */
+static int
+frame_value(Frame *frame)
+{
+  unsigned char value = frame->video_ram[0];
+  int i;
+
+  for (i = 0; i < sizeof(frame->video_ram); i++)
+    if (frame->video_ram[i] != value) return -1;
+  for (i = 0; i < sizeof(frame->charset); i++)
+    if (frame->charset[i] != value) return -1;
+  return value;
+}
+
+static void
+test_framebuf_take_nothing_published()
+{
+  framebuf_init(&framebuf);
+  assert(framebuf_take(&framebuf) == NULL);
+}
+
+static void
+test_framebuf_take_published()
+{
+  Frame *frame;
+
+  framebuf_init(&framebuf);
+  fill_frame(framebuf_back(&framebuf), 7);
+  framebuf_publish(&framebuf);
+  frame = framebuf_take(&framebuf);
+  assert(frame != NULL);
+  assert(frame_value(frame) == 7);
+  assert(framebuf_take(&framebuf) == NULL);
+}
+
+static void
+test_framebuf_take_newest()
+{
+  framebuf_init(&framebuf);
+  fill_frame(framebuf_back(&framebuf), 1);
+  framebuf_publish(&framebuf);
+  fill_frame(framebuf_back(&framebuf), 2);
+  framebuf_publish(&framebuf);
+  fill_frame(framebuf_back(&framebuf), 3);
+  framebuf_publish(&framebuf);
+  assert(frame_value(framebuf_take(&framebuf)) == 3);
+  assert(framebuf_take(&framebuf) == NULL);
+}
+
+/* The writer is told when the frame before the one it publishes was
+ * never taken */
+static void
+test_framebuf_publish_skipped()
+{
+  framebuf_init(&framebuf);
+  assert(framebuf_publish(&framebuf) == 0);
+  assert(framebuf_publish(&framebuf) == 1);
+  assert(framebuf_take(&framebuf) != NULL);
+  assert(framebuf_publish(&framebuf) == 0);
+}
+
+/* The writer must never be given the frame the reader holds */
+static void
+test_framebuf_back_not_taken_frame()
+{
+  Frame *taken;
+  int i;
+
+  framebuf_init(&framebuf);
+  fill_frame(framebuf_back(&framebuf), 1);
+  framebuf_publish(&framebuf);
+  taken = framebuf_take(&framebuf);
+  for (i = 0; i < 5; i++) {
+    assert(framebuf_back(&framebuf) != taken);
+    fill_frame(framebuf_back(&framebuf), 2);
+    framebuf_publish(&framebuf);
+  }
+  assert(frame_value(taken) == 1);
+}
+
+static void *
+stress_writer(void *arg)
+{
+  int i;
+
+  for (i = 1; i <= STRESS_FRAMES; i++) {
+    fill_frame(framebuf_back(&framebuf), i % 251);
+    framebuf_publish(&framebuf);
+  }
+  atomic_store(&writer_done, 1);
+  return NULL;
+}
+
+/* Every frame the reader takes must be whole, and the last one taken
+ * must be the last one published */
+static void
+test_framebuf_threads()
+{
+  pthread_t writer;
+  Frame *frame;
+  int done = 0, last_value = -1;
+
+  framebuf_init(&framebuf);
+  atomic_init(&writer_done, 0);
+  assert(pthread_create(&writer, NULL, stress_writer, NULL) == 0);
+  while (!done) {
+    done = atomic_load(&writer_done);
+    frame = framebuf_take(&framebuf);
+    if (!frame) continue;
+    last_value = frame_value(frame);
+    assert(last_value >= 0);
+  }
+  pthread_join(writer, NULL);
+  assert(last_value == STRESS_FRAMES % 251);
+}
+
+int main()
+{
+  test_framebuf_take_nothing_published();
+  test_framebuf_take_published();
+  test_framebuf_take_newest();
+  test_framebuf_publish_skipped();
+  test_framebuf_back_not_taken_frame();
+  test_framebuf_threads();
+  exit(0);
+}
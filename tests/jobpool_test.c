@@ -0,0 +1,116 @@
+/* Tests for the pool of threads used to run batches of jobs
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobpool.h"
+
+#define MAX_JOBS 1000
+
+static int job_runs[MAX_JOBS];
+static pthread_t job_threads[MAX_JOBS];
+
+/* Each job is only run once, so nothing else writes its entries */
+static void
+record_job(void *context, int job)
+{
+  job_runs[job]++;
+  job_threads[job] = pthread_self();
+}
+
+/* Job 0 is slow, so the jobs queued behind it have to be stolen */
+static void
+record_slow_first_job(void *context, int job)
+{
+  if (job == 0) usleep(200000);
+  record_job(context, job);
+}
+
+static void
+job_runs_init(void)
+{
+  memset(job_runs, 0, sizeof(job_runs));
+}
+
+static void
+assert_each_job_run_once(int num_jobs)
+{
+  int job;
+
+  for (job = 0; job < num_jobs; job++)
+    assert(job_runs[job] == 1);
+  for (job = num_jobs; job < MAX_JOBS; job++)
+    assert(job_runs[job] == 0);
+}
+
+static void
+test_jobpool_run_one_thread()
+{
+  job_runs_init();
+  assert(jobpool_run(100, 1, record_job, NULL) == 0);
+  assert_each_job_run_once(100);
+}
+
+static void
+test_jobpool_run_many_threads()
+{
+  job_runs_init();
+  assert(jobpool_run(MAX_JOBS, 8, record_job, NULL) == 0);
+  assert_each_job_run_once(MAX_JOBS);
+}
+
+static void
+test_jobpool_run_more_threads_than_jobs()
+{
+  job_runs_init();
+  assert(jobpool_run(3, 16, record_job, NULL) == 0);
+  assert_each_job_run_once(3);
+}
+
+static void
+test_jobpool_run_no_jobs()
+{
+  job_runs_init();
+  assert(jobpool_run(0, 4, record_job, NULL) == 0);
+  assert_each_job_run_once(0);
+}
+
+static void
+test_jobpool_steals_jobs()
+{
+  job_runs_init();
+  assert(jobpool_run(10, 2, record_slow_first_job, NULL) == 0);
+  assert_each_job_run_once(10);
+  /* Jobs 1 to 4 were queued behind job 0 but run by the other thread */
+  assert(!pthread_equal(job_threads[0], job_threads[4]));
+  assert(!pthread_equal(job_threads[0], job_threads[1]));
+}
+
+int main()
+{
+  test_jobpool_run_one_thread();
+  test_jobpool_run_many_threads();
+  test_jobpool_run_more_threads_than_jobs();
+  test_jobpool_run_no_jobs();
+  test_jobpool_steals_jobs();
+  exit(0);
+}
@@ -22,12 +22,14 @@
 
 #include "keyboard.h"
 
+static Keyboard keyboard;
+
 static void
 check_keyports(unsigned char *expected_keyports)
 {
   int i;
   for (i = 0; i < 8; i++) {
-    assert(keyboard_get_keyport(i) == expected_keyports[i]);
+    assert(keyboard_get_keyport(&keyboard, i) == expected_keyports[i]);
   }
 }
 
@@ -59,16 +61,32 @@ test_keyboard_clear()
     0xff, 0xff, 0xff, 0xff
   };
 
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress(XK_3, 0);
-  keyboard_keypress(XK_7, 0);
-  keyboard_keypress(XK_u, 0);
-  keyboard_keypress(XK_e, 0);
-  keyboard_keypress(XK_f, 0);
-  keyboard_keypress(XK_l, 0);
-  keyboard_keypress(XK_n, 0);
-  keyboard_keypress(XK_z, 0);
-  keyboard_clear();
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, XK_3, 0);
+  keyboard_keypress(&keyboard, XK_7, 0);
+  keyboard_keypress(&keyboard, XK_u, 0);
+  keyboard_keypress(&keyboard, XK_e, 0);
+  keyboard_keypress(&keyboard, XK_f, 0);
+  keyboard_keypress(&keyboard, XK_l, 0);
+  keyboard_keypress(&keyboard, XK_n, 0);
+  keyboard_keypress(&keyboard, XK_z, 0);
+  keyboard_clear(&keyboard);
+
+  check_keyports(expected_keyports);
+}
+
+static void
+test_keyboard_set_keyport()
+{
+  unsigned char expected_keyports[8] = {
+    0xff, 0xff, 0xfe, 0xff,
+    0xff, 0xff, 0xff, 0x7f
+  };
+
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_clear(&keyboard);
+  keyboard_set_keyport(&keyboard, 2, 0xfe);
+  keyboard_set_keyport(&keyboard, 7, 0x7f);
 
   check_keyports(expected_keyports);
 }
@@ -81,8 +99,8 @@ test_keyboard_keypress_single_key()
     0xff, 0xff, 0xff, 0xfe
   };
 
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress('\t', 0);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, '\t', 0);
   check_keyports(expected_keyports);
 }
 
@@ -94,12 +112,12 @@ test_keyboard_keypress_multiple_keys()
     0xf7, 0xf7, 0xff, 0xfb
   };
 
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress(XK_7, 0);
-  keyboard_keypress(XK_u, 0);
-  keyboard_keypress(XK_e, 0);
-  keyboard_keypress(XK_f, 0);
-  keyboard_keypress(XK_n, 0);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, XK_7, 0);
+  keyboard_keypress(&keyboard, XK_u, 0);
+  keyboard_keypress(&keyboard, XK_e, 0);
+  keyboard_keypress(&keyboard, XK_f, 0);
+  keyboard_keypress(&keyboard, XK_n, 0);
   check_keyports(expected_keyports);
 }
 
@@ -111,8 +129,8 @@ test_keyboard_keypress_symbol_on_physical_keyboard()
     0xff, 0xff, 0xff, 0xf7
   };
 
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress(XK_asterisk, 0);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, XK_asterisk, 0);
   check_keyports(expected_keyports);
 }
 
@@ -124,8 +142,8 @@ test_keyboard_keypress_key_not_found()
     0xff, 0xff, 0xff, 0xff
   };
 
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress(XK_Sys_Req, 0);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, XK_Sys_Req, 0);
   check_keyports(expected_keyports);
 }
 
@@ -138,8 +156,8 @@ test_keyboard_keypress_pass_to_non_ace_key_handler()
   };
 
   non_ace_key_handler_init();
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress(XK_A, 0);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, XK_A, 0);
   assert(non_ace_key_handler_status.handler_called);
   assert(non_ace_key_handler_status.keySym == XK_A);
   assert(non_ace_key_handler_status.key_state == 0);
@@ -156,8 +174,8 @@ test_keyboard_keypress_ignore_keyports_for_keys_pressed_with_control_key()
   };
 
   non_ace_key_handler_init();
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress(XK_A, ControlMask);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, XK_A, ControlMask);
   assert(non_ace_key_handler_status.handler_called);
   assert(non_ace_key_handler_status.keySym == XK_A);
   assert(non_ace_key_handler_status.key_state == ControlMask);
@@ -173,9 +191,9 @@ test_keyboard_keyrelease_from_single_key()
     0xff, 0xff, 0xff, 0xff
   };
 
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress(XK_A, 0);
-  keyboard_keyrelease(XK_A, 0);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, XK_A, 0);
+  keyboard_keyrelease(&keyboard, XK_A, 0);
   check_keyports(expected_keyports);
 }
 
@@ -187,10 +205,10 @@ test_keyboard_keyrelease_from_single_key_with_multiple_pressed()
     0xff, 0xff, 0xff, 0xfe
   };
 
-  keyboard_init(non_ace_key_handler);
-  keyboard_keypress(XK_A, 0);
-  keyboard_keypress(XK_Tab, 0);
-  keyboard_keyrelease(XK_A, 0);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keypress(&keyboard, XK_A, 0);
+  keyboard_keypress(&keyboard, XK_Tab, 0);
+  keyboard_keyrelease(&keyboard, XK_A, 0);
   check_keyports(expected_keyports);
 }
 
@@ -202,8 +220,8 @@ test_keyboard_keyrelease_ignore_keyports_for_keys_pressed_with_control_key()
     0xff, 0xff, 0xff, 0xff
   };
 
-  keyboard_init(non_ace_key_handler);
-  keyboard_keyrelease(XK_A, ControlMask);
+  keyboard_init(&keyboard, non_ace_key_handler);
+  keyboard_keyrelease(&keyboard, XK_A, ControlMask);
 
   check_keyports(expected_keyports);
 }
@@ -211,6 +229,7 @@ test_keyboard_keyrelease_ignore_keyports_for_keys_pressed_with_control_key()
 int main()
 {
   test_keyboard_clear();
+  test_keyboard_set_keyport();
   test_keyboard_keypress_single_key();
   test_keyboard_keypress_multiple_keys();
   test_keyboard_keypress_symbol_on_physical_keyboard();
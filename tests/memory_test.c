@@ -0,0 +1,133 @@
+/* Tests for the memory store macros
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "z80.h"
+
+static Ace machine;
+static Ace *ace = &machine;
+
+static void
+memory_init(void)
+{
+  int page;
+
+  memset(ace, 0, sizeof(Ace));
+  for (page = 0; page < 8; page++) {
+    ace->memptr[page] = ace->mem + page*0x2000;
+    ace->memattr[page] = MEM_RAM;
+  }
+  ace->memattr[0] = MEM_ROM;
+  ace->memattr[1] = MEM_MIRRORED;
+}
+
+static void
+test_store_rom_ignored()
+{
+  memory_init();
+  store(0x0100, 0x55);
+  assert(ace->mem[0x0100] == 0);
+  assert(!ace->display_dirty);
+}
+
+static void
+test_store_ram_not_dirty()
+{
+  memory_init();
+  store(0x4000, 0x55);
+  store2(0x8000, 0x1234);
+  assert(ace->mem[0x4000] == 0x55);
+  assert(ace->mem[0x8000] == 0x34 && ace->mem[0x8001] == 0x12);
+  assert(!ace->display_dirty);
+}
+
+static void
+test_store_video_ram_marks_cell()
+{
+  memory_init();
+  store(0x2400+5*32+7, 'A');
+  assert(ace->mem[0x2400+5*32+7] == 'A');
+  assert(ace->mem[0x2000+5*32+7] == 'A');
+  assert(ace->display_dirty);
+  assert(ace->dirty_cells[5] == 1UL<<7);
+  assert(ace->dirty_glyphs[0] == 0);
+}
+
+static void
+test_store_video_ram_mirror_marks_cell()
+{
+  memory_init();
+  store(0x2000+23*32+31, 'B');
+  assert(ace->mem[0x2400+23*32+31] == 'B');
+  assert(ace->dirty_cells[23] == 1UL<<31);
+}
+
+static void
+test_store_video_ram_beyond_screen_not_dirty()
+{
+  memory_init();
+  store(0x2700, 'C');
+  assert(!ace->display_dirty);
+}
+
+static void
+test_store_charset_marks_glyph()
+{
+  memory_init();
+  store(0x2c00+65*8+3, 0xff);
+  assert(ace->mem[0x2800+65*8+3] == 0xff);
+  assert(ace->display_dirty);
+  assert(ace->dirty_glyphs[2] == 1UL<<1);
+  store(0x2800+127*8, 0xff);
+  assert(ace->dirty_glyphs[3] == 1UL<<31);
+}
+
+static void
+test_store2_marks_both_cells()
+{
+  memory_init();
+  store2(0x2400+31, 0x4142);
+  assert(ace->mem[0x2400+31] == 0x42 && ace->mem[0x2400+32] == 0x41);
+  assert(ace->dirty_cells[0] == 1UL<<31);
+  assert(ace->dirty_cells[1] == 1UL);
+}
+
+static void
+test_store_ram_mirror_not_dirty()
+{
+  memory_init();
+  store(0x3c00, 0x77);
+  assert(ace->mem[0x3000] == 0x77);
+  assert(!ace->display_dirty);
+}
+
+int main()
+{
+  test_store_rom_ignored();
+  test_store_ram_not_dirty();
+  test_store_video_ram_marks_cell();
+  test_store_video_ram_mirror_marks_cell();
+  test_store_video_ram_beyond_screen_not_dirty();
+  test_store_charset_marks_glyph();
+  test_store2_marks_both_cells();
+  test_store_ram_mirror_not_dirty();
+  exit(0);
+}
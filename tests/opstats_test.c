@@ -0,0 +1,87 @@
+/* Tests for counting the Z80 instructions executed
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opstats.h"
+
+static OpStats stats;
+
+static void
+test_opstats_record()
+{
+  opstats_clear(&stats);
+  opstats_record(&stats, OPSTATS_MAIN*256+0x28, 12);
+  opstats_record(&stats, OPSTATS_MAIN*256+0x28, 7);
+  opstats_record(&stats, OPSTATS_ED*256+0xb0, 21);
+  assert(stats.count[0x28] == 2);
+  assert(stats.tstates[0x28] == 19);
+  assert(stats.count[OPSTATS_ED*256+0xb0] == 1);
+  assert(stats.tstates[OPSTATS_ED*256+0xb0] == 21);
+  assert(stats.histogram[7] == 1);
+  assert(stats.histogram[12] == 1);
+  assert(stats.histogram[21] == 1);
+}
+
+static void
+test_opstats_record_long_instruction()
+{
+  opstats_clear(&stats);
+  opstats_record(&stats, 0, OPSTATS_MAX_TSTATES+100);
+  assert(stats.histogram[OPSTATS_MAX_TSTATES-1] == 1);
+}
+
+/* The opcodes are listed by the T-states spent on them, most first */
+static void
+test_opstats_print()
+{
+  char report[8192];
+  char *ldir, *nop, *bit;
+  FILE *fp;
+
+  opstats_clear(&stats);
+  opstats_record(&stats, OPSTATS_MAIN*256+0x00, 4);
+  opstats_record(&stats, OPSTATS_ED*256+0xb0, 21);
+  opstats_record(&stats, OPSTATS_FDCB*256+0x46, 20);
+  stats.interrupts = 1;
+
+  fp = tmpfile();
+  assert(fp != NULL);
+  opstats_print(&stats, fp);
+  rewind(fp);
+  report[fread(report, 1, sizeof(report)-1, fp)] = 0;
+  fclose(fp);
+
+  ldir = strstr(report, "\ned b0 ");
+  bit = strstr(report, "\nfd cb 46 ");
+  nop = strstr(report, "\n00 ");
+  assert(ldir && bit && nop);
+  assert(ldir < bit && bit < nop);
+  assert(strstr(report, "Interrupts: 1, 3.0 instructions and 45.0 T-states"));
+}
+
+int main()
+{
+  test_opstats_record();
+  test_opstats_record_long_instruction();
+  test_opstats_print();
+  exit(0);
+}
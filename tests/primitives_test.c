@@ -0,0 +1,413 @@
+/* Tests that the primitives run natively match the ROM's own code
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ace.h"
+#include "primitives.h"
+
+/* Code field addresses of the words, including the unnamed one at the
+ * heart of U/MOD */
+#define UMUL       0x0ca8
+#define UDMOD      0x0cc4
+#define DPLUS      0x0dee
+#define PLUS       0x0dd2
+#define NEGATE     0x0da9
+#define DNEGATE    0x0dba
+#define SLASH_MOD  0x0d00
+#define STAR_SLASH_MOD 0x0d31
+#define SLASH      0x0d51
+#define MOD        0x0d61
+#define STAR       0x0d6d
+#define STAR_SLASH 0x0d7a
+#define U_SLASH_MOD 0x0d8c
+#define FPLUS      0x1bb1
+#define FMINUS     0x1ba4
+#define FSTAR      0x1c4b
+#define FSLASH     0x1c7b
+#define FNEGATE    0x1d0f
+#define INT        0x1d22
+#define UFLOAT     0x1d59
+
+#define DOCOLON 0x0ec3
+#define NEXT    0x04ba
+/* Where a primitive's jp (iy) goes to pop the IP and carry on */
+#define POP_IP_NEXT 0x04b9
+/* Where the ROM's errors go, with the error number after the rst */
+#define ERROR   0x0020
+#define FP_WORKSPACE 0x3c00
+#define FP_WORKSPACE_SIZE 0x14
+
+/* The word is run from a thread that then runs a word whose code is a
+ * jr to itself */
+#define STOP      0x8000
+#define STOP_CFA  0x8100
+#define THREAD    0x8200
+#define STACK_BOT 0x9000
+#define Z80_STACK 0xff00
+#define MAX_CELLS 8
+#define MAX_STEPS 2000
+#define NUM_RANDOM_FLOATS 3000
+
+#define NUM_EDGES (int)(sizeof(edges)/sizeof(edges[0]))
+
+static unsigned char rom[ACE_ROM_SIZE];
+static Ace *rom_ace, *native_ace;
+
+static const unsigned short edges[] = {
+  0x0000, 0x0001, 0x0002, 0x0003, 0x0007, 0x00ff, 0x0100, 0x1234,
+  0x7fff, 0x8000, 0x8001, 0xfff9, 0xfffe, 0xffff
+};
+
+static void
+load_rom(void)
+{
+  FILE *fp = fopen("../ace.rom", "rb");
+
+  assert(fp != NULL);
+  assert(fread(rom, 1, ACE_ROM_SIZE, fp) == ACE_ROM_SIZE);
+  fclose(fp);
+}
+
+static unsigned short
+peek2(Ace *ace, unsigned short addr)
+{
+  return ace->mem[addr] | (ace->mem[addr+1] << 8);
+}
+
+static void
+poke2(Ace *ace, unsigned short addr, unsigned short value)
+{
+  ace->mem[addr] = value & 0xff;
+  ace->mem[addr+1] = value >> 8;
+}
+
+/* Run the word with the given code field address on a data stack holding
+ * cells, the last on top, and leave its results on the stack.  Returns
+ * STOP, ERROR if the word gives an error, or where it was when it was
+ * given up on. */
+static unsigned short
+run_word(Ace *ace, unsigned short cfa, const unsigned short *cells,
+         int num_cells)
+{
+  unsigned char error_code[2];
+  int i;
+
+  memset(ace->mem+STACK_BOT, 0, MAX_CELLS*2);
+  for (i = 0; i < num_cells; i++)
+    poke2(ace, STACK_BOT+i*2, cells[i]);
+  poke2(ace, ACE_SPARE, STACK_BOT+num_cells*2);
+
+  ace->mem[STOP] = 0x18;
+  ace->mem[STOP+1] = 0xfe;
+  poke2(ace, STOP_CFA, STOP);
+  poke2(ace, THREAD, cfa);
+  poke2(ace, THREAD+2, STOP_CFA);
+  memcpy(error_code, ace->mem+ERROR, 2);
+  ace->mem[ERROR] = 0x18;
+  ace->mem[ERROR+1] = 0xfe;
+
+  ace->z80.h = THREAD >> 8;
+  ace->z80.l = THREAD & 0xff;
+  ace->z80.ix = FP_WORKSPACE;
+  ace->z80.iy = POP_IP_NEXT;
+  ace->z80.sp = Z80_STACK;
+  ace->z80.pc = NEXT;
+  ace->z80.iff1 = ace->z80.iff2 = 0;
+  ace->z80_state_changed = 1;
+  for (i = 0; i < MAX_STEPS && ace->z80.pc != STOP && ace->z80.pc != ERROR;
+       i++)
+    ace_step(ace, 100);
+  memcpy(ace->mem+ERROR, error_code, 2);
+  return ace->z80.pc;
+}
+
+/* What is left above the top of the stack can differ, as the ROM leaves
+ * behind the cells it works with */
+static void
+assert_same_stack()
+{
+  unsigned short top = peek2(rom_ace, ACE_SPARE);
+
+  assert(peek2(native_ace, ACE_SPARE) == top);
+  assert(memcmp(rom_ace->mem+STACK_BOT, native_ace->mem+STACK_BOT,
+                top-STACK_BOT) == 0);
+}
+
+static void
+assert_same(unsigned short cfa, const unsigned short *cells, int num_cells)
+{
+  assert(run_word(rom_ace, cfa, cells, num_cells) == STOP);
+  assert(run_word(native_ace, cfa, cells, num_cells) == STOP);
+  assert_same_stack();
+}
+
+/* The ROM's floating point workspace is compared too, as are errors and
+ * anything that doesn't finish */
+static void
+assert_same_floats(unsigned short cfa, const unsigned short *cells,
+                   int num_cells)
+{
+  unsigned short pc = run_word(rom_ace, cfa, cells, num_cells);
+
+  assert(run_word(native_ace, cfa, cells, num_cells) == pc);
+  if (pc == STOP) {
+    assert_same_stack();
+    assert(memcmp(rom_ace->mem+FP_WORKSPACE, native_ace->mem+FP_WORKSPACE,
+                  FP_WORKSPACE_SIZE) == 0);
+  } else if (pc == ERROR) {
+    assert(rom_ace->mem[peek2(rom_ace, rom_ace->z80.sp)] ==
+           native_ace->mem[peek2(native_ace, native_ace->z80.sp)]);
+  }
+}
+
+/* Every combination of the edge cases, then random cells */
+static void
+assert_same_for_cells(unsigned short cfa, int num_cells)
+{
+  unsigned short cells[MAX_CELLS];
+  int combinations = 1;
+  int i, j, k;
+
+  for (i = 0; i < num_cells; i++)
+    combinations *= NUM_EDGES;
+  for (i = 0; i < combinations; i++) {
+    for (j = 0, k = i; j < num_cells; j++, k /= NUM_EDGES)
+      cells[j] = edges[k % NUM_EDGES];
+    assert_same(cfa, cells, num_cells);
+  }
+  for (i = 0; i < 1000; i++) {
+    for (j = 0; j < num_cells; j++)
+      cells[j] = (rand() & 0xffff) >> (rand() & 15);
+    assert_same(cfa, cells, num_cells);
+  }
+}
+
+/* Mostly the digits that round and carry */
+static int
+random_digit()
+{
+  static const int digits[] = {0, 4, 5, 9};
+
+  return rand() % 2 ? rand() % 10 : digits[rand() % 4];
+}
+
+/* Two cells of a float, mostly normalised ones that are near enough to
+ * each other to be added without losing all the digits, but also 0,
+ * unnormalised floats, any exponent and anything at all */
+static void
+random_float(unsigned short *cells)
+{
+  unsigned char bytes[4];
+  int i;
+
+  switch (rand() % 8) {
+  case 0:
+    memset(bytes, 0, sizeof(bytes));
+    break;
+  case 1:
+    for (i = 0; i < 4; i++)
+      bytes[i] = rand() & 0xff;
+    break;
+  default:
+    for (i = 0; i < 3; i++)
+      bytes[i] = random_digit() << 4 | random_digit();
+    if (rand() % 8 && !(bytes[2] & 0xf0))
+      bytes[2] |= (rand() % 9 + 1) << 4;
+    bytes[3] = rand() % 4 ? 0x3c + rand() % 9 : rand() & 0x7f;
+    bytes[3] |= rand() & 0x80;
+  }
+  cells[0] = bytes[1] << 8 | bytes[0];
+  cells[1] = bytes[3] << 8 | bytes[2];
+}
+
+/* Whether the float's digits are all BCD, the top one not 0 */
+static int
+is_normalised(const unsigned short *cells)
+{
+  unsigned long mantissa = (unsigned long)(cells[1] & 0xff) << 16 | cells[0];
+  int i;
+
+  for (i = 0; i < 6; i++, mantissa >>= 4) {
+    if ((mantissa & 0x0f) > 9)
+      return 0;
+  }
+  return (cells[1] & 0x00f0) != 0;
+}
+
+static void
+test_primitives_patch()
+{
+  Ace *ace = ace_create(rom);
+
+  assert(ace);
+  primitives_patch(ace);
+  assert(peek2(ace, UMUL) == UMUL+2);
+  assert(ace->mem[UMUL+2] == 0xed && ace->mem[UMUL+3] == PRIMITIVES_TRAP);
+  assert(peek2(ace, SLASH_MOD) == SLASH_MOD+2);
+  assert(ace->mem[SLASH_MOD+2] == 0xed);
+  assert(ace->mem[peek2(ace, FPLUS)] == 0xed);
+  primitives_unpatch(ace);
+  assert(memcmp(ace->mem, rom_ace->mem, ACE_ROM_SIZE) == 0);
+  ace_destroy(ace);
+}
+
+/* A primitive part way through being run by the ROM is left alone */
+static void
+test_primitives_patch_part_way()
+{
+  Ace *ace = ace_create(rom);
+
+  assert(ace);
+  ace->z80.pc = UMUL+3;
+  ace->z80.sp = Z80_STACK;
+  poke2(ace, Z80_STACK+2, SLASH_MOD+4);
+  primitives_patch(ace);
+  assert(memcmp(ace->mem+UMUL, rom_ace->mem+UMUL, 5) == 0);
+  assert(memcmp(ace->mem+SLASH_MOD, rom_ace->mem+SLASH_MOD, 5) == 0);
+  assert(ace->mem[PLUS+2] == 0xed);
+  ace_destroy(ace);
+}
+
+/* Nothing is patched into a ROM other than the Ace's own */
+static void
+test_primitives_patch_other_rom()
+{
+  static unsigned char other_rom[ACE_ROM_SIZE];
+  unsigned char before[ACE_ROM_SIZE];
+  Ace *ace = ace_create(other_rom);
+
+  assert(ace);
+  memcpy(before, ace->mem, ACE_ROM_SIZE);
+  primitives_patch(ace);
+  assert(memcmp(ace->mem, before, ACE_ROM_SIZE) == 0);
+  ace_destroy(ace);
+}
+
+static void
+test_primitives_arithmetic()
+{
+  assert_same_for_cells(PLUS, 2);
+  assert_same_for_cells(DPLUS, 4);
+  assert_same_for_cells(NEGATE, 2);
+  assert_same_for_cells(DNEGATE, 2);
+  assert_same_for_cells(UMUL, 2);
+  assert_same_for_cells(STAR, 2);
+}
+
+/* Including dividing by 0 and quotients too big for a cell */
+static void
+test_primitives_division()
+{
+  assert_same_for_cells(UDMOD, 3);
+  assert_same_for_cells(U_SLASH_MOD, 3);
+  assert_same_for_cells(SLASH_MOD, 2);
+  assert_same_for_cells(SLASH, 2);
+  assert_same_for_cells(MOD, 2);
+  assert_same_for_cells(STAR_SLASH_MOD, 3);
+  assert_same_for_cells(STAR_SLASH, 3);
+}
+
+/* Including overflow, dividing by 0 and floats that aren't BCD, which are
+ * left to the ROM */
+static void
+test_primitives_floats()
+{
+  unsigned short cells[4];
+  int i;
+
+  for (i = 0; i < NUM_RANDOM_FLOATS; i++) {
+    random_float(cells);
+    random_float(cells+2);
+    assert_same_floats(FPLUS, cells, 4);
+    assert_same_floats(FMINUS, cells, 4);
+    assert_same_floats(FSTAR, cells, 4);
+    /* The ROM takes too long dividing by most other floats to try many,
+     * and they are left to it anyway */
+    if (is_normalised(cells+2) || !(cells[3] & 0x7f00))
+      assert_same_floats(FSLASH, cells, 4);
+    assert_same_floats(FNEGATE, cells, 2);
+    assert_same_floats(INT, cells, 2);
+  }
+}
+
+static void
+test_primitives_ufloat()
+{
+  unsigned short u;
+
+  for (u = 0; u < 0xffff; u++)
+    assert_same(UFLOAT, &u, 1);
+  assert_same(UFLOAT, &u, 1);
+}
+
+/* The trap anywhere else does nothing, as it does on a real Z80 */
+static void
+test_primitives_stray_trap()
+{
+  const unsigned char code[] = {0xed, PRIMITIVES_TRAP, 0x00, 0x18, 0xfe};
+  unsigned short routine;
+  int i;
+
+  memcpy(native_ace->mem+THREAD, code, sizeof(code));
+  assert(primitives_run(native_ace, THREAD, &routine) == PRIMITIVES_NO_TRAP);
+  poke2(native_ace, ACE_SPARE, STACK_BOT+4);
+  native_ace->z80.pc = THREAD;
+  native_ace->z80_state_changed = 1;
+  for (i = 0; i < 10 && native_ace->z80.pc != THREAD+3; i++)
+    ace_step(native_ace, 4);
+  assert(native_ace->z80.pc == THREAD+3);
+  assert(peek2(native_ace, ACE_SPARE) == STACK_BOT+4);
+}
+
+/* Switching back runs the ROM's code again */
+static void
+test_ace_set_native_primitives()
+{
+  ace_set_native_primitives(native_ace, 0);
+  assert(memcmp(native_ace->mem, rom_ace->mem, ACE_ROM_SIZE) == 0);
+  ace_set_native_primitives(native_ace, 1);
+  assert(peek2(native_ace, SLASH_MOD) != DOCOLON);
+}
+
+int main()
+{
+  load_rom();
+  rom_ace = ace_create(rom);
+  native_ace = ace_create(rom);
+  assert(rom_ace && native_ace);
+  ace_set_native_primitives(native_ace, 1);
+  srand(1);
+
+  test_primitives_patch();
+  test_primitives_patch_part_way();
+  test_primitives_patch_other_rom();
+  test_primitives_arithmetic();
+  test_primitives_division();
+  test_primitives_floats();
+  test_primitives_ufloat();
+  test_primitives_stray_trap();
+  test_ace_set_native_primitives();
+
+  ace_destroy(rom_ace);
+  ace_destroy(native_ace);
+  exit(0);
+}
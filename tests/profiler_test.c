@@ -0,0 +1,267 @@
+/* Tests for profiling the Forth words run by an Ace
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ace.h"
+#include "profiler.h"
+
+#define DOCOLON 0x0ec3
+#define LIT     0x1011
+#define EXIT    0x04b6
+
+/* The name length fields and bodies of the words put in the dictionary */
+#define FORTH_NLF 0x3c49
+#define FOO_NLF   0x3c58
+#define FOO_BODY  0x3c5b
+#define BAR_NLF   0x3c67
+#define BAR_BODY  0x3c6a
+#define DICT_END  0x3c70
+
+#define STACK_TOP 0x8000
+
+static unsigned char rom[ACE_ROM_SIZE];
+static char report[4096];
+
+static void
+poke2(Ace *ace, unsigned short addr, unsigned short value)
+{
+  ace->mem[addr] = value & 0xff;
+  ace->mem[addr+1] = value >> 8;
+}
+
+static void
+poke_name(Ace *ace, unsigned short addr, const char *name)
+{
+  int length = strlen(name);
+
+  memcpy(ace->mem+addr, name, length);
+  ace->mem[addr+length-1] |= 0x80;
+}
+
+/* A dictionary holding the FORTH vocabulary and
+ *   : FOO 1 ;
+ *   : BAR FOO FOO ;
+ * laid out as the ROM does, but with no ROM words */
+static Ace *
+create_ace_with_words(void)
+{
+  Ace *ace = ace_create(rom);
+
+  assert(ace);
+  poke_name(ace, 0x3c40, "FORTH");
+  poke2(ace, FORTH_NLF-4, 0x0c);
+  poke2(ace, FORTH_NLF-2, 0);
+  ace->mem[FORTH_NLF] = 5;
+  poke2(ace, FORTH_NLF+1, 0x11b5);
+  poke2(ace, FORTH_NLF+3, BAR_NLF);
+  ace->mem[FORTH_NLF+5] = 0;
+  poke2(ace, FORTH_NLF+6, 0);
+
+  poke_name(ace, FOO_NLF-7, "FOO");
+  poke2(ace, FOO_NLF-4, 0x0f);
+  poke2(ace, FOO_NLF-2, FORTH_NLF);
+  ace->mem[FOO_NLF] = 3;
+  poke2(ace, FOO_NLF+1, DOCOLON);
+  poke2(ace, FOO_BODY, LIT);
+  poke2(ace, FOO_BODY+2, 1);
+  poke2(ace, FOO_BODY+4, EXIT);
+
+  poke_name(ace, BAR_NLF-7, "BAR");
+  poke2(ace, BAR_NLF-4, 0);
+  poke2(ace, BAR_NLF-2, FOO_NLF);
+  ace->mem[BAR_NLF] = 3;
+  poke2(ace, BAR_NLF+1, DOCOLON);
+  poke2(ace, BAR_BODY, FOO_NLF+1);
+  poke2(ace, BAR_BODY+2, FOO_NLF+1);
+  poke2(ace, BAR_BODY+4, EXIT);
+
+  poke2(ace, ACE_RAMTOP, STACK_TOP);
+  poke2(ace, ACE_VOCLNK, FORTH_NLF+6);
+  poke2(ace, ACE_STKBOT, DICT_END);
+  poke2(ace, ACE_DICT, BAR_NLF-4);
+  memset(ace->mem+0x7000, 0, STACK_TOP-0x7000);
+  return ace;
+}
+
+/* Set the return stack to hold values, the first on top */
+static void
+set_return_stack(Ace *ace, const unsigned short *values, int num_values)
+{
+  int i;
+
+  ace->z80.sp = STACK_TOP - num_values*2;
+  for (i = 0; i < num_values; i++)
+    poke2(ace, ace->z80.sp + i*2, values[i]);
+}
+
+static void
+print_report(Profiler *profiler, int folded)
+{
+  FILE *fp = tmpfile();
+
+  assert(fp != NULL);
+  if (folded)
+    profiler_print_folded(profiler, fp);
+  else
+    profiler_print_flat(profiler, fp);
+  rewind(fp);
+  report[fread(report, 1, sizeof(report)-1, fp)] = 0;
+  fclose(fp);
+}
+
+/* BAR has called FOO, which is running (LIT).  The value between them
+ * could be a loop counter. */
+static void
+test_profiler_sample_stack()
+{
+  Ace *ace = create_ace_with_words();
+  Profiler *profiler = profiler_create(ace);
+  unsigned short stack[] = {FOO_BODY+2, 0x1234, BAR_BODY+2};
+
+  assert(profiler);
+  set_return_stack(ace, stack, 3);
+  profiler_sample(profiler);
+  profiler_sample(profiler);
+
+  print_report(profiler, 1);
+  assert(strcmp(report, "BAR;FOO;(LIT) 2\n") == 0);
+  print_report(profiler, 0);
+  assert(strstr(report, "2 samples"));
+  assert(strstr(report, "         2  100.00          2  100.00  (LIT)\n"));
+  assert(strstr(report, "         0    0.00          2  100.00  FOO\n"));
+  assert(strstr(report, "         0    0.00          2  100.00  BAR\n"));
+
+  profiler_destroy(profiler);
+  ace_destroy(ace);
+}
+
+static void
+test_profiler_sample_no_words()
+{
+  Ace *ace = create_ace_with_words();
+  Profiler *profiler = profiler_create(ace);
+  unsigned short stack[] = {0x1234, FOO_BODY+1};
+
+  set_return_stack(ace, stack, 2);
+  ace->z80.pc = 0x0100;
+  profiler_sample(profiler);
+
+  print_report(profiler, 1);
+  assert(strcmp(report, "(ROM code) 1\n") == 0);
+
+  profiler_destroy(profiler);
+  ace_destroy(ace);
+}
+
+/* The new word is found once the dictionary has changed */
+static void
+test_profiler_sample_new_word()
+{
+  Ace *ace = create_ace_with_words();
+  Profiler *profiler = profiler_create(ace);
+  unsigned short stack[] = {BAR_BODY+2};
+
+  set_return_stack(ace, stack, 1);
+  poke2(ace, FORTH_NLF+3, FOO_NLF);
+  poke2(ace, ACE_STKBOT, BAR_NLF-7);
+  poke2(ace, ACE_DICT, FOO_NLF-4);
+  profiler_sample(profiler);
+
+  poke2(ace, FORTH_NLF+3, BAR_NLF);
+  poke2(ace, ACE_STKBOT, DICT_END);
+  poke2(ace, ACE_DICT, BAR_NLF-4);
+  profiler_sample(profiler);
+
+  print_report(profiler, 1);
+  assert(strcmp(report, "(ROM code) 1\nBAR;FOO 1\n") == 0);
+
+  profiler_destroy(profiler);
+  ace_destroy(ace);
+}
+
+/* A word that has called itself only counts once in its total */
+static void
+test_profiler_sample_recursion()
+{
+  Ace *ace = create_ace_with_words();
+  Profiler *profiler = profiler_create(ace);
+  unsigned short stack[] = {FOO_BODY+2, BAR_BODY+2, BAR_BODY+4};
+
+  set_return_stack(ace, stack, 3);
+  profiler_sample(profiler);
+
+  print_report(profiler, 1);
+  assert(strcmp(report, "BAR;BAR;FOO;(LIT) 1\n") == 0);
+  print_report(profiler, 0);
+  assert(strstr(report, "         0    0.00          1  100.00  BAR\n"));
+
+  profiler_destroy(profiler);
+  ace_destroy(ace);
+}
+
+static void
+test_profiler_reset()
+{
+  Ace *ace = create_ace_with_words();
+  Profiler *profiler = profiler_create(ace);
+  unsigned short stack[] = {FOO_BODY+2, 0x1234, BAR_BODY+2};
+
+  set_return_stack(ace, stack, 3);
+  profiler_sample(profiler);
+  profiler_reset(profiler);
+  print_report(profiler, 1);
+  assert(strcmp(report, "") == 0);
+
+  profiler_sample(profiler);
+  print_report(profiler, 1);
+  assert(strcmp(report, "BAR;FOO;(LIT) 1\n") == 0);
+  print_report(profiler, 0);
+  assert(strstr(report, "1 samples"));
+
+  profiler_destroy(profiler);
+  ace_destroy(ace);
+}
+
+static void
+test_profiler_samples_while_running()
+{
+  Ace *ace = create_ace_with_words();
+  Profiler *profiler = profiler_create(ace);
+
+  ace_step(ace, PROFILER_PERIOD*10);
+  print_report(profiler, 0);
+  assert(strstr(report, "10 samples"));
+
+  profiler_destroy(profiler);
+  ace_destroy(ace);
+}
+
+int main()
+{
+  test_profiler_sample_stack();
+  test_profiler_sample_no_words();
+  test_profiler_sample_new_word();
+  test_profiler_sample_recursion();
+  test_profiler_reset();
+  test_profiler_samples_while_running();
+  exit(0);
+}
@@ -0,0 +1,212 @@
+/* Tests for the event scheduler
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+static Scheduler scheduler;
+static int event_a_count;
+static int event_b_count;
+
+/* Counts calls in the int pointed to by context */
+static void
+count_event(void *context)
+{
+  (*(int *)context)++;
+}
+
+static void
+event_counts_init(void)
+{
+  event_a_count = 0;
+  event_b_count = 0;
+}
+
+static void
+test_scheduler_init_no_deadline()
+{
+  scheduler_init(&scheduler);
+  assert(scheduler.deadline == ULLONG_MAX);
+}
+
+static void
+test_scheduler_add_event_sets_deadline()
+{
+  scheduler_init(&scheduler);
+  scheduler_add_event(&scheduler, 1000, 1000, count_event, &event_a_count);
+  assert(scheduler.deadline == 1000);
+  scheduler_add_event(&scheduler, 500, 0, count_event, &event_b_count);
+  assert(scheduler.deadline == 500);
+}
+
+static void
+test_scheduler_add_event_too_many()
+{
+  int i;
+
+  scheduler_init(&scheduler);
+  for (i = 0; i < SCHEDULER_MAX_EVENTS; i++) {
+    assert(scheduler_add_event(&scheduler, 100, 100,
+                               count_event, &event_a_count) == i);
+  }
+  assert(scheduler_add_event(&scheduler, 100, 100,
+                             count_event, &event_a_count) == -1);
+}
+
+static void
+test_scheduler_run_only_due_events()
+{
+  event_counts_init();
+  scheduler_init(&scheduler);
+  scheduler_add_event(&scheduler, 100, 100, count_event, &event_a_count);
+  scheduler_add_event(&scheduler, 250, 100, count_event, &event_b_count);
+
+  scheduler_run(&scheduler, 99);
+  assert(event_a_count == 0);
+  assert(event_b_count == 0);
+
+  scheduler_run(&scheduler, 100);
+  assert(event_a_count == 1);
+  assert(event_b_count == 0);
+  assert(scheduler.deadline == 200);
+
+  scheduler_run(&scheduler, 260);
+  assert(event_a_count == 2);
+  assert(event_b_count == 1);
+  assert(scheduler.deadline == 300);
+}
+
+static void
+test_scheduler_run_one_shot_event()
+{
+  event_counts_init();
+  scheduler_init(&scheduler);
+  scheduler_add_event(&scheduler, 100, 0, count_event, &event_a_count);
+
+  scheduler_run(&scheduler, 100);
+  scheduler_run(&scheduler, 200);
+  assert(event_a_count == 1);
+  assert(scheduler.deadline == ULLONG_MAX);
+}
+
+/* Events carry on past the 2^32 T-states a 32 bit count would wrap at */
+static void
+test_scheduler_run_past_32_bits()
+{
+  unsigned long long start = 0xffffff00ULL;
+
+  event_counts_init();
+  scheduler_init(&scheduler);
+  scheduler_add_event(&scheduler, start, 0x100, count_event, &event_a_count);
+
+  scheduler_run(&scheduler, start);
+  assert(event_a_count == 1);
+  assert(scheduler.deadline == 0x100000000ULL);
+  scheduler_run(&scheduler, 0x100000000ULL-1);
+  assert(event_a_count == 1);
+  scheduler_run(&scheduler, 0x100000000ULL);
+  assert(event_a_count == 2);
+  assert(scheduler.deadline == 0x100000100ULL);
+}
+
+static void
+test_scheduler_remove_event()
+{
+  int event_id;
+
+  event_counts_init();
+  scheduler_init(&scheduler);
+  event_id = scheduler_add_event(&scheduler, 100, 100,
+                                 count_event, &event_a_count);
+  scheduler_add_event(&scheduler, 150, 100, count_event, &event_b_count);
+  scheduler_remove_event(&scheduler, event_id);
+  assert(scheduler.deadline == 150);
+
+  scheduler_run(&scheduler, 200);
+  assert(event_a_count == 0);
+  assert(event_b_count == 1);
+}
+
+static void
+test_scheduler_set_period()
+{
+  int event_id;
+
+  event_counts_init();
+  scheduler_init(&scheduler);
+  event_id = scheduler_add_event(&scheduler, 100, 100,
+                                 count_event, &event_a_count);
+  scheduler_set_period(&scheduler, event_id, 400);
+
+  scheduler_run(&scheduler, 100);
+  assert(event_a_count == 1);
+  assert(scheduler.deadline == 500);
+}
+
+static void
+test_scheduler_realign()
+{
+  scheduler_init(&scheduler);
+  scheduler_add_event(&scheduler, 100, 100, count_event, &event_a_count);
+  scheduler_add_event(&scheduler, 400, 400, count_event, &event_b_count);
+
+  scheduler_realign(&scheduler, 1050);
+  assert(scheduler.events[0].due == 1100);
+  assert(scheduler.events[1].due == 1200);
+  assert(scheduler.deadline == 1100);
+
+  scheduler_realign(&scheduler, 1200);
+  assert(scheduler.events[0].due == 1300);
+  assert(scheduler.events[1].due == 1600);
+}
+
+static void
+test_scheduler_separate_schedulers()
+{
+  Scheduler other_scheduler;
+
+  event_counts_init();
+  scheduler_init(&scheduler);
+  scheduler_init(&other_scheduler);
+  scheduler_add_event(&scheduler, 100, 100, count_event, &event_a_count);
+  scheduler_add_event(&other_scheduler, 100, 100,
+                      count_event, &event_b_count);
+
+  scheduler_run(&scheduler, 100);
+  assert(event_a_count == 1);
+  assert(event_b_count == 0);
+  assert(other_scheduler.deadline == 100);
+}
+
+int main()
+{
+  test_scheduler_init_no_deadline();
+  test_scheduler_add_event_sets_deadline();
+  test_scheduler_add_event_too_many();
+  test_scheduler_run_only_due_events();
+  test_scheduler_run_one_shot_event();
+  test_scheduler_run_past_32_bits();
+  test_scheduler_remove_event();
+  test_scheduler_set_period();
+  test_scheduler_realign();
+  test_scheduler_separate_schedulers();
+  exit(0);
+}
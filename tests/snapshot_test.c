@@ -0,0 +1,142 @@
+/* Tests for saving and loading snapshots
+ *
+ * Copyright (C) 2012 Lawrence Woodman
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+static Snapshot saved, loaded;
+
+static void
+generate_snapshot(Snapshot *snapshot)
+{
+  int i;
+
+  memset(snapshot, 0, sizeof(Snapshot));
+  snapshot->z80.a = 0x12; snapshot->z80.f = 0x34;
+  snapshot->z80.b = 0x56; snapshot->z80.c = 0x78;
+  snapshot->z80.h1 = 0x9a; snapshot->z80.l1 = 0xbc;
+  snapshot->z80.i = 0x3c; snapshot->z80.r = 0x80;
+  snapshot->z80.iff1 = 1; snapshot->z80.iff2 = 1; snapshot->z80.im = 1;
+  snapshot->z80.intsample = 1; snapshot->z80.radjust = 0x45;
+  snapshot->z80.ix = 0x1234; snapshot->z80.iy = 0xfedc;
+  snapshot->z80.sp = 0x7ffe; snapshot->z80.pc = 0x0038;
+  snapshot->tstates = 0x123456789UL;
+  snapshot->interrupted = 1;
+  for (i = 0; i < 8; i++)
+    snapshot->keyboard_ports[i] = 0xff - i;
+  strcpy(snapshot->tape.filename, "fixtures/test.tap");
+  snapshot->tape.pos = 1234;
+  snapshot->tape.load_header = 0;
+  snapshot->tape.save_header = 1;
+  snapshot->tape.empty_tape_bytes = 1;
+
+  /* Runs, lone bytes and the run length marker in each */
+  for (i = 0; i < 65536; i++)
+    snapshot->mem[i] = (i < 8192) ? rand() : 0xff;
+  snapshot->mem[0x2000] = 0xed;
+  memset(snapshot->mem+0x2001, 0xed, 300);
+  snapshot->mem[0x3000] = 0xed;
+  snapshot->mem[0x3001] = 0x00;
+  snapshot->mem[0xffff] = 0xed;
+}
+
+static void
+test_snapshot_write_read()
+{
+  char *filename = tmpnam(NULL);
+
+  generate_snapshot(&saved);
+  assert(snapshot_write(filename, &saved) == 0);
+  assert(snapshot_read(filename, &loaded) == 0);
+  remove(filename);
+
+  assert(memcmp(&saved.z80, &loaded.z80, sizeof(Z80State)) == 0);
+  assert(loaded.tstates == saved.tstates);
+  assert(loaded.interrupted == saved.interrupted);
+  assert(memcmp(loaded.keyboard_ports, saved.keyboard_ports, 8) == 0);
+  assert(strcmp(loaded.tape.filename, saved.tape.filename) == 0);
+  assert(loaded.tape.pos == saved.tape.pos);
+  assert(loaded.tape.load_header == saved.tape.load_header);
+  assert(loaded.tape.save_header == saved.tape.save_header);
+  assert(loaded.tape.empty_tape_bytes == saved.tape.empty_tape_bytes);
+  assert(memcmp(loaded.mem, saved.mem, sizeof(saved.mem)) == 0);
+}
+
+static void
+test_snapshot_write_compresses_memory()
+{
+  char *filename = tmpnam(NULL);
+  FILE *fp;
+
+  generate_snapshot(&saved);
+  assert(snapshot_write(filename, &saved) == 0);
+  fp = fopen(filename, "rb");
+  fseek(fp, 0, SEEK_END);
+  assert(ftell(fp) < 8192+2048);
+  fclose(fp);
+  remove(filename);
+}
+
+static void
+test_snapshot_read_not_snapshot()
+{
+  assert(snapshot_read("fixtures/test.tap", &loaded) == 1);
+}
+
+static void
+test_snapshot_read_truncated()
+{
+  char *filename = tmpnam(NULL);
+  char *truncated_filename = tmpnam(NULL);
+  FILE *fp, *truncated_fp;
+  int c, size = 0;
+
+  generate_snapshot(&saved);
+  assert(snapshot_write(filename, &saved) == 0);
+
+  fp = fopen(filename, "rb");
+  truncated_fp = fopen(truncated_filename, "wb");
+  while ((c = fgetc(fp)) != EOF && size++ < 5000)
+    fputc(c, truncated_fp);
+  fclose(fp);
+  fclose(truncated_fp);
+
+  assert(snapshot_read(truncated_filename, &loaded) == 1);
+  remove(filename);
+  remove(truncated_filename);
+}
+
+static void
+test_snapshot_read_missing_file()
+{
+  assert(snapshot_read("fixtures/missing.snap", &loaded) == 1);
+}
+
+int main()
+{
+  test_snapshot_write_read();
+  test_snapshot_write_compresses_memory();
+  test_snapshot_read_not_snapshot();
+  test_snapshot_read_truncated();
+  test_snapshot_read_missing_file();
+  exit(0);
+}
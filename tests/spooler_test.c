@@ -23,6 +23,11 @@
 
 #include "spooler.h"
 
+static Spooler spooler;
+static SpoolerKeyState machine_key_state;
+static int machine_takes_lines;
+static char entered_line[SPOOLER_MAX_LINE+1];
+
 static struct {
   int observer_called;
   int clear_keyboard_called;
@@ -30,6 +35,7 @@ static struct {
   KeySym keypress_key;
   int keypress_key_state;
   SpoolerMessage message;
+  void *context;
 } observer_status;
 
 static void
@@ -41,29 +47,45 @@ observer_status_init(void)
   observer_status.keypress_key = 0;
   observer_status.keypress_key_state = 0;
   observer_status.message = SPOOLER_NO_MESSAGE;
+  observer_status.context = NULL;
 }
 
 static void
-spooler_observer(SpoolerMessage message)
+spooler_observer(void *context, SpoolerMessage message)
 {
   observer_status.observer_called = 1;
   observer_status.message = message;
+  observer_status.context = context;
 }
 
 static void
-clear_keyboard(void)
+clear_keyboard(void *context)
 {
   observer_status.clear_keyboard_called = 1;
 }
 
 static void
-keypress(KeySym ks, int key_state)
+keypress(void *context, KeySym ks, int key_state)
 {
   observer_status.keypress_called = 1;
   observer_status.keypress_key = ks;
   observer_status.keypress_key_state = key_state;
 }
 
+static SpoolerKeyState
+key_state(void *context)
+{
+  return machine_key_state;
+}
+
+static int
+enter_line(void *context, const char *line, int length)
+{
+  if (!machine_takes_lines) return -1;
+  memcpy(entered_line, line, length);
+  entered_line[length] = 0;
+  return 0;
+}
 
 static void
 test_spooler_open_successful()
@@ -71,14 +93,15 @@ test_spooler_open_successful()
   char *filename = "fixtures/star.spool";
 
   observer_status_init();
-  spooler_init(spooler_observer, clear_keyboard, NULL);
-  spooler_open(filename);
+  spooler_init(&spooler, spooler_observer, clear_keyboard, NULL, NULL,
+               NULL, NULL);
+  spooler_open(&spooler, filename);
 
   assert(observer_status.observer_called);
   assert(observer_status.message == SPOOLER_OPENED);
-  assert(spooler_active());
+  assert(spooler_active(&spooler));
 
-  spooler_close();
+  spooler_close(&spooler);
 }
 
 static void
@@ -87,12 +110,12 @@ test_spooler_open_unsuccessful()
   char *filename = tmpnam(NULL);
 
   observer_status_init();
-  spooler_init(spooler_observer, NULL, NULL);
-  spooler_open(filename);
+  spooler_init(&spooler, spooler_observer, NULL, NULL, NULL, NULL, NULL);
+  spooler_open(&spooler, filename);
 
   assert(observer_status.observer_called);
   assert(observer_status.message == SPOOLER_OPEN_ERROR);
-  assert(!spooler_active());
+  assert(!spooler_active(&spooler));
 }
 
 static void
@@ -101,14 +124,15 @@ test_spooler_close()
   char *filename = "fixtures/star.spool";
 
   observer_status_init();
-  spooler_init(spooler_observer, clear_keyboard, NULL);
-  spooler_open(filename);
-  spooler_close();
+  spooler_init(&spooler, spooler_observer, clear_keyboard, NULL, NULL,
+               NULL, NULL);
+  spooler_open(&spooler, filename);
+  spooler_close(&spooler);
 
   assert(observer_status.observer_called);
   assert(observer_status.clear_keyboard_called);
   assert(observer_status.message == SPOOLER_CLOSED);
-  assert(!spooler_active());
+  assert(!spooler_active(&spooler));
 }
 
 static void
@@ -118,25 +142,26 @@ test_spooler_read()
   char *filename = "fixtures/star.spool";
   char *comparison_text = ": star 42 emit ;\n";
 
-  spooler_init(spooler_observer, clear_keyboard, keypress);
-  spooler_open(filename);
+  spooler_init(&spooler, spooler_observer, clear_keyboard, keypress, NULL,
+               NULL, NULL);
+  spooler_open(&spooler, filename);
 
   for (text_pos = 0; text_pos < strlen(comparison_text); text_pos++) {
     /* Test key pressed */
     observer_status_init();
-    spooler_read();
+    spooler_read(&spooler);
     assert(observer_status.keypress_called);
     assert(observer_status.keypress_key == comparison_text[text_pos]);
     assert(observer_status.keypress_key_state == 0);
 
     /* Test key cleared */
     observer_status_init();
-    spooler_read();
+    spooler_read(&spooler);
     assert(observer_status.clear_keyboard_called);
   }
 
   observer_status_init();
-  spooler_read();
+  spooler_read(&spooler);
   assert(observer_status.observer_called);
   assert(observer_status.message == SPOOLER_CLOSED);
 }
@@ -148,24 +173,179 @@ test_spooler_read_after_close_no_action()
   char *filename = "fixtures/star.spool";
   char *comparison_text = ": star 42 emit ;\n";
 
-  spooler_init(spooler_observer, clear_keyboard, keypress);
-  spooler_open(filename);
+  spooler_init(&spooler, spooler_observer, clear_keyboard, keypress, NULL,
+               NULL, NULL);
+  spooler_open(&spooler, filename);
 
   for (text_pos = 0; text_pos < strlen(comparison_text); text_pos++) {
-    spooler_read();
-    spooler_read();
+    spooler_read(&spooler);
+    spooler_read(&spooler);
   }
 
-  spooler_read();
-  assert(!spooler_active());
+  spooler_read(&spooler);
+  assert(!spooler_active(&spooler));
 
-  spooler_read();
+  spooler_read(&spooler);
   observer_status_init();
   assert(!observer_status.observer_called);
   assert(!observer_status.keypress_called);
   assert(!observer_status.clear_keyboard_called);
 }
 
+static void
+test_spooler_passes_context()
+{
+  char *filename = "fixtures/star.spool";
+  int context;
+
+  observer_status_init();
+  spooler_init(&spooler, spooler_observer, clear_keyboard, keypress, NULL,
+               NULL, &context);
+  spooler_open(&spooler, filename);
+
+  assert(observer_status.context == &context);
+
+  spooler_close(&spooler);
+}
+
+static void
+test_spooler_read_fast()
+{
+  char *filename = "fixtures/star.spool";
+
+  spooler_init(&spooler, spooler_observer, clear_keyboard, keypress,
+               key_state, NULL, NULL);
+  spooler_set_mode(&spooler, SPOOLER_FAST_KEYS);
+  spooler_open(&spooler, filename);
+
+  /* Nothing is typed until the machine waits for a key */
+  observer_status_init();
+  machine_key_state = SPOOLER_KEY_BUSY;
+  spooler_read(&spooler);
+  assert(!observer_status.keypress_called);
+
+  machine_key_state = SPOOLER_KEY_WAITING;
+  spooler_read(&spooler);
+  assert(observer_status.keypress_called);
+  assert(observer_status.keypress_key == ':');
+
+  /* The key is held until the machine takes it */
+  observer_status_init();
+  machine_key_state = SPOOLER_KEY_HELD;
+  spooler_read(&spooler);
+  spooler_read(&spooler);
+  assert(!observer_status.clear_keyboard_called);
+  machine_key_state = SPOOLER_KEY_TAKEN;
+  spooler_read(&spooler);
+  assert(observer_status.clear_keyboard_called);
+  assert(!observer_status.keypress_called);
+
+  /* The next key waits for the machine to see the last let go */
+  spooler_read(&spooler);
+  assert(!observer_status.keypress_called);
+  machine_key_state = SPOOLER_KEY_WAITING;
+  spooler_read(&spooler);
+  assert(observer_status.keypress_called);
+  assert(observer_status.keypress_key == ' ');
+
+  spooler_close(&spooler);
+}
+
+/* A key the machine never sees is let go of after a while */
+static void
+test_spooler_read_fast_key_not_taken()
+{
+  char *filename = "fixtures/star.spool";
+  int i;
+
+  spooler_init(&spooler, spooler_observer, clear_keyboard, keypress,
+               key_state, NULL, NULL);
+  spooler_set_mode(&spooler, SPOOLER_FAST_KEYS);
+  spooler_open(&spooler, filename);
+
+  machine_key_state = SPOOLER_KEY_WAITING;
+  spooler_read(&spooler);
+  observer_status_init();
+  for (i = 0; i < 20 && !observer_status.clear_keyboard_called; i++)
+    spooler_read(&spooler);
+  assert(observer_status.clear_keyboard_called);
+
+  spooler_close(&spooler);
+}
+
+static void
+test_spooler_read_lines()
+{
+  char *filename = "fixtures/star.spool";
+
+  spooler_init(&spooler, spooler_observer, clear_keyboard, keypress,
+               key_state, enter_line, NULL);
+  spooler_set_mode(&spooler, SPOOLER_LINES);
+  spooler_open(&spooler, filename);
+
+  observer_status_init();
+  entered_line[0] = 0;
+  machine_takes_lines = 1;
+  machine_key_state = SPOOLER_KEY_BUSY;
+  spooler_read(&spooler);
+  assert(!entered_line[0]);
+  assert(!observer_status.keypress_called);
+
+  /* The line is entered and only the newline typed */
+  machine_key_state = SPOOLER_KEY_WAITING;
+  spooler_read(&spooler);
+  assert(strcmp(entered_line, ": star 42 emit ;") == 0);
+  assert(observer_status.keypress_called);
+  assert(observer_status.keypress_key == '\n');
+
+  machine_key_state = SPOOLER_KEY_TAKEN;
+  spooler_read(&spooler);
+  observer_status_init();
+  machine_key_state = SPOOLER_KEY_WAITING;
+  spooler_read(&spooler);
+  assert(observer_status.message == SPOOLER_CLOSED);
+}
+
+/* A line the machine can't take is typed instead */
+static void
+test_spooler_read_lines_typed()
+{
+  char *filename = "fixtures/star.spool";
+
+  spooler_init(&spooler, spooler_observer, clear_keyboard, keypress,
+               key_state, enter_line, NULL);
+  spooler_set_mode(&spooler, SPOOLER_LINES);
+  spooler_open(&spooler, filename);
+
+  observer_status_init();
+  machine_takes_lines = 0;
+  machine_key_state = SPOOLER_KEY_WAITING;
+  spooler_read(&spooler);
+  assert(observer_status.keypress_key == ':');
+
+  machine_key_state = SPOOLER_KEY_TAKEN;
+  spooler_read(&spooler);
+  machine_key_state = SPOOLER_KEY_WAITING;
+  spooler_read(&spooler);
+  assert(observer_status.keypress_key == ' ');
+
+  spooler_close(&spooler);
+}
+
+static void
+test_spooler_parse_mode()
+{
+  SpoolerMode mode;
+
+  assert(spooler_parse_mode("fast", &mode) == 0);
+  assert(mode == SPOOLER_FAST_KEYS);
+  assert(spooler_parse_mode("keys", &mode) == 0);
+  assert(mode == SPOOLER_KEYS);
+  assert(spooler_parse_mode("lines", &mode) == 0);
+  assert(mode == SPOOLER_LINES);
+  assert(spooler_parse_mode("slow", &mode) == -1);
+}
+
 int main()
 {
   test_spooler_open_successful();
@@ -173,5 +353,11 @@ int main()
   test_spooler_close();
   test_spooler_read();
   test_spooler_read_after_close_no_action();
+  test_spooler_passes_context();
+  test_spooler_read_fast();
+  test_spooler_read_fast_key_not_taken();
+  test_spooler_read_lines();
+  test_spooler_read_lines_typed();
+  test_spooler_parse_mode();
   exit(0);
 }
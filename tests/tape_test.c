@@ -21,9 +21,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "tape.h"
 
+static Tape tape;
+
 /* Generate a block of data to save and compare */
 static void
 generate_block(char *block, int num_bytes, int first_num)
@@ -60,6 +64,7 @@ block_correct(FILE *fp, unsigned char *expected_block, int num_bytes)
 
 static struct {
   int observer_called;
+  int error_count;
   int tape_attached;
   int tape_pos;
   char tape_filename[TAPE_MAX_FILENAME_SIZE];
@@ -71,6 +76,7 @@ static void
 observer_status_init(void)
 {
   observer_status.observer_called = 0;
+  observer_status.error_count = 0;
   observer_status.tape_attached = 0;
   observer_status.tape_pos = 0;
   observer_status.tape_filename[0] = 0;
@@ -84,6 +90,7 @@ observer(int tape_attached, int tape_pos,
  TapeMessageType message_type, const char message[TAPE_MAX_MESSAGE_SIZE])
 {
   observer_status.observer_called = 1;
+  if (message_type == TAPE_ERROR) observer_status.error_count++;
   observer_status.tape_attached = tape_attached;
   observer_status.tape_pos = tape_pos;
   observer_status.message_type = message_type;
@@ -99,18 +106,18 @@ test_tape_add_observer()
   char *filename = "fixtures/test.tap";
 
   observer_status_init();
-  tape_add_observer(observer);
+  tape_add_observer(&tape, observer);
 
-  tape_attach(filename);
+  tape_attach(&tape, filename);
   assert(observer_status.observer_called == 1);
   assert(observer_status.tape_attached == 1);
   assert(observer_status.tape_pos == 0);
   assert(strcmp(filename, observer_status.tape_filename) == 0);
   assert(observer_status.message_type == TAPE_MESSAGE);
   assert(strcmp(observer_status.message, "Tape image attached.") == 0);
-  tape_detach();
+  tape_detach(&tape);
 
-  tape_clear_observers();
+  tape_clear_observers(&tape);
 }
 
 static void
@@ -120,9 +127,9 @@ test_tape_attach_file_exists()
   char *filename = "fixtures/test.tap";  
 
   observer_status_init();
-  tape_add_observer(observer);
+  tape_add_observer(&tape, observer);
 
-  fp = tape_attach(filename);
+  fp = tape_attach(&tape, filename);
 
   assert(fp != NULL);
   assert(ftell(fp) == 0);
@@ -135,20 +142,35 @@ test_tape_attach_file_exists()
   assert(observer_status.message_type == TAPE_MESSAGE);
   assert(strcmp(observer_status.message, "Tape image attached.") == 0);
 
-  tape_detach();
-  tape_clear_observers();
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
 }
 
 static void
 test_tape_attach_file_doesnt_exist()
 {
   char *filename = tmpnam(NULL);  
-  FILE *fp = tape_attach(filename);
+  FILE *fp = tape_attach(&tape, filename);
 
   assert(fp != NULL);
   assert(ftell(fp) == 0);
   assert(fputc(65, fp) == 65);
-  tape_detach();
+  tape_detach(&tape);
+}
+
+static void
+test_tape_attach_read_only()
+{
+  char *filename = tmpnam(NULL);
+  FILE *fp;
+
+  assert(tape_attach_read_only(&tape, filename) == NULL);
+  assert((fp = fopen(filename, "rb")) == NULL);
+
+  assert(tape_attach_read_only(&tape, "fixtures/test.tap") != NULL);
+  assert(tape.read_only);
+  assert(tape.file_count == 2);
+  tape_detach(&tape);
 }
 
 static void
@@ -158,8 +180,8 @@ test_tape_attach_file_can_not_create()
   FILE *fp;
 
   observer_status_init();
-  tape_add_observer(observer);
-  fp = tape_attach(filename);
+  tape_add_observer(&tape, observer);
+  fp = tape_attach(&tape, filename);
 
   assert(fp == NULL);
   assert(observer_status.observer_called == 1);
@@ -169,8 +191,8 @@ test_tape_attach_file_can_not_create()
   assert(observer_status.message_type == TAPE_ERROR);
   assert(strcmp(observer_status.message, "Couldn't create file.") == 0);
 
-  tape_detach();
-  tape_clear_observers();
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
 }
 
 static void
@@ -179,9 +201,9 @@ test_tape_detach_notifies_observers()
   char *filename = "fixtures/test.tap";  
 
   observer_status_init();
-  tape_add_observer(observer);
-  tape_attach(filename);
-  tape_detach();
+  tape_add_observer(&tape, observer);
+  tape_attach(&tape, filename);
+  tape_detach(&tape);
 
   assert(observer_status.observer_called == 1);
   assert(observer_status.tape_attached == 0);
@@ -190,7 +212,7 @@ test_tape_detach_notifies_observers()
   assert(observer_status.message_type == TAPE_MESSAGE);
   assert(strcmp(observer_status.message, "Tape image detached.") == 0);
 
-  tape_clear_observers();
+  tape_clear_observers(&tape);
 }
 
 static void
@@ -201,14 +223,14 @@ test_tape_load_p_first_dict_on_tape()
   char *filename = "fixtures/test.tap";
   char *filename_on_tape = "test      ";
 
-  tape_attach(filename);
+  tape_attach(&tape, filename);
   mem[9985] = 0;
   strncpy(mem+9986, filename_on_tape, 10);
 
   observer_status_init();
-  tape_add_observer(observer);
+  tape_add_observer(&tape, observer);
 
-  tape_load_p(mem, 10);
+  tape_load_p(&tape, mem, 10);
   /* Check correct name is in memory */
   assert(memcmp(mem+10+1, mem+9986, 10) == 0);
 
@@ -219,7 +241,7 @@ test_tape_load_p_first_dict_on_tape()
   assert(observer_status.message_type == TAPE_MESSAGE);
   assert(strcmp(observer_status.message, "Found file: test") == 0);
 
-  tape_load_p(mem, 10000);
+  tape_load_p(&tape, mem, 10000);
   /* Check data block is loaded */
   assert(mem[10000] == 0x54);
   assert(mem[10001] == 0x45);
@@ -234,8 +256,8 @@ test_tape_load_p_first_dict_on_tape()
   assert(observer_status.message_type == TAPE_MESSAGE);
   assert(strcmp(observer_status.message, "Load complete.") == 0);
 
-  tape_detach();
-  tape_clear_observers();
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
 }
 
 static void
@@ -246,25 +268,15 @@ test_tape_load_p_second_dict_on_tape()
   char *filename = "fixtures/test.tap";
   char *filename_on_tape = "test2     ";
 
-  tape_attach(filename);
+  tape_attach(&tape, filename);
   observer_status_init();
-  tape_add_observer(observer);
+  tape_add_observer(&tape, observer);
 
   mem[9985] = 0;
   strncpy(mem+9986, filename_on_tape, 10);
 
-  /* Skip first dictionary */
-  tape_load_p(mem, 10);
-
-  assert(observer_status.observer_called == 1);
-  assert(observer_status.tape_attached == 1);
-  assert(observer_status.tape_pos == 62);
-  assert(strcmp(observer_status.tape_filename, filename) == 0);
-  assert(observer_status.message_type == TAPE_MESSAGE);
-  assert(strcmp(observer_status.message, "Skipping file: test") == 0);
-
-  /* Load the header block */
-  tape_load_p(mem, 10);
+  /* Load the header block, going straight past the first dictionary */
+  tape_load_p(&tape, mem, 10);
   /* Check correct name is in memory */
   assert(memcmp(mem+10+1, mem+9986, 10) == 0);
 
@@ -276,7 +288,7 @@ test_tape_load_p_second_dict_on_tape()
   assert(strcmp(observer_status.message, "Found file: test2") == 0);
 
   /* Load the data block */
-  tape_load_p(mem, 10000);
+  tape_load_p(&tape, mem, 10000);
   /* Check data block is loaded */
   assert(mem[10000] == 0x54);
   assert(mem[10001] == 0x45);
@@ -291,8 +303,138 @@ test_tape_load_p_second_dict_on_tape()
   assert(observer_status.message_type == TAPE_MESSAGE);
   assert(strcmp(observer_status.message, "Load complete.") == 0);
 
-  tape_detach();
-  tape_clear_observers();
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
+}
+
+/* A file that isn't on the tape is searched for block by block */
+static void
+test_tape_load_p_dict_not_on_tape()
+{
+  unsigned char mem[65536];
+  char *filename = "fixtures/test.tap";
+  char *filename_on_tape = "missing   ";
+
+  tape_attach(&tape, filename);
+  observer_status_init();
+  tape_add_observer(&tape, observer);
+
+  mem[9985] = 0;
+  strncpy(mem+9986, filename_on_tape, 10);
+
+  tape_load_p(&tape, mem, 10);
+  assert(observer_status.tape_pos == 62);
+  assert(strcmp(observer_status.message, "Skipping file: test") == 0);
+  tape_load_p(&tape, mem, 10);
+  assert(observer_status.tape_pos == 125);
+  assert(strcmp(observer_status.message, "Skipping file: test2") == 0);
+
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
+}
+
+/* A dictionary and bytes file of the same name are told apart by type */
+static void
+test_tape_load_p_matches_type()
+{
+  char *filename = tmpnam(NULL);
+  unsigned char mem[65536];
+
+  mem[0] = 0;
+  strncpy(mem+1, "same      ", 10);
+  generate_block(mem+11, 14, 1);
+  generate_block(mem+50, 30, 6);
+  mem[100] = ' ';
+  strncpy(mem+101, "same      ", 10);
+  generate_block(mem+111, 14, 2);
+  generate_block(mem+150, 40, 9);
+  tape_attach(&tape, filename);
+  tape_save_p(&tape, mem, 25);
+  tape_save_p(&tape, mem+50, 30);
+  tape_save_p(&tape, mem+100, 25);
+  tape_save_p(&tape, mem+150, 40);
+
+  observer_status_init();
+  tape_add_observer(&tape, observer);
+
+  mem[9985] = ' ';
+  strncpy(mem+9986, "same      ", 10);
+  tape_load_p(&tape, mem, 1000);
+  assert(memcmp(mem+1000, mem+100, 24) == 0);
+  assert(strcmp(observer_status.message, "Found file: same") == 0);
+  tape_load_p(&tape, mem, 2000);
+  assert(memcmp(mem+2000, mem+150, 39) == 0);
+
+  mem[9985] = 0;
+  tape_load_p(&tape, mem, 1000);
+  assert(memcmp(mem+1000, mem, 24) == 0);
+  assert(strcmp(observer_status.message, "Found file: same") == 0);
+  tape_load_p(&tape, mem, 2000);
+  assert(memcmp(mem+2000, mem+50, 29) == 0);
+
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
+  remove(filename);
+}
+
+/* A tape cut short while attached is found again before loading */
+static void
+test_tape_load_p_after_truncate()
+{
+  char *filename = tmpnam(NULL);
+  unsigned char mem[65536];
+  unsigned char image[125];
+  FILE *fp;
+
+  fp = fopen("fixtures/test.tap", "rb");
+  assert(fp != NULL);
+  assert(fread(image, 1, sizeof(image), fp) == sizeof(image));
+  fclose(fp);
+  fp = fopen(filename, "wb");
+  assert(fp != NULL);
+  fwrite(image, 1, sizeof(image), fp);
+  fclose(fp);
+
+  tape_attach(&tape, filename);
+  assert(tape.file_count == 2);
+  assert(truncate(filename, 62) == 0);
+
+  observer_status_init();
+  tape_add_observer(&tape, observer);
+  mem[9985] = 0;
+  strncpy(mem+9986, "test2     ", 10);
+  tape_load_p(&tape, mem, 10);
+  assert(tape.file_count == 1);
+  assert(observer_status.tape_pos == 62);
+  assert(strcmp(observer_status.message, "Skipping file: test") == 0);
+
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
+  remove(filename);
+}
+
+static void
+test_tape_index()
+{
+  char *filename = "fixtures/test.tap";
+
+  tape_attach(&tape, filename);
+
+  assert(tape.file_count == 2);
+  assert(strcmp(tape.files[0].filename, "test") == 0);
+  assert(tape.files[0].type == 0);
+  assert(tape.files[0].header_pos == 0);
+  assert(tape.files[0].data_pos == 28);
+  assert(tape.files[0].length == 31);
+  assert(tape.files[0].checksum_ok);
+  assert(strcmp(tape.files[1].filename, "test2") == 0);
+  assert(tape.files[1].header_pos == 62);
+  assert(tape.files[1].data_pos == 90);
+  assert(tape.files[1].length == 32);
+  assert(tape.files[1].checksum_ok);
+
+  tape_detach(&tape);
+  assert(tape.file_count == 0);
 }
 
 static void
@@ -306,13 +448,13 @@ test_tape_save_p()
   generate_block(mem, 25, 'A');
   generate_block(mem+50, 300, 6);
  
-  tape_attach(filename);
+  tape_attach(&tape, filename);
 
   /* Save the blocks */
   observer_status_init();
-  tape_add_observer(observer);
+  tape_add_observer(&tape, observer);
 
-  tape_save_p(mem, 25);
+  tape_save_p(&tape, mem, 25);
   assert(observer_status.observer_called == 1);
   assert(observer_status.tape_attached == 1);
   assert(observer_status.tape_pos == 28);
@@ -320,7 +462,7 @@ test_tape_save_p()
   assert(observer_status.message_type == TAPE_MESSAGE);
   assert(strcmp(observer_status.message, "Saving to file: BCDEFGHIJK") == 0);
 
-  tape_save_p(mem+50, 300);
+  tape_save_p(&tape, mem+50, 300);
   assert(observer_status.observer_called == 1);
   assert(observer_status.tape_attached == 1);
   assert(observer_status.tape_pos == 331);
@@ -328,8 +470,8 @@ test_tape_save_p()
   assert(observer_status.message_type == TAPE_MESSAGE);
   assert(strcmp(observer_status.message, "Save complete.") == 0);
 
-  tape_detach();
-  tape_clear_observers();
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
 
   /* Check the header and data blocks */
   fp = fopen(filename, "rb");
@@ -351,30 +493,31 @@ test_tape_save_p_truncate()
   int i;
 
   /* Save 3 lots of header and data blocks */
-  tape_attach(filename);
+  tape_attach(&tape, filename);
   for (i = 0; i < 3; i++) {
     generate_block(mem+(100*i), 25+i, 'A'+i);
     generate_block(mem+(100*i)+50, 30+i, 6+i);
-    tape_save_p(mem+(100*i), 25+i);
-    tape_save_p(mem+(100*i)+50, 30+i);
+    tape_save_p(&tape, mem+(100*i), 25+i);
+    tape_save_p(&tape, mem+(100*i)+50, 30+i);
   }
-  tape_detach();
+  tape_detach(&tape);
 
-  tape_attach(filename);
+  tape_attach(&tape, filename);
 
   /* Load first header and data blocks */
+  mem[9985] = mem[0];
   for(i = 0; i < 10; i++) {
     mem[9986+i] = mem[100+i];
   }
-  tape_load_p(mem, 1000);
-  tape_load_p(mem, 1150);
+  tape_load_p(&tape, mem, 1000);
+  tape_load_p(&tape, mem, 1150);
 
   /* Save 1 set of header and data blocks after the first 2 blocks */
   generate_block(mem+2000, 28, 'N');
   generate_block(mem+2050, 40, 20);
-  tape_save_p(mem+2000, 28);
-  tape_save_p(mem+2050, 20);
-  tape_detach();
+  tape_save_p(&tape, mem+2000, 28);
+  tape_save_p(&tape, mem+2050, 20);
+  tape_detach(&tape);
 
   /* Check that tape only contains first header and data blocks followed by
    * the last saved header and data blocks */
@@ -391,16 +534,315 @@ test_tape_save_p_truncate()
   fclose(fp);
 }
 
+/* Tests that nothing is written until the data block follows the header */
+static void
+test_tape_save_p_header_waits_for_data()
+{
+  char *filename = tmpnam(NULL);
+  FILE *fp;
+  unsigned char mem[65536];
+
+  generate_block(mem, 25, 'A');
+  generate_block(mem+50, 30, 6);
+  tape_attach(&tape, filename);
+
+  tape_save_p(&tape, mem, 25);
+  fp = fopen(filename, "rb");
+  assert(fp != NULL);
+  assert(fgetc(fp) == EOF);
+  fclose(fp);
+
+  tape_save_p(&tape, mem+50, 30);
+  fp = fopen(filename, "rb");
+  assert(fp != NULL);
+  assert(block_correct(fp, mem, 25));
+  assert(block_correct(fp, mem+50, 30));
+  assert(fgetc(fp) == EOF);
+  fclose(fp);
+
+  tape_detach(&tape);
+}
+
+/* Tests that a file saved after another is added to the same tape image,
+ * rather than the image being written out again */
+static void
+test_tape_save_p_appends_in_place()
+{
+  char *filename = tmpnam(NULL);
+  struct stat before, after;
+  FILE *fp;
+  unsigned char mem[65536];
+
+  generate_block(mem, 25, 'A');
+  generate_block(mem+50, 30, 6);
+  generate_block(mem+100, 25, 'a');
+  generate_block(mem+150, 40, 9);
+  tape_attach(&tape, filename);
+  tape_save_p(&tape, mem, 25);
+  tape_save_p(&tape, mem+50, 30);
+  assert(stat(filename, &before) == 0);
+  fp = fopen(filename, "rb");
+  assert(fp != NULL);
+
+  tape_save_p(&tape, mem+100, 25);
+  tape_save_p(&tape, mem+150, 40);
+  assert(stat(filename, &after) == 0);
+  assert(after.st_ino == before.st_ino);
+  assert(after.st_size == before.st_size+28+43);
+
+  /* The file opened before the second save sees it */
+  assert(block_correct(fp, mem, 25));
+  assert(block_correct(fp, mem+50, 30));
+  assert(block_correct(fp, mem+100, 25));
+  assert(block_correct(fp, mem+150, 40));
+  assert(fgetc(fp) == EOF);
+  fclose(fp);
+
+  tape_detach(&tape);
+  remove(filename);
+}
+
+/* Tests that safe_saves replaces the tape image with a new one */
+static void
+test_tape_save_p_safe_saves()
+{
+  char *filename = tmpnam(NULL);
+  struct stat before, after;
+  FILE *fp;
+  unsigned char mem[65536];
+
+  generate_block(mem, 25, 'A');
+  generate_block(mem+50, 30, 6);
+  generate_block(mem+100, 25, 'a');
+  generate_block(mem+150, 40, 9);
+  tape_attach(&tape, filename);
+  tape.safe_saves = 1;
+  tape_save_p(&tape, mem, 25);
+  tape_save_p(&tape, mem+50, 30);
+  assert(stat(filename, &before) == 0);
+  tape_save_p(&tape, mem+100, 25);
+  tape_save_p(&tape, mem+150, 40);
+  assert(stat(filename, &after) == 0);
+  assert(after.st_ino != before.st_ino);
+  tape_detach(&tape);
+  tape.safe_saves = 0;
+
+  fp = fopen(filename, "rb");
+  assert(fp != NULL);
+  assert(block_correct(fp, mem, 25));
+  assert(block_correct(fp, mem+50, 30));
+  assert(block_correct(fp, mem+100, 25));
+  assert(block_correct(fp, mem+150, 40));
+  assert(fgetc(fp) == EOF);
+  fclose(fp);
+  remove(filename);
+}
+
+/* Tests that with safe_saves a tape reached through a symlink is still
+ * saved to in place */
+static void
+test_tape_save_p_through_symlink()
+{
+  char target[L_tmpnam], link[L_tmpnam];
+  struct stat st;
+  FILE *fp;
+  unsigned char mem[65536];
+
+  tmpnam(target);
+  tmpnam(link);
+  fp = fopen(target, "wb");
+  assert(fp != NULL);
+  fclose(fp);
+  assert(symlink(target, link) == 0);
+
+  generate_block(mem, 25, 'A');
+  generate_block(mem+50, 30, 6);
+  tape_attach(&tape, link);
+  tape.safe_saves = 1;
+  tape_save_p(&tape, mem, 25);
+  tape_save_p(&tape, mem+50, 30);
+  tape_detach(&tape);
+  tape.safe_saves = 0;
+
+  assert(lstat(link, &st) == 0 && S_ISLNK(st.st_mode));
+  fp = fopen(target, "rb");
+  assert(fp != NULL);
+  assert(block_correct(fp, mem, 25));
+  assert(block_correct(fp, mem+50, 30));
+  assert(fgetc(fp) == EOF);
+  fclose(fp);
+
+  remove(link);
+  remove(target);
+}
+
+/* Tests that blocks saved can be loaded without reattaching the tape */
+static void
+test_tape_load_p_after_save()
+{
+  char *filename = tmpnam(NULL);
+  unsigned char mem[65536];
+
+  generate_block(mem, 25, 'A');
+  generate_block(mem+50, 300, 6);
+  tape_attach(&tape, filename);
+  tape_save_p(&tape, mem, 25);
+  tape_save_p(&tape, mem+50, 300);
+
+  observer_status_init();
+  tape_add_observer(&tape, observer);
+
+  /* The end of the tape has been reached, so it is rewound */
+  mem[9985] = mem[0];
+  memcpy(mem+9986, mem+1, 10);
+  tape_load_p(&tape, mem, 1000);
+  assert(memcmp(mem+1000, mem, 24) == 0);
+  assert(observer_status.tape_pos == 28);
+  assert(strcmp(observer_status.message, "Found file: BCDEFGHIJK") == 0);
+
+  tape_load_p(&tape, mem, 2000);
+  assert(memcmp(mem+2000, mem+50, 299) == 0);
+  assert(observer_status.tape_pos == 331);
+  assert(strcmp(observer_status.message, "Load complete.") == 0);
+
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
+}
+
+/* Copy fixtures/test.tap to a new file, changing a byte of the second
+ * file's data block */
+static char *
+make_corrupt_tape(void)
+{
+  char *filename = tmpnam(NULL);
+  FILE *in = fopen("fixtures/test.tap", "rb");
+  FILE *out = fopen(filename, "wb");
+  int c, pos = 0;
+
+  assert(in != NULL && out != NULL);
+  while ((c = fgetc(in)) != EOF) {
+    fputc(pos++ == 100 ? c^1 : c, out);
+  }
+  fclose(in);
+  fclose(out);
+  return filename;
+}
+
+static void
+test_tape_load_p_bad_checksum()
+{
+  unsigned char mem[65536];
+  char *filename = make_corrupt_tape();
+
+  tape_attach(&tape, filename);
+  observer_status_init();
+  tape_add_observer(&tape, observer);
+
+  mem[9985] = 0;
+  strncpy(mem+9986, "test2     ", 10);
+  tape_load_p(&tape, mem, 10);
+  assert(observer_status.error_count == 0);
+  tape_load_p(&tape, mem, 10000);
+  assert(observer_status.error_count == 1);
+  /* The block is loaded anyway */
+  assert(strcmp(observer_status.message, "Load complete.") == 0);
+
+  tape_detach(&tape);
+  tape_clear_observers(&tape);
+  remove(filename);
+}
+
+static void
+test_tape_count_bad_files()
+{
+  char *filename = make_corrupt_tape();
+
+  tape_attach(&tape, "fixtures/test.tap");
+  assert(tape_count_bad_files(&tape) == 0);
+  tape_detach(&tape);
+
+  tape_attach(&tape, filename);
+  assert(tape.files[0].checksum_ok);
+  assert(!tape.files[1].checksum_ok);
+  assert(tape_count_bad_files(&tape) == 1);
+  tape_detach(&tape);
+  remove(filename);
+}
+
+static void
+test_tape_set_state()
+{
+  char *filename = "fixtures/test.tap";
+  TapeState state;
+
+  tape_attach(&tape, filename);
+  tape_get_state(&tape, &state);
+  assert(strcmp(state.filename, filename) == 0);
+  assert(state.pos == 0);
+  assert(state.load_header == 1);
+  tape_detach(&tape);
+
+  state.pos = 27;
+  state.load_header = 0;
+  tape_set_state(&tape, &state);
+  tape_get_state(&tape, &state);
+  assert(strcmp(state.filename, filename) == 0);
+  assert(state.pos == 27);
+  assert(state.load_header == 0);
+
+  state.filename[0] = 0;
+  state.pos = 0;
+  state.load_header = 1;
+  tape_set_state(&tape, &state);
+  tape_get_state(&tape, &state);
+  assert(state.filename[0] == 0);
+  assert(state.load_header == 1);
+}
+
+/* A tape image that has gone isn't made again, and the tape attached is
+ * kept */
+static void
+test_tape_set_state_missing_file()
+{
+  char *filename = tmpnam(NULL);
+  TapeState state;
+  FILE *fp;
+
+  tape_attach(&tape, "fixtures/test.tap");
+  tape_get_state(&tape, &state);
+  strncpy(state.filename, filename, TAPE_MAX_FILENAME_SIZE);
+  assert(tape_set_state(&tape, &state) == -1);
+  assert((fp = fopen(filename, "rb")) == NULL);
+  assert(strcmp(tape.filename, "fixtures/test.tap") == 0);
+  assert(tape.file_count == 2);
+  tape_detach(&tape);
+}
+
 int main()
 {
+  tape_init(&tape);
   test_tape_add_observer();
   test_tape_attach_file_exists();  
   test_tape_attach_file_doesnt_exist();
   test_tape_attach_file_can_not_create();
+  test_tape_attach_read_only();
   test_tape_detach_notifies_observers();
   test_tape_load_p_first_dict_on_tape();
   test_tape_load_p_second_dict_on_tape();
+  test_tape_load_p_dict_not_on_tape();
+  test_tape_load_p_matches_type();
+  test_tape_load_p_after_truncate();
+  test_tape_index();
   test_tape_save_p();
   test_tape_save_p_truncate();
+  test_tape_save_p_header_waits_for_data();
+  test_tape_save_p_appends_in_place();
+  test_tape_save_p_safe_saves();
+  test_tape_save_p_through_symlink();
+  test_tape_load_p_after_save();
+  test_tape_load_p_bad_checksum();
+  test_tape_count_bad_files();
+  test_tape_set_state();
+  test_tape_set_state_missing_file();
   exit(0);
 }